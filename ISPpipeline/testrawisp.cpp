@@ -74,7 +74,7 @@ int main(int argc, char *argv[])
 	RAWProcessFlow = new CHDRPlus_Forward;
 	TimerStatistics::stop("WTAlgo_ToolsInit ");
 	LoadMetaDataTxtFile(argv[1]);
-	MultiUshortImage InRawImage[10], OutRGBImage16;
+	MultiUshortImage InRawImage[12], OutRGBImage16;
 	MultiUcharImage OutRGBImage8;
 	TGlobalControl tControl;
 	tControl.nBLC = m_blc;
@@ -93,11 +93,6 @@ int main(int argc, char *argv[])
 			tControl.nCCM[n][m] = m_f[n][m];
 		}
 	}
-	for (int k = 0; k < tControl.nFrameNum; k++)
-	{
-		printf("%s\n", argv[2 + k]);
-		InRawImage[k].Load16BitRawDataFromBinFile(argv[2 + k], m_nWidth, m_nHeight, m_nBits, m_bHighBits, m_bByteOrder, m_nMIPIRAW);
-	}
 	CHDRPlus_Forward m_HDRPlus_Forward;
 	if (!m_HDRPlus_Forward.LoadMultiConfigFile("./config/weight.param"))
 	{
@@ -105,7 +100,48 @@ int main(int argc, char *argv[])
 		m_HDRPlus_Forward.SaveMultiConfigFile("default.param");
 		exit(1);
 	}
-	m_HDRPlus_Forward.Forward(InRawImage, &OutRGBImage8, &tControl);
+	// 整个burst在一个并行域内:本线程逐帧读入并PushFrame,每帧的金字塔/对齐作为任务交给其它线程,
+	// 读下一帧时前面各帧的对齐仍在进行;每帧一个读入缓冲,保留到Finish,PushFrame直接引用不拷贝,并行域结束时任务全部完成
+	if (tControl.nFrameNum < 1 || tControl.nFrameNum > 12)
+	{
+		printf("frame num %d not supported\n", tControl.nFrameNum);
+		exit(1);
+	}
+	if (!m_HDRPlus_Forward.BeginBurst(&tControl))
+	{
+		printf("BeginBurst fail\n");
+		exit(1);
+	}
+	// 帧任务内部的并行循环不再嵌套开线程,并行度来自帧任务和对齐的taskloop
+	omp_set_max_active_levels(1);
+	int nProcs = omp_get_num_procs();
+	bool bPushOK = true;
+#pragma omp parallel num_threads(nProcs)
+	{
+#pragma omp single
+		{
+			for (int k = 0; k < tControl.nFrameNum && bPushOK; k++)
+			{
+				printf("%s\n", argv[2 + k]);
+				if (!InRawImage[k].Load16BitRawDataFromBinFile(argv[2 + k], m_nWidth, m_nHeight, m_nBits, m_bHighBits, m_bByteOrder, m_nMIPIRAW))
+				{
+					printf("load %s fail\n", argv[2 + k]);
+					bPushOK = false;
+				}
+				else if (!m_HDRPlus_Forward.PushFrame(&InRawImage[k], false))
+				{
+					printf("PushFrame %d fail\n", k);
+					bPushOK = false;
+				}
+			}
+		}
+	}
+	// 已提交的帧任务在并行域结束时都已完成,失败时不再融合
+	if (!bPushOK)
+	{
+		exit(1);
+	}
+	m_HDRPlus_Forward.Finish(&OutRGBImage8, &tControl);
 	if (NULL != RAWProcessFlow)
 	{
 		delete RAWProcessFlow;
@@ -2,22 +2,511 @@
 #define SCALEBIT 14
 #define SCALEVALUE (1 << SCALEBIT)
 #define SCALEVALUEHALF (1 << (SCALEBIT - 1))
-void FastFillvalue(CImageData_UINT32 *pInImage, const int value)
+#define SUBPIXELBIT 4
+#define SUBPIXELVALUE (1 << SUBPIXELBIT)
+#define MERGESTRIPBYTES (512 << 10) // 按块行融合时一个列条带两块行累加值的上限,留在L2内
+#define WIENERCHUNK 4					// 频域融合一次处理的块数
+#define ALIGNCELLMARGIN 2				// 对齐子块SAD缓存框比搜索窗每边多出的位移数
+#define MERGEACCBIT 4					// 增量融合逐像素累加器比Q14少的位数,最多16帧不溢出
+typedef unsigned int (*BlockSadFunc)(const unsigned short *pRef, const unsigned short *pDebug, int nStride);
+static unsigned int BlockSad16x16_C(const unsigned short *pRef, const unsigned short *pDebug, int nStride)
 {
-	int nWidth = pInImage->GetImageWidth();
-	int nHeight = pInImage->GetImageHeight();
-	int nDim = pInImage->GetImageDim();
-	int len = nWidth * nDim;
-	int nProcs = omp_get_num_procs();
-#pragma omp parallel for num_threads(nProcs) schedule(dynamic, 16)
-	for (int y = 0; y < nHeight; y++)
+	unsigned int Sad = 0;
+	for (int a = 0; a < 16; a++)
+	{
+		for (int b = 0; b < 16; b++)
+		{
+			Sad += (unsigned int)ABS((int)pRef[b] - (int)pDebug[b]);
+		}
+		pRef += nStride;
+		pDebug += nStride;
+	}
+	return Sad;
+}
+#ifdef USE_NEON
+static unsigned int BlockSad16x16_NEON(const unsigned short *pRef, const unsigned short *pDebug, int nStride)
+{
+	uint32x4_t nsumabs = vdupq_n_u32(0);
+	for (int a = 0; a < 16; a++)
+	{
+		nsumabs = vaddq_u32(nsumabs, vpaddlq_u16(vabdq_u16(vld1q_u16(pRef), vld1q_u16(pDebug))));
+		nsumabs = vaddq_u32(nsumabs, vpaddlq_u16(vabdq_u16(vld1q_u16(pRef + 8), vld1q_u16(pDebug + 8))));
+		pRef += nStride;
+		pDebug += nStride;
+	}
+	uint64x2_t nsumsad = vpaddlq_u32(nsumabs);
+#ifdef _WIN32
+	return (unsigned int)(nsumsad.m128i_u64[0] + nsumsad.m128i_u64[1]);
+#else
+	return (unsigned int)(nsumsad[0] + nsumsad[1]);
+#endif
+}
+#endif
+#ifdef USE_X86_DISPATCH
+// |a-b| = max(a,b)-min(a,b) on u16, then both u16 halves of each u32 lane are summed
+X86_TARGET("sse4.1") static unsigned int BlockSad16x16_SSE41(const unsigned short *pRef, const unsigned short *pDebug, int nStride)
+{
+	const __m128i mask = _mm_set1_epi32(0xFFFF);
+	__m128i sum = _mm_setzero_si128();
+	for (int a = 0; a < 16; a++)
+	{
+		__m128i r0 = _mm_loadu_si128((const __m128i *)pRef);
+		__m128i r1 = _mm_loadu_si128((const __m128i *)(pRef + 8));
+		__m128i d0 = _mm_loadu_si128((const __m128i *)pDebug);
+		__m128i d1 = _mm_loadu_si128((const __m128i *)(pDebug + 8));
+		__m128i abs0 = _mm_sub_epi16(_mm_max_epu16(r0, d0), _mm_min_epu16(r0, d0));
+		__m128i abs1 = _mm_sub_epi16(_mm_max_epu16(r1, d1), _mm_min_epu16(r1, d1));
+		sum = _mm_add_epi32(sum, _mm_add_epi32(_mm_and_si128(abs0, mask), _mm_srli_epi32(abs0, 16)));
+		sum = _mm_add_epi32(sum, _mm_add_epi32(_mm_and_si128(abs1, mask), _mm_srli_epi32(abs1, 16)));
+		pRef += nStride;
+		pDebug += nStride;
+	}
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+	return (unsigned int)_mm_cvtsi128_si32(sum);
+}
+X86_TARGET("avx2") static unsigned int BlockSad16x16_AVX2(const unsigned short *pRef, const unsigned short *pDebug, int nStride)
+{
+	const __m256i mask = _mm256_set1_epi32(0xFFFF);
+	__m256i sum = _mm256_setzero_si256();
+	for (int a = 0; a < 16; a++)
+	{
+		__m256i r = _mm256_loadu_si256((const __m256i *)pRef);
+		__m256i d = _mm256_loadu_si256((const __m256i *)pDebug);
+		__m256i absd = _mm256_sub_epi16(_mm256_max_epu16(r, d), _mm256_min_epu16(r, d));
+		sum = _mm256_add_epi32(sum, _mm256_add_epi32(_mm256_and_si256(absd, mask), _mm256_srli_epi32(absd, 16)));
+		pRef += nStride;
+		pDebug += nStride;
+	}
+	__m128i sum128 = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+	sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, _MM_SHUFFLE(1, 0, 3, 2)));
+	sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, _MM_SHUFFLE(2, 3, 0, 1)));
+	return (unsigned int)_mm_cvtsi128_si32(sum128);
+}
+#endif
+static BlockSadFunc GetBlockSad16x16Func()
+{
+#ifdef USE_NEON
+	return BlockSad16x16_NEON;
+#else
+#ifdef USE_X86_DISPATCH
+	int nLevel = GetX86SimdLevel();
+	if (nLevel >= X86_SIMD_AVX2)
+		return BlockSad16x16_AVX2;
+	if (nLevel >= X86_SIMD_SSE41)
+		return BlockSad16x16_SSE41;
+#endif
+	return BlockSad16x16_C;
+#endif
+}
+static unsigned int BlockSad8x8_C(const unsigned short *pRef, const unsigned short *pDebug, int nStride)
+{
+	unsigned int Sad = 0;
+	for (int a = 0; a < 8; a++)
+	{
+		for (int b = 0; b < 8; b++)
+		{
+			Sad += (unsigned int)ABS((int)pRef[b] - (int)pDebug[b]);
+		}
+		pRef += nStride;
+		pDebug += nStride;
+	}
+	return Sad;
+}
+#ifdef USE_NEON
+static unsigned int BlockSad8x8_NEON(const unsigned short *pRef, const unsigned short *pDebug, int nStride)
+{
+	uint32x4_t nsumabs = vdupq_n_u32(0);
+	for (int a = 0; a < 8; a++)
+	{
+		nsumabs = vaddq_u32(nsumabs, vpaddlq_u16(vabdq_u16(vld1q_u16(pRef), vld1q_u16(pDebug))));
+		pRef += nStride;
+		pDebug += nStride;
+	}
+	uint64x2_t nsumsad = vpaddlq_u32(nsumabs);
+#ifdef _WIN32
+	return (unsigned int)(nsumsad.m128i_u64[0] + nsumsad.m128i_u64[1]);
+#else
+	return (unsigned int)(nsumsad[0] + nsumsad[1]);
+#endif
+}
+#endif
+#ifdef USE_X86_DISPATCH
+X86_TARGET("sse4.1") static unsigned int BlockSad8x8_SSE41(const unsigned short *pRef, const unsigned short *pDebug, int nStride)
+{
+	const __m128i mask = _mm_set1_epi32(0xFFFF);
+	__m128i sum = _mm_setzero_si128();
+	for (int a = 0; a < 8; a++)
+	{
+		__m128i r = _mm_loadu_si128((const __m128i *)pRef);
+		__m128i d = _mm_loadu_si128((const __m128i *)pDebug);
+		__m128i absd = _mm_sub_epi16(_mm_max_epu16(r, d), _mm_min_epu16(r, d));
+		sum = _mm_add_epi32(sum, _mm_add_epi32(_mm_and_si128(absd, mask), _mm_srli_epi32(absd, 16)));
+		pRef += nStride;
+		pDebug += nStride;
+	}
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+	return (unsigned int)_mm_cvtsi128_si32(sum);
+}
+X86_TARGET("avx2") static unsigned int BlockSad8x8_AVX2(const unsigned short *pRef, const unsigned short *pDebug, int nStride)
+{
+	const __m256i mask = _mm256_set1_epi32(0xFFFF);
+	__m256i sum = _mm256_setzero_si256();
+	for (int a = 0; a < 8; a += 2)
+	{
+		__m256i r = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)pRef)), _mm_loadu_si128((const __m128i *)(pRef + nStride)), 1);
+		__m256i d = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)pDebug)), _mm_loadu_si128((const __m128i *)(pDebug + nStride)), 1);
+		__m256i absd = _mm256_sub_epi16(_mm256_max_epu16(r, d), _mm256_min_epu16(r, d));
+		sum = _mm256_add_epi32(sum, _mm256_add_epi32(_mm256_and_si256(absd, mask), _mm256_srli_epi32(absd, 16)));
+		pRef += nStride * 2;
+		pDebug += nStride * 2;
+	}
+	__m128i sum128 = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+	sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, _MM_SHUFFLE(1, 0, 3, 2)));
+	sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, _MM_SHUFFLE(2, 3, 0, 1)));
+	return (unsigned int)_mm_cvtsi128_si32(sum128);
+}
+#endif
+static BlockSadFunc GetBlockSad8x8Func()
+{
+#ifdef USE_NEON
+	return BlockSad8x8_NEON;
+#else
+#ifdef USE_X86_DISPATCH
+	int nLevel = GetX86SimdLevel();
+	if (nLevel >= X86_SIMD_AVX2)
+		return BlockSad8x8_AVX2;
+	if (nLevel >= X86_SIMD_SSE41)
+		return BlockSad8x8_SSE41;
+#endif
+	return BlockSad8x8_C;
+#endif
+}
+// 大于16x16的块由多个16x16块拼成
+template <int Size>
+static unsigned int BlockSadTiled(const unsigned short *pRef, const unsigned short *pDebug, int nStride)
+{
+	static const BlockSadFunc pSad16 = GetBlockSad16x16Func();
+	unsigned int Sad = 0;
+	for (int a = 0; a < Size; a += 16)
+	{
+		for (int b = 0; b < Size; b += 16)
+		{
+			Sad += pSad16(pRef + a * nStride + b, pDebug + a * nStride + b, nStride);
+		}
+	}
+	return Sad;
+}
+template <int Size>
+static BlockSadFunc GetBlockSadFunc()
+{
+	return BlockSadTiled<Size>;
+}
+template <>
+BlockSadFunc GetBlockSadFunc<8>()
+{
+	return GetBlockSad8x8Func();
+}
+template <>
+BlockSadFunc GetBlockSadFunc<16>()
+{
+	return GetBlockSad16x16Func();
+}
+// 同一位移下一行中连续nCells个子块的SAD,第j个子块结果写到pOutSad[j*nOutStep]
+typedef void (*CellRowSadFunc)(const unsigned short *pRef, const unsigned short *pDebug, int nStride, int nCells, unsigned int *pOutSad, int nOutStep);
+static void CellRowSad8x8_C(const unsigned short *pRef, const unsigned short *pDebug, int nStride, int nCells, unsigned int *pOutSad, int nOutStep)
+{
+	for (int j = 0; j < nCells; j++)
+	{
+		pOutSad[j * nOutStep] = BlockSad8x8_C(pRef + j * 8, pDebug + j * 8, nStride);
+	}
+}
+#ifdef USE_NEON
+static void CellRowSad8x8_NEON(const unsigned short *pRef, const unsigned short *pDebug, int nStride, int nCells, unsigned int *pOutSad, int nOutStep)
+{
+	for (int j = 0; j < nCells; j++)
+	{
+		pOutSad[j * nOutStep] = BlockSad8x8_NEON(pRef + j * 8, pDebug + j * 8, nStride);
+	}
+}
+#endif
+#ifdef USE_X86_DISPATCH
+X86_TARGET("sse4.1") static void CellRowSad8x8_SSE41(const unsigned short *pRef, const unsigned short *pDebug, int nStride, int nCells, unsigned int *pOutSad, int nOutStep)
+{
+	for (int j = 0; j < nCells; j++)
+	{
+		pOutSad[j * nOutStep] = BlockSad8x8_SSE41(pRef + j * 8, pDebug + j * 8, nStride);
+	}
+}
+// 一次4个子块:每个256位寄存器放2个子块的一行,8行累加后两次hadd得到4个子块的和
+X86_TARGET("avx2") static void CellRowSad8x8_AVX2(const unsigned short *pRef, const unsigned short *pDebug, int nStride, int nCells, unsigned int *pOutSad, int nOutStep)
+{
+	const __m256i mask = _mm256_set1_epi32(0xFFFF);
+	int j = 0;
+	for (; j + 4 <= nCells; j += 4)
+	{
+		const unsigned short *pr = pRef + j * 8;
+		const unsigned short *pd = pDebug + j * 8;
+		__m256i sum0 = _mm256_setzero_si256();
+		__m256i sum1 = _mm256_setzero_si256();
+		for (int a = 0; a < 8; a++)
+		{
+			__m256i r0 = _mm256_loadu_si256((const __m256i *)pr);
+			__m256i r1 = _mm256_loadu_si256((const __m256i *)(pr + 16));
+			__m256i d0 = _mm256_loadu_si256((const __m256i *)pd);
+			__m256i d1 = _mm256_loadu_si256((const __m256i *)(pd + 16));
+			__m256i abs0 = _mm256_sub_epi16(_mm256_max_epu16(r0, d0), _mm256_min_epu16(r0, d0));
+			__m256i abs1 = _mm256_sub_epi16(_mm256_max_epu16(r1, d1), _mm256_min_epu16(r1, d1));
+			sum0 = _mm256_add_epi32(sum0, _mm256_add_epi32(_mm256_and_si256(abs0, mask), _mm256_srli_epi32(abs0, 16)));
+			sum1 = _mm256_add_epi32(sum1, _mm256_add_epi32(_mm256_and_si256(abs1, mask), _mm256_srli_epi32(abs1, 16)));
+			pr += nStride;
+			pd += nStride;
+		}
+		// 低128位依次为子块0,2,高128位为子块1,3
+		__m256i h = _mm256_hadd_epi32(sum0, sum1);
+		h = _mm256_hadd_epi32(h, h);
+		pOutSad[j * nOutStep] = (unsigned int)_mm256_extract_epi32(h, 0);
+		pOutSad[(j + 1) * nOutStep] = (unsigned int)_mm256_extract_epi32(h, 4);
+		pOutSad[(j + 2) * nOutStep] = (unsigned int)_mm256_extract_epi32(h, 1);
+		pOutSad[(j + 3) * nOutStep] = (unsigned int)_mm256_extract_epi32(h, 5);
+	}
+	for (; j < nCells; j++)
+	{
+		pOutSad[j * nOutStep] = BlockSad8x8_AVX2(pRef + j * 8, pDebug + j * 8, nStride);
+	}
+}
+#endif
+static CellRowSadFunc GetCellRowSad8x8Func()
+{
+#ifdef USE_NEON
+	return CellRowSad8x8_NEON;
+#else
+#ifdef USE_X86_DISPATCH
+	int nLevel = GetX86SimdLevel();
+	if (nLevel >= X86_SIMD_AVX2)
+		return CellRowSad8x8_AVX2;
+	if (nLevel >= X86_SIMD_SSE41)
+		return CellRowSad8x8_SSE41;
+#endif
+	return CellRowSad8x8_C;
+#endif
+}
+template <int Cellsize>
+static void CellRowSadTiled(const unsigned short *pRef, const unsigned short *pDebug, int nStride, int nCells, unsigned int *pOutSad, int nOutStep)
+{
+	static const BlockSadFunc pCellSad = GetBlockSadFunc<Cellsize>();
+	for (int j = 0; j < nCells; j++)
+	{
+		pOutSad[j * nOutStep] = pCellSad(pRef + j * Cellsize, pDebug + j * Cellsize, nStride);
+	}
+}
+template <int Cellsize>
+static CellRowSadFunc GetCellRowSadFunc()
+{
+	return CellRowSadTiled<Cellsize>;
+}
+template <>
+CellRowSadFunc GetCellRowSadFunc<8>()
+{
+	return GetCellRowSad8x8Func();
+}
+// 越界的行列取最近的边界像素,每行只取一次行指针
+static unsigned int BlockSadClamped(MultiUshortImage *pRefImage, MultiUshortImage *pDebugImage, int x, int y, int debugx, int debugy, int Blocksize)
+{
+	int nRefWidth = pRefImage->GetImageWidth();
+	int nRefHeight = pRefImage->GetImageHeight();
+	int nDebugWidth = pDebugImage->GetImageWidth();
+	int nDebugHeight = pDebugImage->GetImageHeight();
+	unsigned int Sad = 0;
+	for (int a = 0; a < Blocksize; a++)
+	{
+		unsigned short *pRef = pRefImage->GetImageLine(MIN2(MAX2(y + a, 0), nRefHeight - 1));
+		unsigned short *pDebug = pDebugImage->GetImageLine(MIN2(MAX2(debugy + a, 0), nDebugHeight - 1));
+		for (int b = 0; b < Blocksize; b++)
+		{
+			int refx = MIN2(MAX2(x + b, 0), nRefWidth - 1);
+			int debugxnew = MIN2(MAX2(debugx + b, 0), nDebugWidth - 1);
+			int Dif = (int)pRef[refx] - (int)pDebug[debugxnew];
+			Sad += (unsigned int)ABS(Dif);
+		}
+	}
+	return Sad;
+}
+// 块完全在图内走无钳位的快速路径,否则逐像素钳位计算,两者结果一致
+template <int Blocksize>
+static inline unsigned int BlockSad(MultiUshortImage *pRefImage, MultiUshortImage *pDebugImage, int x, int y, int debugx, int debugy, BlockSadFunc pFastSad)
+{
+	int nWidth = pRefImage->GetImageWidth();
+	int nHeight = pRefImage->GetImageHeight();
+	if (x + Blocksize <= nWidth && y + Blocksize <= nHeight && debugx >= 0 && debugy >= 0 && debugx + Blocksize <= nWidth && debugy + Blocksize <= nHeight)
+	{
+		return pFastSad(pRefImage->GetImageLine(y) + x, pDebugImage->GetImageLine(debugy) + debugx, nWidth);
+	}
+	return BlockSadClamped(pRefImage, pDebugImage, x, y, debugx, debugy, Blocksize);
+}
+// 一个子块(对齐块的1/4)在(px,py)为中心的整个搜索窗内的SAD,对齐块的SAD为其2x2个子块之和
+template <int Cellsize>
+static void CellSadWindow(MultiUshortImage *pRefImage, MultiUshortImage *pDebugImage, int x, int y, int px, int py, int nMoveRangex, int nMoveRangey, BlockSadFunc pFastSad, unsigned int *pOutSad)
+{
+	int nWidth = pRefImage->GetImageWidth();
+	int nHeight = pRefImage->GetImageHeight();
+	bool bRefInside = (x + Cellsize <= nWidth && y + Cellsize <= nHeight);
+	for (int n = -nMoveRangey; n <= nMoveRangey; n++)
+	{
+		int debugy = y + py + n;
+		bool bRowInside = bRefInside && debugy >= 0 && debugy + Cellsize <= nHeight;
+		for (int m = -nMoveRangex; m <= nMoveRangex; m++)
+		{
+			int debugx = x + px + m;
+			if (bRowInside && debugx >= 0 && debugx + Cellsize <= nWidth)
+			{
+				*pOutSad++ = pFastSad(pRefImage->GetImageLine(y) + x, pDebugImage->GetImageLine(debugy) + debugx, nWidth);
+			}
+			else
+			{
+				*pOutSad++ = BlockSadClamped(pRefImage, pDebugImage, x, y, debugx, debugy, Cellsize);
+			}
+		}
+	}
+}
+// 第cy行所有子块的SAD按绝对位移缓存,与预偏移无关:框取用到该子块的(最多)2x2个对齐块搜索窗的并集,
+// 并集超过nBoxSizex x nBoxSizey时只取能放进框的最多块,其余块的窗由调用者单独计算;
+// 框相同的连续子块对每个位移整段调用pCellRowSad,pBox每个子块存框的左上角位移和宽高
+template <int Cellsize>
+static void CellRowSadBox(MultiUshortImage *pRefImage, MultiUshortImage *pDebugImage, MultiShortImage *pPreOffsetxImage, MultiShortImage *pPreOffsetyImage, int cy, int Ystart, int Yend, int nMoveRangex, int nMoveRangey, int nBoxSizex, int nBoxSizey, CellRowSadFunc pCellRowSad, unsigned int *pOutSad, short *pBox)
+{
+	int nWidth = pRefImage->GetImageWidth();
+	int nHeight = pRefImage->GetImageHeight();
+	int nWidth8 = nWidth / Cellsize;
+	int nCellW = nWidth8 + 1;
+	int nBoxArea = nBoxSizex * nBoxSizey;
+	int nSpreadx = nBoxSizex - nMoveRangex * 2 - 1;
+	int nSpready = nBoxSizey - nMoveRangey * 2 - 1;
+	int Y0 = MAX2(cy - 1, Ystart);
+	int Y1 = MIN2(cy, Yend - 1);
+	for (int cx = 0; cx < nCellW; cx++)
+	{
+		int X0 = MAX2(cx - 1, 0);
+		int X1 = MIN2(cx, nWidth8 - 1);
+		int px[4], py[4];
+		int nBlk = 0;
+		for (int Y = Y0; Y <= Y1; Y++)
+		{
+			for (int X = X0; X <= X1; X++, nBlk++)
+			{
+				px[nBlk] = (pPreOffsetxImage != NULL) ? pPreOffsetxImage->GetImageLine(Y)[X] : 0;
+				py[nBlk] = (pPreOffsetyImage != NULL) ? pPreOffsetyImage->GetImageLine(Y)[X] : 0;
+			}
+		}
+		// 取预偏移彼此相差不超过框余量的最多块,框为这些块搜索窗的并集
+		int nBest = 0;
+		int minx = 0, maxx = 0, miny = 0, maxy = 0;
+		for (int a = 0; a < nBlk && nBest < nBlk; a++)
+		{
+			for (int b = 0; b < nBlk && nBest < nBlk; b++)
+			{
+				int nCover = 0;
+				int x0 = 32767, x1 = -32768, y0 = 32767, y1 = -32768;
+				for (int k = 0; k < nBlk; k++)
+				{
+					if (px[k] >= px[a] && px[k] <= px[a] + nSpreadx && py[k] >= py[b] && py[k] <= py[b] + nSpready)
+					{
+						nCover++;
+						x0 = MIN2(x0, px[k]);
+						x1 = MAX2(x1, px[k]);
+						y0 = MIN2(y0, py[k]);
+						y1 = MAX2(y1, py[k]);
+					}
+				}
+				if (nCover > nBest)
+				{
+					nBest = nCover;
+					minx = x0;
+					maxx = x1;
+					miny = y0;
+					maxy = y1;
+				}
+			}
+		}
+		int ox = minx - nMoveRangex;
+		int oy = miny - nMoveRangey;
+		int bw = maxx - minx + nMoveRangex * 2 + 1;
+		int bh = maxy - miny + nMoveRangey * 2 + 1;
+		pBox[cx * 4 + 0] = ox;
+		pBox[cx * 4 + 1] = oy;
+		pBox[cx * 4 + 2] = bw;
+		pBox[cx * 4 + 3] = bh;
+	}
+	int y = cy * Cellsize;
+	bool bRefRowInside = (y + Cellsize <= nHeight);
+	unsigned short *pRefLine = pRefImage->GetImageLine(MIN2(y, nHeight - 1));
+	for (int c0 = 0; c0 < nCellW;)
 	{
-		unsigned int *pline = pInImage->GetImageLine(y);
-		int b = len;
-		while (b--)
-			*pline++ = 0;
+		const short *pb = pBox + c0 * 4;
+		int c1 = c0 + 1;
+		while (c1 < nCellW && pBox[c1 * 4] == pb[0] && pBox[c1 * 4 + 1] == pb[1] && pBox[c1 * 4 + 2] == pb[2] && pBox[c1 * 4 + 3] == pb[3])
+		{
+			c1++;
+		}
+		int i = 0;
+		for (int n = 0; n < pb[3]; n++)
+		{
+			int debugy = y + pb[1] + n;
+			bool bRowInside = bRefRowInside && debugy >= 0 && debugy + Cellsize <= nHeight;
+			for (int m = 0; m < pb[2]; m++, i++)
+			{
+				int dx = pb[0] + m;
+				// [cxa,cxb)内的子块和位移后的块都在图内,走整段快速路径,两头逐个钳位计算
+				int cxa = c1;
+				int cxb = c1;
+				if (bRowInside)
+				{
+					cxa = c0;
+					while (cxa < cxb && cxa * Cellsize + dx < 0)
+					{
+						cxa++;
+					}
+					while (cxb > cxa && (cxb > nWidth8 || cxb * Cellsize + dx > nWidth))
+					{
+						cxb--;
+					}
+				}
+				for (int cx = c0; cx < cxa; cx++)
+				{
+					pOutSad[cx * nBoxArea + i] = BlockSadClamped(pRefImage, pDebugImage, cx * Cellsize, y, cx * Cellsize + dx, debugy, Cellsize);
+				}
+				if (cxb > cxa)
+				{
+					pCellRowSad(pRefLine + cxa * Cellsize, pDebugImage->GetImageLine(debugy) + cxa * Cellsize + dx, nWidth, cxb - cxa, pOutSad + cxa * nBoxArea + i, nBoxArea);
+				}
+				for (int cx = cxb; cx < c1; cx++)
+				{
+					pOutSad[cx * nBoxArea + i] = BlockSadClamped(pRefImage, pDebugImage, cx * Cellsize, y, cx * Cellsize + dx, debugy, Cellsize);
+				}
+			}
+		}
+		c0 = c1;
 	}
 }
+// 3x3 SAD面上做二维二次曲面 f=c+b1*x+b2*y+(A11*x*x+2*A12*x*y+A22*y*y)/2 的最小二乘拟合,
+// 9点等权,各系数为固定的3x3滤波,求极小值相对中心的亚像素偏移,D[行y][列x]
+static bool SubPixelQuadraticFit(const float D[3][3], float &dx, float &dy)
+{
+	float A11 = (D[0][0] + D[0][2] + D[1][0] + D[1][2] + D[2][0] + D[2][2] - 2 * (D[0][1] + D[1][1] + D[2][1])) / 3.0f;
+	float A22 = (D[0][0] + D[2][0] + D[0][1] + D[2][1] + D[0][2] + D[2][2] - 2 * (D[1][0] + D[1][1] + D[1][2])) / 3.0f;
+	float A12 = (D[0][0] - D[0][2] - D[2][0] + D[2][2]) / 4.0f;
+	float b1 = (D[0][2] + D[1][2] + D[2][2] - D[0][0] - D[1][0] - D[2][0]) / 6.0f;
+	float b2 = (D[2][0] + D[2][1] + D[2][2] - D[0][0] - D[0][1] - D[0][2]) / 6.0f;
+	float det = A11 * A22 - A12 * A12;
+	if (A11 <= 0 || det <= 0)
+		return false;
+	dx = -(A22 * b1 - A12 * b2) / det;
+	dy = -(A11 * b2 - A12 * b1) / det;
+	dx = CLIP(dx, -0.5f, 0.5f);
+	dy = CLIP(dy, -0.5f, 0.5f);
+	return true;
+}
 void CHDRPlus_BlockMatchFusion::FillUnsignedShortImage(unsigned short *pInImage, unsigned short *pOutImage, int nx, int ny, int lenx, int leny)
 {
 	int nMirrorW = nx + lenx;
@@ -61,6 +550,99 @@ void CHDRPlus_BlockMatchFusion::FillUnsignedShortImage(unsigned short *pInImage,
 		}
 	}
 }
+// 一行2x2均值下采样 pout[x] = (p0[2x] + p0[2x+1] + p1[2x] + p1[2x+1] + 2) >> 2
+typedef void (*BoxDownRowFunc)(const unsigned short *pline0, const unsigned short *pline1, unsigned short *pout, int nOutWidth);
+static void BoxDownRow_C(const unsigned short *pline0, const unsigned short *pline1, unsigned short *pout, int nOutWidth)
+{
+	for (int x = 0; x < nOutWidth; x++)
+	{
+		pout[0] = ((pline0[0] + pline0[1] + pline1[0] + pline1[1] + 2) >> 2);
+		pline0 += 2;
+		pline1 += 2;
+		pout += 1;
+	}
+}
+#ifdef USE_NEON
+static void BoxDownRow_NEON(const unsigned short *pline0, const unsigned short *pline1, unsigned short *pout, int nOutWidth)
+{
+	int tmplen = nOutWidth / 4 * 4;
+	int x = 0;
+	for (; x < tmplen; x += 4)
+	{
+		uint32x4_t sum = vpaddlq_u16(vaddq_u16(vld1q_u16(pline0), vld1q_u16(pline1)));
+		vst1_u16(pout, vshrn_n_u32(sum, 2));
+		pline0 += 8;
+		pline1 += 8;
+		pout += 4;
+	}
+	BoxDownRow_C(pline0, pline1, pout, nOutWidth - x);
+}
+#endif
+#ifdef USE_X86_DISPATCH
+// 每个u32通道的高低两个u16分别取出后在32位上求和,全16bit输入也不会溢出
+X86_TARGET("sse4.1") static void BoxDownRow_SSE41(const unsigned short *pline0, const unsigned short *pline1, unsigned short *pout, int nOutWidth)
+{
+	const __m128i mask = _mm_set1_epi32(0xFFFF);
+	const __m128i round = _mm_set1_epi32(2);
+	int tmplen = nOutWidth / 8 * 8;
+	int x = 0;
+	for (; x < tmplen; x += 8)
+	{
+		__m128i r00 = _mm_loadu_si128((const __m128i *)pline0);
+		__m128i r01 = _mm_loadu_si128((const __m128i *)(pline0 + 8));
+		__m128i r10 = _mm_loadu_si128((const __m128i *)pline1);
+		__m128i r11 = _mm_loadu_si128((const __m128i *)(pline1 + 8));
+		__m128i s0 = _mm_add_epi32(_mm_add_epi32(_mm_and_si128(r00, mask), _mm_srli_epi32(r00, 16)), _mm_add_epi32(_mm_and_si128(r10, mask), _mm_srli_epi32(r10, 16)));
+		__m128i s1 = _mm_add_epi32(_mm_add_epi32(_mm_and_si128(r01, mask), _mm_srli_epi32(r01, 16)), _mm_add_epi32(_mm_and_si128(r11, mask), _mm_srli_epi32(r11, 16)));
+		s0 = _mm_srli_epi32(_mm_add_epi32(s0, round), 2);
+		s1 = _mm_srli_epi32(_mm_add_epi32(s1, round), 2);
+		_mm_storeu_si128((__m128i *)pout, _mm_packus_epi32(s0, s1));
+		pline0 += 16;
+		pline1 += 16;
+		pout += 8;
+	}
+	BoxDownRow_C(pline0, pline1, pout, nOutWidth - x);
+}
+X86_TARGET("avx2") static void BoxDownRow_AVX2(const unsigned short *pline0, const unsigned short *pline1, unsigned short *pout, int nOutWidth)
+{
+	const __m256i mask = _mm256_set1_epi32(0xFFFF);
+	const __m256i round = _mm256_set1_epi32(2);
+	int tmplen = nOutWidth / 16 * 16;
+	int x = 0;
+	for (; x < tmplen; x += 16)
+	{
+		__m256i r00 = _mm256_loadu_si256((const __m256i *)pline0);
+		__m256i r01 = _mm256_loadu_si256((const __m256i *)(pline0 + 16));
+		__m256i r10 = _mm256_loadu_si256((const __m256i *)pline1);
+		__m256i r11 = _mm256_loadu_si256((const __m256i *)(pline1 + 16));
+		__m256i s0 = _mm256_add_epi32(_mm256_add_epi32(_mm256_and_si256(r00, mask), _mm256_srli_epi32(r00, 16)), _mm256_add_epi32(_mm256_and_si256(r10, mask), _mm256_srli_epi32(r10, 16)));
+		__m256i s1 = _mm256_add_epi32(_mm256_add_epi32(_mm256_and_si256(r01, mask), _mm256_srli_epi32(r01, 16)), _mm256_add_epi32(_mm256_and_si256(r11, mask), _mm256_srli_epi32(r11, 16)));
+		s0 = _mm256_srli_epi32(_mm256_add_epi32(s0, round), 2);
+		s1 = _mm256_srli_epi32(_mm256_add_epi32(s1, round), 2);
+		// packus按128位通道交错,再按64位重排回顺序
+		_mm256_storeu_si256((__m256i *)pout, _mm256_permute4x64_epi64(_mm256_packus_epi32(s0, s1), _MM_SHUFFLE(3, 1, 2, 0)));
+		pline0 += 32;
+		pline1 += 32;
+		pout += 16;
+	}
+	BoxDownRow_SSE41(pline0, pline1, pout, nOutWidth - x);
+}
+#endif
+static BoxDownRowFunc GetBoxDownRowFunc()
+{
+#ifdef USE_NEON
+	return BoxDownRow_NEON;
+#else
+#ifdef USE_X86_DISPATCH
+	int nLevel = GetX86SimdLevel();
+	if (nLevel >= X86_SIMD_AVX2)
+		return BoxDownRow_AVX2;
+	if (nLevel >= X86_SIMD_SSE41)
+		return BoxDownRow_SSE41;
+#endif
+	return BoxDownRow_C;
+#endif
+}
 bool CHDRPlus_BlockMatchFusion::BoxDownx2(MultiUshortImage *pInImage, MultiUshortImage *pOutImage)
 {
 	int nWidth = pInImage->GetImageWidth();
@@ -77,12 +659,11 @@ bool CHDRPlus_BlockMatchFusion::BoxDownx2(MultiUshortImage *pInImage, MultiUshor
 		if (!pOutImage->CreateImage((nWidth) >> 1, (nHeight) >> 1, 1, 16))
 			return false;
 	}
+	BoxDownRowFunc pBoxDownRow = GetBoxDownRowFunc();
 	if (padflag == true)
 	{
 		int nOutWidth = pOutImage->GetImageWidth();
 		int nOutHeight = pOutImage->GetImageHeight();
-		int padx = nOutWidth * 2 - nWidth;
-		int pady = nOutWidth * 2 - nHeight;
 		MultiUshortImage tmpPadOut;
 		tmpPadOut.CreateImage(nWidth, nHeight, 1, 16);
 		tmpPadOut.Extend2Image(pInImage, &tmpPadOut, 1);
@@ -90,28 +671,7 @@ bool CHDRPlus_BlockMatchFusion::BoxDownx2(MultiUshortImage *pInImage, MultiUshor
 #pragma omp parallel for num_threads(nProcs) schedule(dynamic, 16)
 		for (int y = 0; y < nOutHeight; y++)
 		{
-			unsigned short *pline0 = tmpPadOut.GetImageLine(y * 2);
-			unsigned short *pline1 = tmpPadOut.GetImageLine(y * 2 + 1);
-			unsigned short *pout = pOutImage->GetImageLine(y);
-			int tmplen = nOutWidth / 4 * 4;
-			int x = 0;
-#ifdef USE_NEON
-			for (; x < tmplen; x += 4)
-			{
-				uint32x4_t sum = vpaddlq_u16(vaddq_u16(vld1q_u16(pline0), vld1q_u16(pline1)));
-				vst1_u16(pout, vshrn_n_u32(sum, 2));
-				pline0 += 8;
-				pline1 += 8;
-				pout += 4;
-			}
-#endif
-			for (; x < nOutWidth; x++)
-			{
-				pout[0] = ((pline0[0] + pline0[1] + pline1[0] + pline1[1] + 2) >> 2);
-				pline0 += 2;
-				pline1 += 2;
-				pout += 1;
-			}
+			pBoxDownRow(tmpPadOut.GetImageLine(y * 2), tmpPadOut.GetImageLine(y * 2 + 1), pOutImage->GetImageLine(y), nOutWidth);
 		}
 	}
 	else
@@ -122,138 +682,197 @@ bool CHDRPlus_BlockMatchFusion::BoxDownx2(MultiUshortImage *pInImage, MultiUshor
 #pragma omp parallel for num_threads(nProcs) schedule(dynamic, 16)
 		for (int y = 0; y < nOutHeight; y++)
 		{
-			unsigned short *pline0 = pInImage->GetImageLine(y * 2);
-			unsigned short *pline1 = pInImage->GetImageLine(y * 2 + 1);
-			unsigned short *pout = pOutImage->GetImageLine(y);
-			int tmplen = nOutWidth / 4 * 4;
-			int x = 0;
-#ifdef USE_NEON
-			for (; x < tmplen; x += 4)
-			{
-				uint32x4_t sum = vpaddlq_u16(vaddq_u16(vld1q_u16(pline0), vld1q_u16(pline1)));
-				vst1_u16(pout, vshrn_n_u32(sum, 2));
-				pline0 += 8;
-				pline1 += 8;
-				pout += 4;
-			}
-#endif
-			for (; x < nOutWidth; x++)
-			{
-				pout[0] = ((pline0[0] + pline0[1] + pline1[0] + pline1[1] + 2) >> 2);
-				pline0 += 2;
-				pline1 += 2;
-				pout += 1;
-			}
+			pBoxDownRow(pInImage->GetImageLine(y * 2), pInImage->GetImageLine(y * 2 + 1), pOutImage->GetImageLine(y), nOutWidth);
 		}
 	}
+	return true;
 }
-bool CHDRPlus_BlockMatchFusion::EstimatedOffsetNoRef(MultiUshortImage *pInRefImage, MultiUshortImage *pInDebugImage, MultiShortImage *pOutOffsetxImage, MultiShortImage *pOutOffsetyImage, int nMoveRangex, int nMoveRangey)
+// 一次读入全分辨率图生成nLevel层2x2均值金字塔:每2^nLevel行为一个行块,
+// 块内先出x2的行,再用刚写出仍在缓存中的x2行出x4,依次到最后一层,结果与逐层BoxDownx2一致
+// 输入为未填充原图上的虚拟填充视图,x2层中间部分直接读原图行,只有左右填充列逐点映射
+bool CHDRPlus_BlockMatchFusion::BoxDownPyramid(TRawPadView *pInView, MultiUshortImage *pOutImage[], int nLevel)
 {
-	int Step = 8;
-	int Blocksize = 16;
-	unsigned int thre = Blocksize * Blocksize * 10;
-	const unsigned int InitMinSad = Blocksize * Blocksize * m_nMaxDist * 2;
-	int nWidth = pInRefImage->GetImageWidth();
-	int nHeight = pInRefImage->GetImageHeight();
-	int nWidth8 = nWidth / Step;
-	int nHeight8 = nHeight / Step;
-	if (pOutOffsetxImage->GetImageWidth() != nWidth8 || pOutOffsetxImage->GetImageHeight() != nHeight8)
+	int nWidth = pInView->GetImageWidth();
+	int nHeight = pInView->GetImageHeight();
+	int nBlockRows = 1 << nLevel;
+	if ((nWidth % nBlockRows) != 0 || (nHeight % nBlockRows) != 0)
 	{
-		if (!pOutOffsetxImage->CreateImageFillValue(nWidth8, nHeight8, 1, 0))
+		// 奇数尺寸的帧填充后某一层需要补边,按原来的方式实际填充后逐层计算
+		MultiUshortImage tmpPadImage;
+		if (!pInView->pImage->FillImageAround(&tmpPadImage, pInView->nPadx, pInView->nPady))
 			return false;
+		MultiUshortImage *pIn = &tmpPadImage;
+		for (int l = 0; l < nLevel; l++)
+		{
+			if (!BoxDownx2(pIn, pOutImage[l]))
+				return false;
+			pIn = pOutImage[l];
+		}
+		return true;
 	}
-	if (pOutOffsetyImage->GetImageWidth() != nWidth8 || pOutOffsetyImage->GetImageHeight() != nHeight8)
+	for (int l = 0; l < nLevel; l++)
 	{
-		if (!pOutOffsetyImage->CreateImageFillValue(nWidth8, nHeight8, 1, 0))
+		if (!pOutImage[l]->CreateImage(nWidth >> (l + 1), nHeight >> (l + 1), 1, 16))
 			return false;
 	}
-	int NeonBlocksizex = (nWidth - Blocksize);
-	int NeonBlocksizey = (nHeight - Blocksize);
+	BoxDownRowFunc pBoxDownRow = GetBoxDownRowFunc();
+	int nPadx = pInView->nPadx;
+	int nSrcWidth = pInView->pImage->GetImageWidth();
+	int nOutWidth0 = pOutImage[0]->GetImageWidth();
+	// x2层[xs,xe)内的点对应的2x2全部落在原图列内
+	int xs = MIN2((nPadx + 1) / 2, nOutWidth0);
+	int xe = MAX2(xs, MIN2((nPadx + nSrcWidth) / 2, nOutWidth0));
+	int nBlocks = nHeight / nBlockRows;
+	int nProcs = omp_get_num_procs();
+#pragma omp parallel for num_threads(nProcs) schedule(dynamic, 4)
+	for (int j = 0; j < nBlocks; j++)
+	{
+		int nOutRows = nBlockRows >> 1;
+		for (int r = j * nOutRows; r < (j + 1) * nOutRows; r++)
+		{
+			unsigned short *pline0 = pInView->pImage->GetImageLine(pInView->MapRow(r * 2));
+			unsigned short *pline1 = pInView->pImage->GetImageLine(pInView->MapRow(r * 2 + 1));
+			unsigned short *pout = pOutImage[0]->GetImageLine(r);
+			for (int x = 0; x < nOutWidth0; x++)
+			{
+				if (x == xs)
+				{
+					pBoxDownRow(pline0 + 2 * xs - nPadx, pline1 + 2 * xs - nPadx, pout + xs, xe - xs);
+					x = xe;
+					if (x >= nOutWidth0)
+						break;
+				}
+				int c0 = pInView->MapCol(2 * x);
+				int c1 = pInView->MapCol(2 * x + 1);
+				pout[x] = ((pline0[c0] + pline0[c1] + pline1[c0] + pline1[c1] + 2) >> 2);
+			}
+		}
+		MultiUshortImage *pIn = pOutImage[0];
+		for (int l = 1; l < nLevel; l++)
+		{
+			nOutRows = nBlockRows >> (l + 1);
+			int nOutWidth = pOutImage[l]->GetImageWidth();
+			for (int r = j * nOutRows; r < (j + 1) * nOutRows; r++)
+			{
+				pBoxDownRow(pIn->GetImageLine(r * 2), pIn->GetImageLine(r * 2 + 1), pOutImage[l]->GetImageLine(r), nOutWidth);
+			}
+			pIn = pOutImage[l];
+		}
+	}
+	return true;
+}
+template <int Blocksize>
+bool CHDRPlus_BlockMatchFusion::EstimatedOffsetNoRef(MultiUshortImage *pInRefImage, MultiUshortImage *pInDebugImage, MultiShortImage *pOutOffsetxImage, MultiShortImage *pOutOffsetyImage, int nMoveRangex, int nMoveRangey, int nStaticThre, int *pStaticNum)
+{
+	return EstimatedOffsetAndRef<Blocksize>(pInRefImage, pInDebugImage, NULL, NULL, pOutOffsetxImage, pOutOffsetyImage, nMoveRangex, nMoveRangey, NULL, NULL, NULL, nStaticThre, pStaticNum);
+}
+template <int Blocksize>
+void CHDRPlus_BlockMatchFusion::EstimatedOffsetBand(MultiUshortImage *pInRefImage, MultiUshortImage *pInDebugImage, MultiShortImage *pPreOffsetxImage, MultiShortImage *pPreOffsetyImage, MultiShortImage *pOutOffsetxImage, MultiShortImage *pOutOffsetyImage, int nMoveRangex, int nMoveRangey, MultiShortImage *pOutSubOffsetxImage, MultiShortImage *pOutSubOffsetyImage, MultiUshortImage *pOutSadImage, int nStaticThre, int *pStaticNum, int Ystart, int Yend, unsigned int *pSadCache, short *pBoxCache)
+{
+	// 块间步长为半个块,子块大小等于步长
+	const int Step = Blocksize / 2;
+	const unsigned int nBlockArea = Blocksize * Blocksize;
+	const unsigned int InitMinSad = nBlockArea * m_nMaxDist * 2;
+	int nWidth8 = pInRefImage->GetImageWidth() / Step;
+	bool bSubPixel = (pOutSubOffsetxImage != NULL && pOutSubOffsetyImage != NULL);
+	BlockSadFunc pCellSad = GetBlockSadFunc<Step>();
+	BlockSadFunc pBlockSad = GetBlockSadFunc<Blocksize>();
+	CellRowSadFunc pCellRowSad = GetCellRowSadFunc<Step>();
 	const int Moveystart = nMoveRangey;
 	const int Moveyend = nMoveRangey;
 	const int Movexstart = nMoveRangex;
 	const int Movexend = nMoveRangex;
-	int nProcs = omp_get_num_procs();
-#pragma omp parallel for num_threads(nProcs) // schedule(guided)
-	for (int y = 0; y < nHeight; y += Step)
+	const int nCandx = Movexstart + Movexend + 1;
+	const int nCandy = Moveystart + Moveyend + 1;
+	const int nCandNum = nCandx * nCandy;
+	const int nBoxSizex = nCandx + ALIGNCELLMARGIN * 2;
+	const int nBoxSizey = nCandy + ALIGNCELLMARGIN * 2;
+	const int nBoxArea = nBoxSizex * nBoxSizey;
+	const int nCellW = nWidth8 + 1;
+	unsigned int *pWinSad = pSadCache + nCellW * nBoxArea * 2;
+	int nSlotRow[2] = {-1, -1};
+	int nStaticNum = 0;
+	for (int Y = Ystart; Y < Yend; Y++)
 	{
-		int Y = y / Step;
+		int y = Y * Step;
+		for (int r = Y; r <= Y + 1; r++)
+		{
+			int slot = r & 1;
+			if (nSlotRow[slot] != r)
+			{
+				nSlotRow[slot] = r;
+				CellRowSadBox<Step>(pInRefImage, pInDebugImage, pPreOffsetxImage, pPreOffsetyImage, r, Ystart, Yend, nMoveRangex, nMoveRangey, nBoxSizex, nBoxSizey, pCellRowSad, pSadCache + slot * nCellW * nBoxArea, pBoxCache + slot * nCellW * 4);
+			}
+		}
+		short *PreOffsetxline = (pPreOffsetxImage != NULL) ? pPreOffsetxImage->GetImageLine(Y) : NULL;
+		short *PreOffsetyline = (pPreOffsetyImage != NULL) ? pPreOffsetyImage->GetImageLine(Y) : NULL;
 		short *NewOffsetxline = pOutOffsetxImage->GetImageLine(Y);
 		short *NewOffsetyline = pOutOffsetyImage->GetImageLine(Y);
-		for (int x = 0; x < nWidth; x += Step)
+		for (int X = 0; X < nWidth8; X++)
 		{
-			int X = x / Step;
-			int Predebugy = y;
-			int Predebugx = x;
-			short Bestofsetx = 0;
-			short Bestofsety = 0;
-			unsigned int MinSad = InitMinSad; //
-			int summ = 0;
-			int sumn = 0;
-			int sumnum = 0;
-			NewOffsetxline[0] = 0;
-			NewOffsetyline[0] = 0;
-			for (int n = -Moveystart; n <= Moveyend; n++)
+			int x = X * Step;
+			int PreOffsetx = (PreOffsetxline != NULL) ? PreOffsetxline[X] : 0;
+			int PreOffsety = (PreOffsetyline != NULL) ? PreOffsetyline[X] : 0;
+			if (nStaticThre > 0)
 			{
-				int debugy = Predebugy + n;
-				for (int m = -Movexstart; m <= Movexend; m++)
+				// 静止块:预测偏移(上一层上采样的结果,最粗层为0)处的平均SAD已在噪声范围内,不再搜索
+				unsigned int PreSad = BlockSad<Blocksize>(pInRefImage, pInDebugImage, x, y, x + PreOffsetx, y + PreOffsety, pBlockSad);
+				if ((int)(PreSad / nBlockArea) < nStaticThre)
 				{
-					int debugx = Predebugx + m;
-					unsigned int Sad = 0;
-					unsigned short *pRef = pInRefImage->GetImagePixel(x, y);
-					unsigned short *pDebug = pInDebugImage->GetImagePixel(debugx, debugy);
-#ifdef USE_NEON
-					uint32x4_t nsumabs = vdupq_n_u32(0);
-					if (debugy >= 0 && debugy < NeonBlocksizey && debugx >= 0 && debugx < NeonBlocksizex)
-					{
-						for (int a = 0; a < Blocksize; a++)
-						{
-							nsumabs = vaddq_u32(nsumabs, vpaddlq_u16(vabdq_u16(vld1q_u16(pRef), vld1q_u16(pDebug))));
-							nsumabs = vaddq_u32(nsumabs, vpaddlq_u16(vabdq_u16(vld1q_u16(pRef + 8), vld1q_u16(pDebug + 8))));
-							pRef += nWidth;
-							pDebug += nWidth;
-						}
-						uint64x2_t nsumsad = vpaddlq_u32(nsumabs);
-#ifdef _WIN32
-						Sad = nsumsad.m128i_u64[0] + nsumsad.m128i_u64[1];
-#else
-						Sad = nsumsad[0] + nsumsad[1];
-#endif
-					}
-					else
+					NewOffsetxline[X] = PreOffsetx;
+					NewOffsetyline[X] = PreOffsety;
+					if (pOutSadImage != NULL)
 					{
-						for (int a = 0; a < Blocksize; a++)
-						{
-							int refy = y + a;
-							int debugynew = debugy + a;
-							for (int b = 0; b < Blocksize; b++)
-							{
-								int refx = x + b;
-								int debugxnew = debugx + b;
-								int Dif = (int)(pInRefImage->GetImagePixel(refx, refy)[0] - pInDebugImage->GetImagePixel(debugxnew, debugynew)[0]);
-								Sad += (unsigned int)ABS(Dif);
-							}
-						}
+						pOutSadImage->GetImageLine(Y)[X] = (unsigned short)(PreSad / nBlockArea);
 					}
-#else
-					for (int a = 0; a < Blocksize; a++)
+					if (bSubPixel)
 					{
-						int refy = y + a;
-						int debugynew = debugy + a;
-						for (int b = 0; b < Blocksize; b++)
-						{
-							int refx = x + b;
-							int debugxnew = debugx + b;
-							Sad += (unsigned int)ABS(pInRefImage->GetImagePixel(refx, refy)[0] - pInDebugImage->GetImagePixel(debugxnew, debugynew)[0]);
-						}
+						pOutSubOffsetxImage->GetImageLine(Y)[X] = PreOffsetx * SUBPIXELVALUE;
+						pOutSubOffsetyImage->GetImageLine(Y)[X] = PreOffsety * SUBPIXELVALUE;
 					}
-#endif
-					/*if (Sad < thre)
-					{
-						summ += m;
-						sumn += n;
-						sumnum++;
-					}*/
+					nStaticNum++;
+					continue;
+				}
+			}
+			// 每个子块搜索窗的起点和行跨度,窗在子块缓存框内时直接指向缓存
+			const unsigned int *pCell[4];
+			int nCellStride[4];
+			for (int c = 0; c < 4; c++)
+			{
+				int cx = X + (c & 1);
+				int cy = Y + (c >> 1);
+				int slot = cy & 1;
+				const short *pb = pBoxCache + (slot * nCellW + cx) * 4;
+				int bx = PreOffsetx - Movexstart - pb[0];
+				int by = PreOffsety - Moveystart - pb[1];
+				if (bx >= 0 && by >= 0 && bx + nCandx <= pb[2] && by + nCandy <= pb[3])
+				{
+					pCell[c] = pSadCache + (slot * nCellW + cx) * nBoxArea + by * pb[2] + bx;
+					nCellStride[c] = pb[2];
+				}
+				else
+				{
+					// 相邻块预偏移相差过大,搜索窗超出缓存框,单独算
+					CellSadWindow<Step>(pInRefImage, pInDebugImage, cx * Step, cy * Step, PreOffsetx, PreOffsety, nMoveRangex, nMoveRangey, pCellSad, pWinSad + c * nCandNum);
+					pCell[c] = pWinSad + c * nCandNum;
+					nCellStride[c] = nCandx;
+				}
+			}
+			// 这三个初始值后面重新规划会影响到动态物体的清晰度
+			short Bestofsetx = PreOffsetx;
+			short Bestofsety = PreOffsety;
+			unsigned int MinSad = InitMinSad; //
+			for (int n = -Moveystart; n <= Moveyend; n++)
+			{
+				int j = n + Moveystart;
+				const unsigned int *p0 = pCell[0] + j * nCellStride[0];
+				const unsigned int *p1 = pCell[1] + j * nCellStride[1];
+				const unsigned int *p2 = pCell[2] + j * nCellStride[2];
+				const unsigned int *p3 = pCell[3] + j * nCellStride[3];
+				int i = 0;
+				for (int m = -Movexstart; m <= Movexend; m++, i++)
+				{
+					unsigned int Sad = p0[i] + p1[i] + p2[i] + p3[i];
 					if (Sad < MinSad)
 					{
 						MinSad = Sad;
@@ -262,24 +881,58 @@ bool CHDRPlus_BlockMatchFusion::EstimatedOffsetNoRef(MultiUshortImage *pInRefIma
 					}
 				}
 			}
-			/*if (sumnum != 0)
+			NewOffsetxline[X] = Bestofsetx + PreOffsetx;
+			NewOffsetyline[X] = Bestofsety + PreOffsety;
+			if (pOutSadImage != NULL)
 			{
-				Bestofsetx = summ / sumnum;
-				Bestofsety = sumn / sumnum;
-			}*/
-			NewOffsetxline[0] = Bestofsetx;
-			NewOffsetyline[0] = Bestofsety;
-			NewOffsetxline++;
-			NewOffsetyline++;
+				// 最终偏移处整块的平均SAD,融合权重直接由它换算,不再单独扫一遍
+				unsigned int BestSad = MinSad;
+				if (MinSad >= InitMinSad)
+				{
+					// 搜索窗内没有更优的点,偏移落在窗外,单独算一次
+					BestSad = BlockSad<Blocksize>(pInRefImage, pInDebugImage, x, y, x + NewOffsetxline[X], y + NewOffsetyline[X], pBlockSad);
+				}
+				pOutSadImage->GetImageLine(Y)[X] = (unsigned short)(BestSad / nBlockArea);
+			}
+			if (bSubPixel)
+			{
+				// 定点偏移(SUBPIXELBIT位小数),最优点在搜索窗内部时用周围3x3的SAD拟合
+				short Subx = NewOffsetxline[X] * SUBPIXELVALUE;
+				short Suby = NewOffsetyline[X] * SUBPIXELVALUE;
+				if (MinSad < InitMinSad && Bestofsetx > -Movexstart && Bestofsetx < Movexend && Bestofsety > -Moveystart && Bestofsety < Moveyend)
+				{
+					float D[3][3];
+					for (int n = 0; n < 3; n++)
+					{
+						int j = Bestofsety + Moveystart + n - 1;
+						int i = Bestofsetx + Movexstart - 1;
+						for (int m = 0; m < 3; m++, i++)
+						{
+							D[n][m] = (float)(pCell[0][j * nCellStride[0] + i] + pCell[1][j * nCellStride[1] + i] + pCell[2][j * nCellStride[2] + i] + pCell[3][j * nCellStride[3] + i]);
+						}
+					}
+					float dx, dy;
+					if (SubPixelQuadraticFit(D, dx, dy))
+					{
+						Subx += (short)floorf(dx * SUBPIXELVALUE + 0.5f);
+						Suby += (short)floorf(dy * SUBPIXELVALUE + 0.5f);
+					}
+				}
+				pOutSubOffsetxImage->GetImageLine(Y)[X] = Subx;
+				pOutSubOffsetyImage->GetImageLine(Y)[X] = Suby;
+			}
 		}
 	}
-	return true;
+	if (pStaticNum != NULL)
+	{
+#pragma omp atomic
+		*pStaticNum += nStaticNum;
+	}
 }
-bool CHDRPlus_BlockMatchFusion::EstimatedOffsetAndRef(MultiUshortImage *pInRefImage, MultiUshortImage *pInDebugImage, MultiShortImage *pPreOffsetxImage, MultiShortImage *pPreOffsetyImage, MultiShortImage *pOutOffsetxImage, MultiShortImage *pOutOffsetyImage, int nMoveRangex, int nMoveRangey)
+template <int Blocksize>
+bool CHDRPlus_BlockMatchFusion::EstimatedOffsetAndRef(MultiUshortImage *pInRefImage, MultiUshortImage *pInDebugImage, MultiShortImage *pPreOffsetxImage, MultiShortImage *pPreOffsetyImage, MultiShortImage *pOutOffsetxImage, MultiShortImage *pOutOffsetyImage, int nMoveRangex, int nMoveRangey, MultiShortImage *pOutSubOffsetxImage, MultiShortImage *pOutSubOffsetyImage, MultiUshortImage *pOutSadImage, int nStaticThre, int *pStaticNum)
 {
-	int Step = 8;
-	int Blocksize = 16;
-	const unsigned int InitMinSad = Blocksize * Blocksize * m_nMaxDist * 2;
+	const int Step = Blocksize / 2;
 	int nWidth = pInRefImage->GetImageWidth();
 	int nHeight = pInRefImage->GetImageHeight();
 	int nWidth8 = nWidth / Step;
@@ -294,352 +947,1541 @@ bool CHDRPlus_BlockMatchFusion::EstimatedOffsetAndRef(MultiUshortImage *pInRefIm
 		if (!pOutOffsetyImage->CreateImageFillValue(nWidth8, nHeight8, 1, 0))
 			return false;
 	}
-	int NeonBlocksizex = (nWidth - Blocksize);
-	int NeonBlocksizey = (nHeight - Blocksize);
-	int Moveystart = nMoveRangey;
-	int Moveyend = nMoveRangey;
-	int Movexstart = nMoveRangex;
-	int Movexend = nMoveRangex;
+	bool bSubPixel = (pOutSubOffsetxImage != NULL && pOutSubOffsetyImage != NULL);
+	if (bSubPixel)
+	{
+		if (!pOutSubOffsetxImage->SetImageSize(nWidth8, nHeight8, 1) || !pOutSubOffsetyImage->SetImageSize(nWidth8, nHeight8, 1))
+			return false;
+	}
+	if (pOutSadImage != NULL)
+	{
+		if (!pOutSadImage->CreateImage(nWidth8, nHeight8, 1, 16))
+			return false;
+	}
+	if (nWidth8 == 0 || nHeight8 == 0)
+		return true;
+	// 对齐块由2x2个子块组成,相邻块共享子块;子块的SAD按绝对位移缓存在覆盖相邻块搜索窗并集的框内,
+	// 预偏移不同的相邻块也共用重叠的位移,每块只需累加4个子块SAD
+	const int nCandNum = (nMoveRangex * 2 + 1) * (nMoveRangey * 2 + 1);
+	const int nBoxArea = (nMoveRangex * 2 + 1 + ALIGNCELLMARGIN * 2) * (nMoveRangey * 2 + 1 + ALIGNCELLMARGIN * 2);
+	const int nCellW = nWidth8 + 1;
+	const int nBandSad = nCellW * nBoxArea * 2 + nCandNum * 4;
 	int nProcs = omp_get_num_procs();
-#pragma omp parallel for num_threads(nProcs) // schedule(dynamic,16)
-	for (int y = 0; y < nHeight; y += Step)
+	int nBands = MIN2(nProcs, nHeight8);
+	unsigned int *pSadBuffer = new unsigned int[nBandSad * nBands];
+	short *pBoxBuffer = new short[nCellW * 4 * 2 * nBands];
+	if (omp_in_parallel())
 	{
-		int Y = y / Step;
-		short *PreOffsetxline = pPreOffsetxImage->GetImageLine(Y);
-		short *PreOffsetyline = pPreOffsetyImage->GetImageLine(Y);
-		short *NewOffsetxline = pOutOffsetxImage->GetImageLine(Y);
-		short *NewOffsetyline = pOutOffsetyImage->GetImageLine(Y);
-		for (int x = 0; x < nWidth; x += Step)
+		// 在帧级任务内调用时按行带拆成子任务,只等待本帧的子任务,其它帧不受影响
+#pragma omp taskloop grainsize(1)
+		for (int band = 0; band < nBands; band++)
 		{
-			int X = x / Step;
-			int PreOffsetx = *PreOffsetxline++;
-			int PreOffsety = *PreOffsetyline++;
-			int Predebugy = y + PreOffsety;
-			int Predebugx = x + PreOffsetx;
-			// 这三个初始值后面重新规划会影响到动态物体的清晰度
-			short Bestofsetx = PreOffsetx;
-			short Bestofsety = PreOffsety;
-			unsigned int MinSad = InitMinSad; //
-			NewOffsetxline[0] = 0;
-			NewOffsetyline[0] = 0;
-			for (int n = -Moveystart; n <= Moveyend; n++)
+			EstimatedOffsetBand<Blocksize>(pInRefImage, pInDebugImage, pPreOffsetxImage, pPreOffsetyImage, pOutOffsetxImage, pOutOffsetyImage, nMoveRangex, nMoveRangey, pOutSubOffsetxImage, pOutSubOffsetyImage, pOutSadImage, nStaticThre, pStaticNum, band * nHeight8 / nBands, (band + 1) * nHeight8 / nBands, pSadBuffer + band * nBandSad, pBoxBuffer + band * nCellW * 4 * 2);
+		}
+	}
+	else
+	{
+#pragma omp parallel for num_threads(nProcs) schedule(dynamic, 1)
+		for (int band = 0; band < nBands; band++)
+		{
+			EstimatedOffsetBand<Blocksize>(pInRefImage, pInDebugImage, pPreOffsetxImage, pPreOffsetyImage, pOutOffsetxImage, pOutOffsetyImage, nMoveRangex, nMoveRangey, pOutSubOffsetxImage, pOutSubOffsetyImage, pOutSadImage, nStaticThre, pStaticNum, band * nHeight8 / nBands, (band + 1) * nHeight8 / nBands, pSadBuffer + band * nBandSad, pBoxBuffer + band * nCellW * 4 * 2);
+		}
+	}
+	delete[] pSadBuffer;
+	delete[] pBoxBuffer;
+	return true;
+}
+inline float CHDRPlus_BlockMatchFusion::SadToWeight(unsigned short AvgSad)
+{
+	float NormDist = MAX2(1.0f, (float)((float)AvgSad - m_nMinDist) / (float)m_nBurstAmountFactor);
+	if (NormDist > (m_nMaxDist - m_nMinDist))
+	{
+		return 0.f;
+	}
+	return 1.f / NormDist;
+}
+// 对齐最后一层输出的块SAD换算成权重,各帧在同一行内累加总权重,帧之间不再有同步和写冲突
+bool CHDRPlus_BlockMatchFusion::EstimatedWeight(MultiUshortImage *pSadImage, int nFrame, CImage_FLOAT *pOutWeightImage)
+{
+	int nWidth = pOutWeightImage[0].GetImageWidth();
+	int nHeight = pOutWeightImage[0].GetImageHeight();
+	int nProcs = omp_get_num_procs();
+#pragma omp parallel for num_threads(nProcs) schedule(dynamic, 16)
+	for (int Y = 0; Y < nHeight; Y++)
+	{
+		float *pOutTotalWeightline = pOutWeightImage[0].GetImageLine(Y);
+		for (int k = 1; k < nFrame; k++)
+		{
+			unsigned short *pSadline = pSadImage[k].GetImageLine(Y);
+			float *pOutWeightline = pOutWeightImage[k].GetImageLine(Y);
+			for (int X = 0; X < nWidth; X++)
+			{
+				pOutWeightline[X] = SadToWeight(pSadline[X]);
+				pOutTotalWeightline[X] += pOutWeightline[X];
+			}
+		}
+	}
+	return true;
+}
+// 融合块一行nLen个像素的加权累加 pAcc[b] += pIn[b] * weiget,16bit x 16bit -> 32bit,nLen为16的倍数
+typedef void (*TileRowMacFunc)(unsigned int *pAcc, const unsigned short *pIn, unsigned short weiget, int nLen);
+static void TileRowMac_C(unsigned int *pAcc, const unsigned short *pIn, unsigned short weiget, int nLen)
+{
+	for (int b = 0; b < nLen; b++)
+	{
+		pAcc[b] += static_cast<uint32_t>(pIn[b]) * weiget;
+	}
+}
+#ifdef USE_NEON
+static void TileRowMac_NEON(unsigned int *pAcc, const unsigned short *pIn, unsigned short weiget, int nLen)
+{
+	for (int b = 0; b < nLen; b += 8)
+	{
+		uint16x8_t v = vld1q_u16(pIn + b);
+		vst1q_u32(pAcc + b, vmlal_n_u16(vld1q_u32(pAcc + b), vget_low_u16(v), weiget));
+		vst1q_u32(pAcc + b + 4, vmlal_n_u16(vld1q_u32(pAcc + b + 4), vget_high_u16(v), weiget));
+	}
+}
+#endif
+#ifdef USE_X86_DISPATCH
+// mullo/mulhi得到32bit乘积的低/高16位,交织后即为4个32bit乘积
+X86_TARGET("sse4.1") static void TileRowMac_SSE41(unsigned int *pAcc, const unsigned short *pIn, unsigned short weiget, int nLen)
+{
+	const __m128i w = _mm_set1_epi16((short)weiget);
+	for (int b = 0; b < nLen; b += 8)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(pIn + b));
+		__m128i lo = _mm_mullo_epi16(v, w);
+		__m128i hi = _mm_mulhi_epu16(v, w);
+		__m128i *pA = (__m128i *)(pAcc + b);
+		_mm_storeu_si128(pA, _mm_add_epi32(_mm_loadu_si128(pA), _mm_unpacklo_epi16(lo, hi)));
+		_mm_storeu_si128(pA + 1, _mm_add_epi32(_mm_loadu_si128(pA + 1), _mm_unpackhi_epi16(lo, hi)));
+	}
+}
+X86_TARGET("avx2") static void TileRowMac_AVX2(unsigned int *pAcc, const unsigned short *pIn, unsigned short weiget, int nLen)
+{
+	const __m256i w = _mm256_set1_epi16((short)weiget);
+	for (int b = 0; b < nLen; b += 16)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(pIn + b));
+		__m256i lo = _mm256_mullo_epi16(v, w);
+		__m256i hi = _mm256_mulhi_epu16(v, w);
+		// unpack在128bit通道内进行,结果为[0-3,8-11]和[4-7,12-15],再按通道重排
+		__m256i ul = _mm256_unpacklo_epi16(lo, hi);
+		__m256i uh = _mm256_unpackhi_epi16(lo, hi);
+		__m256i *pA = (__m256i *)(pAcc + b);
+		_mm256_storeu_si256(pA, _mm256_add_epi32(_mm256_loadu_si256(pA), _mm256_permute2x128_si256(ul, uh, 0x20)));
+		_mm256_storeu_si256(pA + 1, _mm256_add_epi32(_mm256_loadu_si256(pA + 1), _mm256_permute2x128_si256(ul, uh, 0x31)));
+	}
+}
+#endif
+static TileRowMacFunc GetTileRowMacFunc()
+{
+#ifdef USE_NEON
+	return TileRowMac_NEON;
+#else
+#ifdef USE_X86_DISPATCH
+	int nLevel = GetX86SimdLevel();
+	if (nLevel >= X86_SIMD_AVX2)
+		return TileRowMac_AVX2;
+	if (nLevel >= X86_SIMD_SSE41)
+		return TileRowMac_SSE41;
+#endif
+	return TileRowMac_C;
+#endif
+}
+static inline void TileRowMac(unsigned int *pAcc, const unsigned short *pIn, unsigned short weiget, int nLen)
+{
+	static const TileRowMacFunc pTileRowMac = GetTileRowMacFunc();
+	pTileRowMac(pAcc, pIn, weiget, nLen);
+}
+// 频域融合取块时的浮点累加
+static inline void TileRowMac(float *pAcc, const unsigned short *pIn, float weiget, int nLen)
+{
+	for (int b = 0; b < nLen; b++)
+	{
+		pAcc[b] += pIn[b] * weiget;
+	}
+}
+// 把第k帧偏移后的Blocksize x Blocksize块按权重累加到pMergeTile,Fracx/Fracy非0时在相隔2个像素的同色像素间双线性插值
+// 落在原图内的整数偏移直接对原始行做乘累加,插值和碰到填充区的行先生成到临时行里再乘累加
+template <int Blocksize, class T, class W>
+static void AccumulateTile(TRawPadView *pRawImage, int Newx, int Newy, int Fracx, int Fracy, W weiget, T *pMergeTile)
+{
+	unsigned short pLine[Blocksize];
+	if (Fracx != 0 || Fracy != 0)
+	{
+		int w00 = (SUBPIXELVALUE - Fracx) * (SUBPIXELVALUE - Fracy);
+		int w01 = Fracx * (SUBPIXELVALUE - Fracy);
+		int w10 = (SUBPIXELVALUE - Fracx) * Fracy;
+		int w11 = Fracx * Fracy;
+		bool bInside = pRawImage->IsInside(Newx, Newy, Blocksize + 2, Blocksize + 2);
+		for (int a = 0; a < Blocksize; a++)
+		{
+			if (bInside)
 			{
-				int debugy = Predebugy + n;
-				for (int m = -Movexstart; m <= Movexend; m++)
+				const unsigned short *pRawDataline0 = pRawImage->GetImagePos(Newx, Newy + a);
+				const unsigned short *pRawDataline1 = pRawImage->GetImagePos(Newx, Newy + a + 2);
+				for (int b = 0; b < Blocksize; ++b)
 				{
-					int debugx = Predebugx + m;
-					unsigned int Sad = 0;
-					unsigned short *pRef = pInRefImage->GetImagePixel(x, y);
-					unsigned short *pDebug = pInDebugImage->GetImagePixel(debugx, debugy);
+					unsigned int val = w00 * pRawDataline0[b] + w01 * pRawDataline0[b + 2] + w10 * pRawDataline1[b] + w11 * pRawDataline1[b + 2];
+					pLine[b] = (unsigned short)((val + (1 << (2 * SUBPIXELBIT - 1))) >> (2 * SUBPIXELBIT));
+				}
+			}
+			else
+			{
+				unsigned short pLine0[Blocksize + 2], pLine1[Blocksize + 2];
+				pRawImage->GetImageRow(Newx, Newy + a, Blocksize + 2, pLine0);
+				pRawImage->GetImageRow(Newx, Newy + a + 2, Blocksize + 2, pLine1);
+				for (int b = 0; b < Blocksize; ++b)
+				{
+					unsigned int val = w00 * pLine0[b] + w01 * pLine0[b + 2] + w10 * pLine1[b] + w11 * pLine1[b + 2];
+					pLine[b] = (unsigned short)((val + (1 << (2 * SUBPIXELBIT - 1))) >> (2 * SUBPIXELBIT));
+				}
+			}
+			TileRowMac(pMergeTile + a * Blocksize, pLine, weiget, Blocksize);
+		}
+	}
+	else if (pRawImage->IsInside(Newx, Newy, Blocksize, Blocksize))
+	{
+		for (int a = 0; a < Blocksize; a++)
+		{
+			TileRowMac(pMergeTile + a * Blocksize, pRawImage->GetImagePos(Newx, Newy + a), weiget, Blocksize);
+		}
+	}
+	else
+	{
+		for (int a = 0; a < Blocksize; a++)
+		{
+			pRawImage->GetImageRow(Newx, Newy + a, Blocksize, pLine);
+			TileRowMac(pMergeTile + a * Blocksize, pLine, weiget, Blocksize);
+		}
+	}
+}
+// 16点FFT,按列(行向量)同时做16列,数据为16x16的实部/虚部分开存放
+// 输入行须已按位反序排列(由抽取或Transpose16x16Rev完成),输出为自然顺序
+static const float g_fFFT16Cos[8] = {1.0f, 0.92387953f, 0.70710678f, 0.38268343f, 0.0f, -0.38268343f, -0.70710678f, -0.92387953f};
+static const float g_fFFT16Sin[8] = {0.0f, 0.38268343f, 0.70710678f, 0.92387953f, 1.0f, 0.92387953f, 0.70710678f, 0.38268343f};
+static const unsigned char g_nFFT16Rev[16] = {0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15};
+typedef void (*FFT16ColumnsFunc)(float *pRe, float *pIm, int nInverse);
+typedef void (*Transpose16x16RevFunc)(const float *pIn, float *pOut);
+typedef void (*WienerAccumulateFunc)(const float *pRr, const float *pRi, const float *pSr, const float *pSi, float fNoiseX, float fNoiseY, float *pCr, float *pCi);
+typedef void (*SplitTileFunc)(const unsigned short *pIn, int nStride, float *pPlane);
+typedef void (*JoinTileRowFunc)(const float *pRe, const float *pIm, float fScale, unsigned int *pOut);
+static void FFT16Columns_C(float *pRe, float *pIm, int nInverse)
+{
+	for (int nHalf = 1; nHalf < 16; nHalf <<= 1)
+	{
+		int nTwStep = 8 / nHalf;
+		for (int i = 0; i < 16; i += nHalf * 2)
+		{
+			for (int j = 0; j < nHalf; j++)
+			{
+				float wr = g_fFFT16Cos[j * nTwStep];
+				float wi = nInverse ? g_fFFT16Sin[j * nTwStep] : -g_fFFT16Sin[j * nTwStep];
+				float *pUr = pRe + (i + j) * 16;
+				float *pUi = pIm + (i + j) * 16;
+				float *pVr = pUr + nHalf * 16;
+				float *pVi = pUi + nHalf * 16;
+				for (int x = 0; x < 16; x++)
+				{
+					float vr = pVr[x] * wr - pVi[x] * wi;
+					float vi = pVr[x] * wi + pVi[x] * wr;
+					pVr[x] = pUr[x] - vr;
+					pVi[x] = pUi[x] - vi;
+					pUr[x] += vr;
+					pUi[x] += vi;
+				}
+			}
+		}
+	}
+}
+// pOut[rev(x)][y] = pIn[y][x],转置的同时把行排成下一次列FFT需要的位反序
+static void Transpose16x16Rev_C(const float *pIn, float *pOut)
+{
+	for (int y = 0; y < 16; y++)
+	{
+		for (int x = 0; x < 16; x++)
+		{
+			pOut[g_nFFT16Rev[x] * 16 + y] = pIn[y * 16 + x];
+		}
+	}
+}
+// 参考帧频谱R与当前帧频谱S都为打包频谱,差D = R - S = Dx + i*Dy,M = conj(D[-k]),Dx = (D+M)/2,Dy = (D-M)/2i
+// 维纳系数 A = |Dx|^2 / (|Dx|^2 + 噪声),累加 S + Ax*Dx + i*Ay*Dy = S + (Ax*(D+M) + Ay*(D-M)) / 2
+static void WienerAccumulate_C(const float *pRr, const float *pRi, const float *pSr, const float *pSi, float fNoiseX, float fNoiseY, float *pCr, float *pCi)
+{
+	float fNx = 4.0f * fNoiseX + 1e-6f;
+	float fNy = 4.0f * fNoiseY + 1e-6f;
+	for (int a = 0; a < 16; a++)
+	{
+		int ra = (16 - a) & 15;
+		for (int b = 0; b < 16; b++)
+		{
+			int i = a * 16 + b;
+			int m = ra * 16 + ((16 - b) & 15);
+			int c = g_nFFT16Rev[a] * 16 + b;
+			float Dr = pRr[i] - pSr[i];
+			float Di = pRi[i] - pSi[i];
+			float Mr = pRr[m] - pSr[m];
+			float Mi = pRi[m] - pSi[m];
+			float Pr = Dr + Mr;
+			float Pi = Di - Mi;
+			float Qr = Dr - Mr;
+			float Qi = Di + Mi;
+			float P2 = Pr * Pr + Pi * Pi;
+			float Q2 = Qr * Qr + Qi * Qi;
+			float Ax = P2 / (P2 + fNx);
+			float Ay = Q2 / (Q2 + fNy);
+			pCr[c] += pSr[i] + 0.5f * (Ax * Pr + Ay * Qr);
+			pCi[c] += pSi[i] + 0.5f * (Ax * Pi + Ay * Qi);
+		}
+	}
+}
+// 32x32的raw块每行拆成偶列(实部)和奇列(虚部)各16个,第t行存到平面(t&1)的第rev(t/2)行(GatherTilePlanes的布局)
+static void SplitTile_C(const unsigned short *pIn, int nStride, float *pPlane)
+{
+	for (int t = 0; t < 32; t++, pIn += nStride)
+	{
+		float *pRe = pPlane + (t & 1) * 512 + g_nFFT16Rev[t >> 1] * 16;
+		float *pIm = pRe + 256;
+		for (int u = 0; u < 16; u++)
+		{
+			pRe[u] = pIn[2 * u];
+			pIm[u] = pIn[2 * u + 1];
+		}
+	}
+}
+// SplitTile一行的逆过程,乘fScale后四舍五入,负值截到0
+static void JoinTileRow_C(const float *pRe, const float *pIm, float fScale, unsigned int *pOut)
+{
+	for (int u = 0; u < 16; u++)
+	{
+		float val0 = pRe[u] * fScale + 0.5f;
+		float val1 = pIm[u] * fScale + 0.5f;
+		pOut[2 * u] = (val0 > 0.0f) ? (unsigned int)val0 : 0;
+		pOut[2 * u + 1] = (val1 > 0.0f) ? (unsigned int)val1 : 0;
+	}
+}
 #ifdef USE_NEON
-					uint32x4_t nsumabs = vdupq_n_u32(0);
-					if (debugy >= 0 && debugy < NeonBlocksizey && debugx >= 0 && debugx < NeonBlocksizex)
-					{
-						for (int a = 0; a < Blocksize; a++)
-						{
-							nsumabs = vaddq_u32(nsumabs, vpaddlq_u16(vabdq_u16(vld1q_u16(pRef), vld1q_u16(pDebug))));
-							nsumabs = vaddq_u32(nsumabs, vpaddlq_u16(vabdq_u16(vld1q_u16(pRef + 8), vld1q_u16(pDebug + 8))));
-							pRef += nWidth;
-							pDebug += nWidth;
-						}
-						uint64x2_t nsumsad = vpaddlq_u32(nsumabs);
-#ifdef _WIN32
-						Sad = nsumsad.m128i_u64[0] + nsumsad.m128i_u64[1];
+// 蝶形 U ± W*V,旋转因子为1和-i/+i时省掉复数乘法
+static inline void FFT16Butterfly_NEON(float32x4_t &ur, float32x4_t &ui, float32x4_t &vr, float32x4_t &vi, int nTw, int nInverse)
+{
+	float32x4_t tr, ti;
+	if (nTw == 0)
+	{
+		tr = vr;
+		ti = vi;
+	}
+	else if (nTw == 4)
+	{
+		// 正变换乘-i,逆变换乘+i
+		tr = nInverse ? vnegq_f32(vi) : vi;
+		ti = nInverse ? vr : vnegq_f32(vr);
+	}
+	else
+	{
+		float wr = g_fFFT16Cos[nTw];
+		float wi = nInverse ? g_fFFT16Sin[nTw] : -g_fFFT16Sin[nTw];
+		tr = vmlsq_n_f32(vmulq_n_f32(vr, wr), vi, wi);
+		ti = vmlaq_n_f32(vmulq_n_f32(vr, wi), vi, wr);
+	}
+	vr = vsubq_f32(ur, tr);
+	vi = vsubq_f32(ui, ti);
+	ur = vaddq_f32(ur, tr);
+	ui = vaddq_f32(ui, ti);
+}
+// 4级蝶形两两合并在寄存器内完成:前两级每组为连续4行,后两级每组为第j,j+4,j+8,j+12行
+static void FFT16Columns_NEON(float *pRe, float *pIm, int nInverse)
+{
+	for (int x = 0; x < 16; x += 4)
+	{
+		for (int g = 0; g < 16; g += 4)
+		{
+			float32x4_t r0 = vld1q_f32(pRe + g * 16 + x);
+			float32x4_t r1 = vld1q_f32(pRe + (g + 1) * 16 + x);
+			float32x4_t r2 = vld1q_f32(pRe + (g + 2) * 16 + x);
+			float32x4_t r3 = vld1q_f32(pRe + (g + 3) * 16 + x);
+			float32x4_t m0 = vld1q_f32(pIm + g * 16 + x);
+			float32x4_t m1 = vld1q_f32(pIm + (g + 1) * 16 + x);
+			float32x4_t m2 = vld1q_f32(pIm + (g + 2) * 16 + x);
+			float32x4_t m3 = vld1q_f32(pIm + (g + 3) * 16 + x);
+			FFT16Butterfly_NEON(r0, m0, r1, m1, 0, nInverse);
+			FFT16Butterfly_NEON(r2, m2, r3, m3, 0, nInverse);
+			FFT16Butterfly_NEON(r0, m0, r2, m2, 0, nInverse);
+			FFT16Butterfly_NEON(r1, m1, r3, m3, 4, nInverse);
+			vst1q_f32(pRe + g * 16 + x, r0);
+			vst1q_f32(pRe + (g + 1) * 16 + x, r1);
+			vst1q_f32(pRe + (g + 2) * 16 + x, r2);
+			vst1q_f32(pRe + (g + 3) * 16 + x, r3);
+			vst1q_f32(pIm + g * 16 + x, m0);
+			vst1q_f32(pIm + (g + 1) * 16 + x, m1);
+			vst1q_f32(pIm + (g + 2) * 16 + x, m2);
+			vst1q_f32(pIm + (g + 3) * 16 + x, m3);
+		}
+		for (int j = 0; j < 4; j++)
+		{
+			float32x4_t r0 = vld1q_f32(pRe + j * 16 + x);
+			float32x4_t r1 = vld1q_f32(pRe + (j + 4) * 16 + x);
+			float32x4_t r2 = vld1q_f32(pRe + (j + 8) * 16 + x);
+			float32x4_t r3 = vld1q_f32(pRe + (j + 12) * 16 + x);
+			float32x4_t m0 = vld1q_f32(pIm + j * 16 + x);
+			float32x4_t m1 = vld1q_f32(pIm + (j + 4) * 16 + x);
+			float32x4_t m2 = vld1q_f32(pIm + (j + 8) * 16 + x);
+			float32x4_t m3 = vld1q_f32(pIm + (j + 12) * 16 + x);
+			FFT16Butterfly_NEON(r0, m0, r1, m1, j * 2, nInverse);
+			FFT16Butterfly_NEON(r2, m2, r3, m3, j * 2, nInverse);
+			FFT16Butterfly_NEON(r0, m0, r2, m2, j, nInverse);
+			FFT16Butterfly_NEON(r1, m1, r3, m3, j + 4, nInverse);
+			vst1q_f32(pRe + j * 16 + x, r0);
+			vst1q_f32(pRe + (j + 4) * 16 + x, r1);
+			vst1q_f32(pRe + (j + 8) * 16 + x, r2);
+			vst1q_f32(pRe + (j + 12) * 16 + x, r3);
+			vst1q_f32(pIm + j * 16 + x, m0);
+			vst1q_f32(pIm + (j + 4) * 16 + x, m1);
+			vst1q_f32(pIm + (j + 8) * 16 + x, m2);
+			vst1q_f32(pIm + (j + 12) * 16 + x, m3);
+		}
+	}
+}
+// 16个4x4子块分别转置,输出行按位反序写出
+static void Transpose16x16Rev_NEON(const float *pIn, float *pOut)
+{
+	for (int by = 0; by < 16; by += 4)
+	{
+		for (int bx = 0; bx < 16; bx += 4)
+		{
+			const float *pBlock = pIn + by * 16 + bx;
+			float32x4x2_t t01 = vtrnq_f32(vld1q_f32(pBlock), vld1q_f32(pBlock + 16));
+			float32x4x2_t t23 = vtrnq_f32(vld1q_f32(pBlock + 32), vld1q_f32(pBlock + 48));
+			vst1q_f32(pOut + g_nFFT16Rev[bx + 0] * 16 + by, vcombine_f32(vget_low_f32(t01.val[0]), vget_low_f32(t23.val[0])));
+			vst1q_f32(pOut + g_nFFT16Rev[bx + 1] * 16 + by, vcombine_f32(vget_low_f32(t01.val[1]), vget_low_f32(t23.val[1])));
+			vst1q_f32(pOut + g_nFFT16Rev[bx + 2] * 16 + by, vcombine_f32(vget_high_f32(t01.val[0]), vget_high_f32(t23.val[0])));
+			vst1q_f32(pOut + g_nFFT16Rev[bx + 3] * 16 + by, vcombine_f32(vget_high_f32(t01.val[1]), vget_high_f32(t23.val[1])));
+		}
+	}
+}
+// 4个一组的倒序
+static inline float32x4_t Reverse4_NEON(float32x4_t v)
+{
+	float32x4_t r = vrev64q_f32(v);
+	return vcombine_f32(vget_high_f32(r), vget_low_f32(r));
+}
+// armv7没有除法指令,倒数估计后两次牛顿迭代
+static inline float32x4_t Divide_NEON(float32x4_t a, float32x4_t b)
+{
+	float32x4_t r = vrecpeq_f32(b);
+	r = vmulq_f32(vrecpsq_f32(b, r), r);
+	r = vmulq_f32(vrecpsq_f32(b, r), r);
+	return vmulq_f32(a, r);
+}
+// 第a行与共轭对称的第ra行一起处理:P(-k) = conj(P(k)),Q(-k) = -conj(Q(k)),系数A相同,
+// 记U = Ax*P/2,V = Ay*Q/2,第a行累加 S + U + V,第ra行的共轭对称位置累加 S + conj(U - V)
+static inline void WienerGain_NEON(float32x4_t Dr, float32x4_t Di, float32x4_t mr, float32x4_t mi, float32x4_t nx, float32x4_t ny, float32x4_t &Ur, float32x4_t &Ui, float32x4_t &Vr, float32x4_t &Vi)
+{
+	float32x4_t Pr = vaddq_f32(Dr, mr);
+	float32x4_t Pi = vsubq_f32(Di, mi);
+	float32x4_t Qr = vsubq_f32(Dr, mr);
+	float32x4_t Qi = vaddq_f32(Di, mi);
+	float32x4_t P2 = vmlaq_f32(vmulq_f32(Pr, Pr), Pi, Pi);
+	float32x4_t Q2 = vmlaq_f32(vmulq_f32(Qr, Qr), Qi, Qi);
+	float32x4_t Ax = vmulq_n_f32(Divide_NEON(P2, vaddq_f32(P2, nx)), 0.5f);
+	float32x4_t Ay = vmulq_n_f32(Divide_NEON(Q2, vaddq_f32(Q2, ny)), 0.5f);
+	Ur = vmulq_f32(Ax, Pr);
+	Ui = vmulq_f32(Ax, Pi);
+	Vr = vmulq_f32(Ay, Qr);
+	Vi = vmulq_f32(Ay, Qi);
+}
+static void WienerAccumulate_NEON(const float *pRr, const float *pRi, const float *pSr, const float *pSi, float fNoiseX, float fNoiseY, float *pCr, float *pCi)
+{
+	const float32x4_t nx = vdupq_n_f32(4.0f * fNoiseX + 1e-6f);
+	const float32x4_t ny = vdupq_n_f32(4.0f * fNoiseY + 1e-6f);
+	for (int a = 0; a <= 8; a++)
+	{
+		int ra = (16 - a) & 15;
+		// 共轭对称位置 (16-b)&15 的第k组为 rev([d(13-4k)..d(16-4k)])
+		float32x4_t dr[4], di[4], er[4], ei[4];
+		for (int k = 0; k < 4; k++)
+		{
+			dr[k] = vsubq_f32(vld1q_f32(pRr + a * 16 + k * 4), vld1q_f32(pSr + a * 16 + k * 4));
+			di[k] = vsubq_f32(vld1q_f32(pRi + a * 16 + k * 4), vld1q_f32(pSi + a * 16 + k * 4));
+			er[k] = vsubq_f32(vld1q_f32(pRr + ra * 16 + k * 4), vld1q_f32(pSr + ra * 16 + k * 4));
+			ei[k] = vsubq_f32(vld1q_f32(pRi + ra * 16 + k * 4), vld1q_f32(pSi + ra * 16 + k * 4));
+		}
+		float32x4_t wr[4], wi[4];
+		for (int k = 0; k < 4; k++)
+		{
+			int i = a * 16 + k * 4;
+			int c = g_nFFT16Rev[a] * 16 + k * 4;
+			float32x4_t mr = Reverse4_NEON(vextq_f32(er[3 - k], er[(4 - k) & 3], 1));
+			float32x4_t mi = Reverse4_NEON(vextq_f32(ei[3 - k], ei[(4 - k) & 3], 1));
+			float32x4_t Ur, Ui, Vr, Vi;
+			WienerGain_NEON(dr[k], di[k], mr, mi, nx, ny, Ur, Ui, Vr, Vi);
+			vst1q_f32(pCr + c, vaddq_f32(vaddq_f32(vld1q_f32(pCr + c), vld1q_f32(pSr + i)), vaddq_f32(Ur, Vr)));
+			vst1q_f32(pCi + c, vaddq_f32(vaddq_f32(vld1q_f32(pCi + c), vld1q_f32(pSi + i)), vaddq_f32(Ui, Vi)));
+			wr[k] = vsubq_f32(Ur, Vr);
+			wi[k] = vsubq_f32(Vi, Ui);
+		}
+		if (ra == a)
+			continue;
+		for (int k = 0; k < 4; k++)
+		{
+			int i = ra * 16 + k * 4;
+			int c = g_nFFT16Rev[ra] * 16 + k * 4;
+			float32x4_t tr = Reverse4_NEON(vextq_f32(wr[3 - k], wr[(4 - k) & 3], 1));
+			float32x4_t ti = Reverse4_NEON(vextq_f32(wi[3 - k], wi[(4 - k) & 3], 1));
+			vst1q_f32(pCr + c, vaddq_f32(vaddq_f32(vld1q_f32(pCr + c), vld1q_f32(pSr + i)), tr));
+			vst1q_f32(pCi + c, vaddq_f32(vaddq_f32(vld1q_f32(pCi + c), vld1q_f32(pSi + i)), ti));
+		}
+	}
+}
+static void SplitTile_NEON(const unsigned short *pIn, int nStride, float *pPlane)
+{
+	for (int t = 0; t < 32; t++, pIn += nStride)
+	{
+		float *pRe = pPlane + (t & 1) * 512 + g_nFFT16Rev[t >> 1] * 16;
+		float *pIm = pRe + 256;
+		for (int u = 0; u < 16; u += 8)
+		{
+			uint16x8x2_t v = vld2q_u16(pIn + 2 * u);
+			vst1q_f32(pRe + u, vcvtq_f32_u32(vmovl_u16(vget_low_u16(v.val[0]))));
+			vst1q_f32(pRe + u + 4, vcvtq_f32_u32(vmovl_u16(vget_high_u16(v.val[0]))));
+			vst1q_f32(pIm + u, vcvtq_f32_u32(vmovl_u16(vget_low_u16(v.val[1]))));
+			vst1q_f32(pIm + u + 4, vcvtq_f32_u32(vmovl_u16(vget_high_u16(v.val[1]))));
+		}
+	}
+}
+// 转无符号整数时向0截断,负值饱和为0
+static void JoinTileRow_NEON(const float *pRe, const float *pIm, float fScale, unsigned int *pOut)
+{
+	const float32x4_t half = vdupq_n_f32(0.5f);
+	for (int u = 0; u < 16; u += 4)
+	{
+		uint32x4x2_t v;
+		v.val[0] = vcvtq_u32_f32(vmlaq_n_f32(half, vld1q_f32(pRe + u), fScale));
+		v.val[1] = vcvtq_u32_f32(vmlaq_n_f32(half, vld1q_f32(pIm + u), fScale));
+		vst2q_u32(pOut + 2 * u, v);
+	}
+}
+#endif
+#ifdef USE_X86_DISPATCH
+X86_TARGET("sse4.1") static inline void FFT16Butterfly_SSE41(__m128 &ur, __m128 &ui, __m128 &vr, __m128 &vi, int nTw, int nInverse)
+{
+	__m128 tr, ti;
+	if (nTw == 0)
+	{
+		tr = vr;
+		ti = vi;
+	}
+	else if (nTw == 4)
+	{
+		tr = nInverse ? _mm_sub_ps(_mm_setzero_ps(), vi) : vi;
+		ti = nInverse ? vr : _mm_sub_ps(_mm_setzero_ps(), vr);
+	}
+	else
+	{
+		__m128 wr = _mm_set1_ps(g_fFFT16Cos[nTw]);
+		__m128 wi = _mm_set1_ps(nInverse ? g_fFFT16Sin[nTw] : -g_fFFT16Sin[nTw]);
+		tr = _mm_sub_ps(_mm_mul_ps(vr, wr), _mm_mul_ps(vi, wi));
+		ti = _mm_add_ps(_mm_mul_ps(vr, wi), _mm_mul_ps(vi, wr));
+	}
+	vr = _mm_sub_ps(ur, tr);
+	vi = _mm_sub_ps(ui, ti);
+	ur = _mm_add_ps(ur, tr);
+	ui = _mm_add_ps(ui, ti);
+}
+X86_TARGET("sse4.1") static void FFT16Columns_SSE41(float *pRe, float *pIm, int nInverse)
+{
+	for (int x = 0; x < 16; x += 4)
+	{
+		for (int g = 0; g < 16; g += 4)
+		{
+			__m128 r0 = _mm_loadu_ps(pRe + g * 16 + x);
+			__m128 r1 = _mm_loadu_ps(pRe + (g + 1) * 16 + x);
+			__m128 r2 = _mm_loadu_ps(pRe + (g + 2) * 16 + x);
+			__m128 r3 = _mm_loadu_ps(pRe + (g + 3) * 16 + x);
+			__m128 m0 = _mm_loadu_ps(pIm + g * 16 + x);
+			__m128 m1 = _mm_loadu_ps(pIm + (g + 1) * 16 + x);
+			__m128 m2 = _mm_loadu_ps(pIm + (g + 2) * 16 + x);
+			__m128 m3 = _mm_loadu_ps(pIm + (g + 3) * 16 + x);
+			FFT16Butterfly_SSE41(r0, m0, r1, m1, 0, nInverse);
+			FFT16Butterfly_SSE41(r2, m2, r3, m3, 0, nInverse);
+			FFT16Butterfly_SSE41(r0, m0, r2, m2, 0, nInverse);
+			FFT16Butterfly_SSE41(r1, m1, r3, m3, 4, nInverse);
+			_mm_storeu_ps(pRe + g * 16 + x, r0);
+			_mm_storeu_ps(pRe + (g + 1) * 16 + x, r1);
+			_mm_storeu_ps(pRe + (g + 2) * 16 + x, r2);
+			_mm_storeu_ps(pRe + (g + 3) * 16 + x, r3);
+			_mm_storeu_ps(pIm + g * 16 + x, m0);
+			_mm_storeu_ps(pIm + (g + 1) * 16 + x, m1);
+			_mm_storeu_ps(pIm + (g + 2) * 16 + x, m2);
+			_mm_storeu_ps(pIm + (g + 3) * 16 + x, m3);
+		}
+		for (int j = 0; j < 4; j++)
+		{
+			__m128 r0 = _mm_loadu_ps(pRe + j * 16 + x);
+			__m128 r1 = _mm_loadu_ps(pRe + (j + 4) * 16 + x);
+			__m128 r2 = _mm_loadu_ps(pRe + (j + 8) * 16 + x);
+			__m128 r3 = _mm_loadu_ps(pRe + (j + 12) * 16 + x);
+			__m128 m0 = _mm_loadu_ps(pIm + j * 16 + x);
+			__m128 m1 = _mm_loadu_ps(pIm + (j + 4) * 16 + x);
+			__m128 m2 = _mm_loadu_ps(pIm + (j + 8) * 16 + x);
+			__m128 m3 = _mm_loadu_ps(pIm + (j + 12) * 16 + x);
+			FFT16Butterfly_SSE41(r0, m0, r1, m1, j * 2, nInverse);
+			FFT16Butterfly_SSE41(r2, m2, r3, m3, j * 2, nInverse);
+			FFT16Butterfly_SSE41(r0, m0, r2, m2, j, nInverse);
+			FFT16Butterfly_SSE41(r1, m1, r3, m3, j + 4, nInverse);
+			_mm_storeu_ps(pRe + j * 16 + x, r0);
+			_mm_storeu_ps(pRe + (j + 4) * 16 + x, r1);
+			_mm_storeu_ps(pRe + (j + 8) * 16 + x, r2);
+			_mm_storeu_ps(pRe + (j + 12) * 16 + x, r3);
+			_mm_storeu_ps(pIm + j * 16 + x, m0);
+			_mm_storeu_ps(pIm + (j + 4) * 16 + x, m1);
+			_mm_storeu_ps(pIm + (j + 8) * 16 + x, m2);
+			_mm_storeu_ps(pIm + (j + 12) * 16 + x, m3);
+		}
+	}
+}
+X86_TARGET("sse4.1") static void Transpose16x16Rev_SSE41(const float *pIn, float *pOut)
+{
+	for (int by = 0; by < 16; by += 4)
+	{
+		for (int bx = 0; bx < 16; bx += 4)
+		{
+			const float *pBlock = pIn + by * 16 + bx;
+			__m128 r0 = _mm_loadu_ps(pBlock);
+			__m128 r1 = _mm_loadu_ps(pBlock + 16);
+			__m128 r2 = _mm_loadu_ps(pBlock + 32);
+			__m128 r3 = _mm_loadu_ps(pBlock + 48);
+			_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+			_mm_storeu_ps(pOut + g_nFFT16Rev[bx + 0] * 16 + by, r0);
+			_mm_storeu_ps(pOut + g_nFFT16Rev[bx + 1] * 16 + by, r1);
+			_mm_storeu_ps(pOut + g_nFFT16Rev[bx + 2] * 16 + by, r2);
+			_mm_storeu_ps(pOut + g_nFFT16Rev[bx + 3] * 16 + by, r3);
+		}
+	}
+}
+// 倒数近似加一次牛顿迭代,比除法吞吐高,相对误差约1e-7
+X86_TARGET("sse4.1") static inline __m128 Reciprocal_SSE41(__m128 d)
+{
+	__m128 x = _mm_rcp_ps(d);
+	return _mm_mul_ps(x, _mm_sub_ps(_mm_set1_ps(2.0f), _mm_mul_ps(d, x)));
+}
+// 共轭对称位置的第k组为 rev([d(13-4k)..d(16-4k)]),由相邻两组拼接后倒序得到
+X86_TARGET("sse4.1") static inline __m128 MirrorGroup_SSE41(__m128 lo, __m128 hi)
+{
+	__m128 v = _mm_castsi128_ps(_mm_alignr_epi8(_mm_castps_si128(hi), _mm_castps_si128(lo), 4));
+	return _mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 1, 2, 3));
+}
+// 与NEON版相同,第a行与第ra行一起处理
+X86_TARGET("sse4.1") static inline void WienerGain_SSE41(__m128 Dr, __m128 Di, __m128 mr, __m128 mi, __m128 nx, __m128 ny, __m128 &Ur, __m128 &Ui, __m128 &Vr, __m128 &Vi)
+{
+	const __m128 half = _mm_set1_ps(0.5f);
+	__m128 Pr = _mm_add_ps(Dr, mr);
+	__m128 Pi = _mm_sub_ps(Di, mi);
+	__m128 Qr = _mm_sub_ps(Dr, mr);
+	__m128 Qi = _mm_add_ps(Di, mi);
+	__m128 P2 = _mm_add_ps(_mm_mul_ps(Pr, Pr), _mm_mul_ps(Pi, Pi));
+	__m128 Q2 = _mm_add_ps(_mm_mul_ps(Qr, Qr), _mm_mul_ps(Qi, Qi));
+	__m128 Ax = _mm_mul_ps(half, _mm_mul_ps(P2, Reciprocal_SSE41(_mm_add_ps(P2, nx))));
+	__m128 Ay = _mm_mul_ps(half, _mm_mul_ps(Q2, Reciprocal_SSE41(_mm_add_ps(Q2, ny))));
+	Ur = _mm_mul_ps(Ax, Pr);
+	Ui = _mm_mul_ps(Ax, Pi);
+	Vr = _mm_mul_ps(Ay, Qr);
+	Vi = _mm_mul_ps(Ay, Qi);
+}
+X86_TARGET("sse4.1") static void WienerAccumulate_SSE41(const float *pRr, const float *pRi, const float *pSr, const float *pSi, float fNoiseX, float fNoiseY, float *pCr, float *pCi)
+{
+	const __m128 nx = _mm_set1_ps(4.0f * fNoiseX + 1e-6f);
+	const __m128 ny = _mm_set1_ps(4.0f * fNoiseY + 1e-6f);
+	for (int a = 0; a <= 8; a++)
+	{
+		int ra = (16 - a) & 15;
+		__m128 dr[4], di[4], er[4], ei[4];
+		for (int k = 0; k < 4; k++)
+		{
+			dr[k] = _mm_sub_ps(_mm_loadu_ps(pRr + a * 16 + k * 4), _mm_loadu_ps(pSr + a * 16 + k * 4));
+			di[k] = _mm_sub_ps(_mm_loadu_ps(pRi + a * 16 + k * 4), _mm_loadu_ps(pSi + a * 16 + k * 4));
+			er[k] = _mm_sub_ps(_mm_loadu_ps(pRr + ra * 16 + k * 4), _mm_loadu_ps(pSr + ra * 16 + k * 4));
+			ei[k] = _mm_sub_ps(_mm_loadu_ps(pRi + ra * 16 + k * 4), _mm_loadu_ps(pSi + ra * 16 + k * 4));
+		}
+		__m128 wr[4], wi[4];
+		for (int k = 0; k < 4; k++)
+		{
+			int i = a * 16 + k * 4;
+			int c = g_nFFT16Rev[a] * 16 + k * 4;
+			__m128 Ur, Ui, Vr, Vi;
+			WienerGain_SSE41(dr[k], di[k], MirrorGroup_SSE41(er[3 - k], er[(4 - k) & 3]), MirrorGroup_SSE41(ei[3 - k], ei[(4 - k) & 3]), nx, ny, Ur, Ui, Vr, Vi);
+			_mm_storeu_ps(pCr + c, _mm_add_ps(_mm_add_ps(_mm_loadu_ps(pCr + c), _mm_loadu_ps(pSr + i)), _mm_add_ps(Ur, Vr)));
+			_mm_storeu_ps(pCi + c, _mm_add_ps(_mm_add_ps(_mm_loadu_ps(pCi + c), _mm_loadu_ps(pSi + i)), _mm_add_ps(Ui, Vi)));
+			wr[k] = _mm_sub_ps(Ur, Vr);
+			wi[k] = _mm_sub_ps(Vi, Ui);
+		}
+		if (ra == a)
+			continue;
+		for (int k = 0; k < 4; k++)
+		{
+			int i = ra * 16 + k * 4;
+			int c = g_nFFT16Rev[ra] * 16 + k * 4;
+			_mm_storeu_ps(pCr + c, _mm_add_ps(_mm_add_ps(_mm_loadu_ps(pCr + c), _mm_loadu_ps(pSr + i)), MirrorGroup_SSE41(wr[3 - k], wr[(4 - k) & 3])));
+			_mm_storeu_ps(pCi + c, _mm_add_ps(_mm_add_ps(_mm_loadu_ps(pCi + c), _mm_loadu_ps(pSi + i)), MirrorGroup_SSE41(wi[3 - k], wi[(4 - k) & 3])));
+		}
+	}
+}
+// 每个u32通道的低16位为偶列,高16位为奇列
+X86_TARGET("sse4.1") static void SplitTile_SSE41(const unsigned short *pIn, int nStride, float *pPlane)
+{
+	const __m128i mask = _mm_set1_epi32(0xFFFF);
+	for (int t = 0; t < 32; t++, pIn += nStride)
+	{
+		float *pRe = pPlane + (t & 1) * 512 + g_nFFT16Rev[t >> 1] * 16;
+		float *pIm = pRe + 256;
+		for (int u = 0; u < 16; u += 4)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i *)(pIn + 2 * u));
+			_mm_storeu_ps(pRe + u, _mm_cvtepi32_ps(_mm_and_si128(v, mask)));
+			_mm_storeu_ps(pIm + u, _mm_cvtepi32_ps(_mm_srli_epi32(v, 16)));
+		}
+	}
+}
+X86_TARGET("sse4.1") static void JoinTileRow_SSE41(const float *pRe, const float *pIm, float fScale, unsigned int *pOut)
+{
+	const __m128 scale = _mm_set1_ps(fScale);
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128 zero = _mm_setzero_ps();
+	for (int u = 0; u < 16; u += 4)
+	{
+		__m128i e = _mm_cvttps_epi32(_mm_max_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(pRe + u), scale), half), zero));
+		__m128i o = _mm_cvttps_epi32(_mm_max_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(pIm + u), scale), half), zero));
+		_mm_storeu_si128((__m128i *)(pOut + 2 * u), _mm_unpacklo_epi32(e, o));
+		_mm_storeu_si128((__m128i *)(pOut + 2 * u + 4), _mm_unpackhi_epi32(e, o));
+	}
+}
+X86_TARGET("avx2") static inline void FFT16Butterfly_AVX2(__m256 &ur, __m256 &ui, __m256 &vr, __m256 &vi, int nTw, int nInverse)
+{
+	__m256 tr, ti;
+	if (nTw == 0)
+	{
+		tr = vr;
+		ti = vi;
+	}
+	else if (nTw == 4)
+	{
+		tr = nInverse ? _mm256_sub_ps(_mm256_setzero_ps(), vi) : vi;
+		ti = nInverse ? vr : _mm256_sub_ps(_mm256_setzero_ps(), vr);
+	}
+	else
+	{
+		__m256 wr = _mm256_set1_ps(g_fFFT16Cos[nTw]);
+		__m256 wi = _mm256_set1_ps(nInverse ? g_fFFT16Sin[nTw] : -g_fFFT16Sin[nTw]);
+		tr = _mm256_sub_ps(_mm256_mul_ps(vr, wr), _mm256_mul_ps(vi, wi));
+		ti = _mm256_add_ps(_mm256_mul_ps(vr, wi), _mm256_mul_ps(vi, wr));
+	}
+	vr = _mm256_sub_ps(ur, tr);
+	vi = _mm256_sub_ps(ui, ti);
+	ur = _mm256_add_ps(ur, tr);
+	ui = _mm256_add_ps(ui, ti);
+}
+X86_TARGET("avx2") static void FFT16Columns_AVX2(float *pRe, float *pIm, int nInverse)
+{
+	for (int x = 0; x < 16; x += 8)
+	{
+		for (int g = 0; g < 16; g += 4)
+		{
+			__m256 r0 = _mm256_loadu_ps(pRe + g * 16 + x);
+			__m256 r1 = _mm256_loadu_ps(pRe + (g + 1) * 16 + x);
+			__m256 r2 = _mm256_loadu_ps(pRe + (g + 2) * 16 + x);
+			__m256 r3 = _mm256_loadu_ps(pRe + (g + 3) * 16 + x);
+			__m256 m0 = _mm256_loadu_ps(pIm + g * 16 + x);
+			__m256 m1 = _mm256_loadu_ps(pIm + (g + 1) * 16 + x);
+			__m256 m2 = _mm256_loadu_ps(pIm + (g + 2) * 16 + x);
+			__m256 m3 = _mm256_loadu_ps(pIm + (g + 3) * 16 + x);
+			FFT16Butterfly_AVX2(r0, m0, r1, m1, 0, nInverse);
+			FFT16Butterfly_AVX2(r2, m2, r3, m3, 0, nInverse);
+			FFT16Butterfly_AVX2(r0, m0, r2, m2, 0, nInverse);
+			FFT16Butterfly_AVX2(r1, m1, r3, m3, 4, nInverse);
+			_mm256_storeu_ps(pRe + g * 16 + x, r0);
+			_mm256_storeu_ps(pRe + (g + 1) * 16 + x, r1);
+			_mm256_storeu_ps(pRe + (g + 2) * 16 + x, r2);
+			_mm256_storeu_ps(pRe + (g + 3) * 16 + x, r3);
+			_mm256_storeu_ps(pIm + g * 16 + x, m0);
+			_mm256_storeu_ps(pIm + (g + 1) * 16 + x, m1);
+			_mm256_storeu_ps(pIm + (g + 2) * 16 + x, m2);
+			_mm256_storeu_ps(pIm + (g + 3) * 16 + x, m3);
+		}
+		for (int j = 0; j < 4; j++)
+		{
+			__m256 r0 = _mm256_loadu_ps(pRe + j * 16 + x);
+			__m256 r1 = _mm256_loadu_ps(pRe + (j + 4) * 16 + x);
+			__m256 r2 = _mm256_loadu_ps(pRe + (j + 8) * 16 + x);
+			__m256 r3 = _mm256_loadu_ps(pRe + (j + 12) * 16 + x);
+			__m256 m0 = _mm256_loadu_ps(pIm + j * 16 + x);
+			__m256 m1 = _mm256_loadu_ps(pIm + (j + 4) * 16 + x);
+			__m256 m2 = _mm256_loadu_ps(pIm + (j + 8) * 16 + x);
+			__m256 m3 = _mm256_loadu_ps(pIm + (j + 12) * 16 + x);
+			FFT16Butterfly_AVX2(r0, m0, r1, m1, j * 2, nInverse);
+			FFT16Butterfly_AVX2(r2, m2, r3, m3, j * 2, nInverse);
+			FFT16Butterfly_AVX2(r0, m0, r2, m2, j, nInverse);
+			FFT16Butterfly_AVX2(r1, m1, r3, m3, j + 4, nInverse);
+			_mm256_storeu_ps(pRe + j * 16 + x, r0);
+			_mm256_storeu_ps(pRe + (j + 4) * 16 + x, r1);
+			_mm256_storeu_ps(pRe + (j + 8) * 16 + x, r2);
+			_mm256_storeu_ps(pRe + (j + 12) * 16 + x, r3);
+			_mm256_storeu_ps(pIm + j * 16 + x, m0);
+			_mm256_storeu_ps(pIm + (j + 4) * 16 + x, m1);
+			_mm256_storeu_ps(pIm + (j + 8) * 16 + x, m2);
+			_mm256_storeu_ps(pIm + (j + 12) * 16 + x, m3);
+		}
+	}
+}
+// 4个8x8子块分别转置,输出行按位反序写出
+X86_TARGET("avx2") static void Transpose16x16Rev_AVX2(const float *pIn, float *pOut)
+{
+	for (int by = 0; by < 16; by += 8)
+	{
+		for (int bx = 0; bx < 16; bx += 8)
+		{
+			const float *pBlock = pIn + by * 16 + bx;
+			__m256 r0 = _mm256_loadu_ps(pBlock);
+			__m256 r1 = _mm256_loadu_ps(pBlock + 16);
+			__m256 r2 = _mm256_loadu_ps(pBlock + 32);
+			__m256 r3 = _mm256_loadu_ps(pBlock + 48);
+			__m256 r4 = _mm256_loadu_ps(pBlock + 64);
+			__m256 r5 = _mm256_loadu_ps(pBlock + 80);
+			__m256 r6 = _mm256_loadu_ps(pBlock + 96);
+			__m256 r7 = _mm256_loadu_ps(pBlock + 112);
+			__m256 t0 = _mm256_unpacklo_ps(r0, r1);
+			__m256 t1 = _mm256_unpackhi_ps(r0, r1);
+			__m256 t2 = _mm256_unpacklo_ps(r2, r3);
+			__m256 t3 = _mm256_unpackhi_ps(r2, r3);
+			__m256 t4 = _mm256_unpacklo_ps(r4, r5);
+			__m256 t5 = _mm256_unpackhi_ps(r4, r5);
+			__m256 t6 = _mm256_unpacklo_ps(r6, r7);
+			__m256 t7 = _mm256_unpackhi_ps(r6, r7);
+			r0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+			r1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+			r2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+			r3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+			r4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+			r5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+			r6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+			r7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+			_mm256_storeu_ps(pOut + g_nFFT16Rev[bx + 0] * 16 + by, _mm256_permute2f128_ps(r0, r4, 0x20));
+			_mm256_storeu_ps(pOut + g_nFFT16Rev[bx + 1] * 16 + by, _mm256_permute2f128_ps(r1, r5, 0x20));
+			_mm256_storeu_ps(pOut + g_nFFT16Rev[bx + 2] * 16 + by, _mm256_permute2f128_ps(r2, r6, 0x20));
+			_mm256_storeu_ps(pOut + g_nFFT16Rev[bx + 3] * 16 + by, _mm256_permute2f128_ps(r3, r7, 0x20));
+			_mm256_storeu_ps(pOut + g_nFFT16Rev[bx + 4] * 16 + by, _mm256_permute2f128_ps(r0, r4, 0x31));
+			_mm256_storeu_ps(pOut + g_nFFT16Rev[bx + 5] * 16 + by, _mm256_permute2f128_ps(r1, r5, 0x31));
+			_mm256_storeu_ps(pOut + g_nFFT16Rev[bx + 6] * 16 + by, _mm256_permute2f128_ps(r2, r6, 0x31));
+			_mm256_storeu_ps(pOut + g_nFFT16Rev[bx + 7] * 16 + by, _mm256_permute2f128_ps(r3, r7, 0x31));
+		}
+	}
+}
+X86_TARGET("avx2") static inline __m256 Reciprocal_AVX2(__m256 d)
+{
+	__m256 x = _mm256_rcp_ps(d);
+	return _mm256_mul_ps(x, _mm256_sub_ps(_mm256_set1_ps(2.0f), _mm256_mul_ps(d, x)));
+}
+// 第ra行的共轭对称位置 (16-b)&15: 低8个为[M0,M15..M9],高8个为[M8,M7..M1]
+X86_TARGET("avx2") static inline void MirrorRow16_AVX2(__m256 src0, __m256 src1, __m256 &lo, __m256 &hi)
+{
+	const __m256i idx = _mm256_setr_epi32(0, 7, 6, 5, 4, 3, 2, 1);
+	lo = _mm256_blend_ps(_mm256_permutevar8x32_ps(src1, idx), src0, 0x01);
+	hi = _mm256_blend_ps(_mm256_permutevar8x32_ps(src0, idx), src1, 0x01);
+}
+// 与NEON版相同,第a行与第ra行一起处理
+X86_TARGET("avx2") static inline void WienerGain_AVX2(__m256 Dr, __m256 Di, __m256 mr, __m256 mi, __m256 nx, __m256 ny, __m256 &Ur, __m256 &Ui, __m256 &Vr, __m256 &Vi)
+{
+	const __m256 half = _mm256_set1_ps(0.5f);
+	__m256 Pr = _mm256_add_ps(Dr, mr);
+	__m256 Pi = _mm256_sub_ps(Di, mi);
+	__m256 Qr = _mm256_sub_ps(Dr, mr);
+	__m256 Qi = _mm256_add_ps(Di, mi);
+	__m256 P2 = _mm256_add_ps(_mm256_mul_ps(Pr, Pr), _mm256_mul_ps(Pi, Pi));
+	__m256 Q2 = _mm256_add_ps(_mm256_mul_ps(Qr, Qr), _mm256_mul_ps(Qi, Qi));
+	__m256 Ax = _mm256_mul_ps(half, _mm256_mul_ps(P2, Reciprocal_AVX2(_mm256_add_ps(P2, nx))));
+	__m256 Ay = _mm256_mul_ps(half, _mm256_mul_ps(Q2, Reciprocal_AVX2(_mm256_add_ps(Q2, ny))));
+	Ur = _mm256_mul_ps(Ax, Pr);
+	Ui = _mm256_mul_ps(Ax, Pi);
+	Vr = _mm256_mul_ps(Ay, Qr);
+	Vi = _mm256_mul_ps(Ay, Qi);
+}
+X86_TARGET("avx2") static void WienerAccumulate_AVX2(const float *pRr, const float *pRi, const float *pSr, const float *pSi, float fNoiseX, float fNoiseY, float *pCr, float *pCi)
+{
+	const __m256 nx = _mm256_set1_ps(4.0f * fNoiseX + 1e-6f);
+	const __m256 ny = _mm256_set1_ps(4.0f * fNoiseY + 1e-6f);
+	for (int a = 0; a <= 8; a++)
+	{
+		int ra = (16 - a) & 15;
+		__m256 mr0, mr1, mi0, mi1;
+		MirrorRow16_AVX2(_mm256_sub_ps(_mm256_loadu_ps(pRr + ra * 16), _mm256_loadu_ps(pSr + ra * 16)), _mm256_sub_ps(_mm256_loadu_ps(pRr + ra * 16 + 8), _mm256_loadu_ps(pSr + ra * 16 + 8)), mr0, mr1);
+		MirrorRow16_AVX2(_mm256_sub_ps(_mm256_loadu_ps(pRi + ra * 16), _mm256_loadu_ps(pSi + ra * 16)), _mm256_sub_ps(_mm256_loadu_ps(pRi + ra * 16 + 8), _mm256_loadu_ps(pSi + ra * 16 + 8)), mi0, mi1);
+		const float *pSra = pSr + a * 16;
+		const float *pSia = pSi + a * 16;
+		__m256 Ur0, Ui0, Vr0, Vi0, Ur1, Ui1, Vr1, Vi1;
+		WienerGain_AVX2(_mm256_sub_ps(_mm256_loadu_ps(pRr + a * 16), _mm256_loadu_ps(pSra)), _mm256_sub_ps(_mm256_loadu_ps(pRi + a * 16), _mm256_loadu_ps(pSia)), mr0, mi0, nx, ny, Ur0, Ui0, Vr0, Vi0);
+		WienerGain_AVX2(_mm256_sub_ps(_mm256_loadu_ps(pRr + a * 16 + 8), _mm256_loadu_ps(pSra + 8)), _mm256_sub_ps(_mm256_loadu_ps(pRi + a * 16 + 8), _mm256_loadu_ps(pSia + 8)), mr1, mi1, nx, ny, Ur1, Ui1, Vr1, Vi1);
+		float *pCra = pCr + g_nFFT16Rev[a] * 16;
+		float *pCia = pCi + g_nFFT16Rev[a] * 16;
+		_mm256_storeu_ps(pCra, _mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(pCra), _mm256_loadu_ps(pSra)), _mm256_add_ps(Ur0, Vr0)));
+		_mm256_storeu_ps(pCra + 8, _mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(pCra + 8), _mm256_loadu_ps(pSra + 8)), _mm256_add_ps(Ur1, Vr1)));
+		_mm256_storeu_ps(pCia, _mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(pCia), _mm256_loadu_ps(pSia)), _mm256_add_ps(Ui0, Vi0)));
+		_mm256_storeu_ps(pCia + 8, _mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(pCia + 8), _mm256_loadu_ps(pSia + 8)), _mm256_add_ps(Ui1, Vi1)));
+		if (ra == a)
+			continue;
+		__m256 tr0, tr1, ti0, ti1;
+		MirrorRow16_AVX2(_mm256_sub_ps(Ur0, Vr0), _mm256_sub_ps(Ur1, Vr1), tr0, tr1);
+		MirrorRow16_AVX2(_mm256_sub_ps(Vi0, Ui0), _mm256_sub_ps(Vi1, Ui1), ti0, ti1);
+		float *pCrb = pCr + g_nFFT16Rev[ra] * 16;
+		float *pCib = pCi + g_nFFT16Rev[ra] * 16;
+		_mm256_storeu_ps(pCrb, _mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(pCrb), _mm256_loadu_ps(pSr + ra * 16)), tr0));
+		_mm256_storeu_ps(pCrb + 8, _mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(pCrb + 8), _mm256_loadu_ps(pSr + ra * 16 + 8)), tr1));
+		_mm256_storeu_ps(pCib, _mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(pCib), _mm256_loadu_ps(pSi + ra * 16)), ti0));
+		_mm256_storeu_ps(pCib + 8, _mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(pCib + 8), _mm256_loadu_ps(pSi + ra * 16 + 8)), ti1));
+	}
+}
+X86_TARGET("avx2") static void SplitTile_AVX2(const unsigned short *pIn, int nStride, float *pPlane)
+{
+	const __m256i mask = _mm256_set1_epi32(0xFFFF);
+	for (int t = 0; t < 32; t++, pIn += nStride)
+	{
+		float *pRe = pPlane + (t & 1) * 512 + g_nFFT16Rev[t >> 1] * 16;
+		float *pIm = pRe + 256;
+		for (int u = 0; u < 16; u += 8)
+		{
+			__m256i v = _mm256_loadu_si256((const __m256i *)(pIn + 2 * u));
+			_mm256_storeu_ps(pRe + u, _mm256_cvtepi32_ps(_mm256_and_si256(v, mask)));
+			_mm256_storeu_ps(pIm + u, _mm256_cvtepi32_ps(_mm256_srli_epi32(v, 16)));
+		}
+	}
+}
+X86_TARGET("avx2") static void JoinTileRow_AVX2(const float *pRe, const float *pIm, float fScale, unsigned int *pOut)
+{
+	const __m256 scale = _mm256_set1_ps(fScale);
+	const __m256 half = _mm256_set1_ps(0.5f);
+	const __m256 zero = _mm256_setzero_ps();
+	for (int u = 0; u < 16; u += 8)
+	{
+		__m256i e = _mm256_cvttps_epi32(_mm256_max_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(pRe + u), scale), half), zero));
+		__m256i o = _mm256_cvttps_epi32(_mm256_max_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(pIm + u), scale), half), zero));
+		// unpack在128bit通道内交错,再按通道重排
+		__m256i lo = _mm256_unpacklo_epi32(e, o);
+		__m256i hi = _mm256_unpackhi_epi32(e, o);
+		_mm256_storeu_si256((__m256i *)(pOut + 2 * u), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *)(pOut + 2 * u + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+}
+#endif
+static FFT16ColumnsFunc GetFFT16ColumnsFunc()
+{
+#ifdef USE_NEON
+	return FFT16Columns_NEON;
 #else
-						Sad = nsumsad[0] + nsumsad[1];
+#ifdef USE_X86_DISPATCH
+	int nLevel = GetX86SimdLevel();
+	if (nLevel >= X86_SIMD_AVX2)
+		return FFT16Columns_AVX2;
+	if (nLevel >= X86_SIMD_SSE41)
+		return FFT16Columns_SSE41;
 #endif
-					}
-					else
-					{
-						for (int a = 0; a < Blocksize; a++)
-						{
-							int refy = y + a;
-							int debugynew = debugy + a;
-							for (int b = 0; b < Blocksize; b++)
-							{
-								int refx = x + b;
-								int debugxnew = debugx + b;
-								int Dif = (int)(pInRefImage->GetImagePixel(refx, refy)[0] - pInDebugImage->GetImagePixel(debugxnew, debugynew)[0]);
-								Sad += (unsigned int)ABS(Dif);
-							}
-						}
-					}
+	return FFT16Columns_C;
+#endif
+}
+static Transpose16x16RevFunc GetTranspose16x16RevFunc()
+{
+#ifdef USE_NEON
+	return Transpose16x16Rev_NEON;
 #else
-					for (int a = 0; a < Blocksize; a++)
-					{
-						int refy = y + a;
-						int debugynew = debugy + a;
-						for (int b = 0; b < Blocksize; b++)
-						{
-							int refx = x + b;
-							int debugxnew = debugx + b;
-							Sad += (unsigned int)ABS(pInRefImage->GetImagePixel(refx, refy)[0] - pInDebugImage->GetImagePixel(debugxnew, debugynew)[0]);
-						}
-					}
+#ifdef USE_X86_DISPATCH
+	int nLevel = GetX86SimdLevel();
+	if (nLevel >= X86_SIMD_AVX2)
+		return Transpose16x16Rev_AVX2;
+	if (nLevel >= X86_SIMD_SSE41)
+		return Transpose16x16Rev_SSE41;
 #endif
-					if (Sad < MinSad)
+	return Transpose16x16Rev_C;
+#endif
+}
+static WienerAccumulateFunc GetWienerAccumulateFunc()
+{
+#ifdef USE_NEON
+	return WienerAccumulate_NEON;
+#else
+#ifdef USE_X86_DISPATCH
+	int nLevel = GetX86SimdLevel();
+	if (nLevel >= X86_SIMD_AVX2)
+		return WienerAccumulate_AVX2;
+	if (nLevel >= X86_SIMD_SSE41)
+		return WienerAccumulate_SSE41;
+#endif
+	return WienerAccumulate_C;
+#endif
+}
+static SplitTileFunc GetSplitTileFunc()
+{
+#ifdef USE_NEON
+	return SplitTile_NEON;
+#else
+#ifdef USE_X86_DISPATCH
+	int nLevel = GetX86SimdLevel();
+	if (nLevel >= X86_SIMD_AVX2)
+		return SplitTile_AVX2;
+	if (nLevel >= X86_SIMD_SSE41)
+		return SplitTile_SSE41;
+#endif
+	return SplitTile_C;
+#endif
+}
+static JoinTileRowFunc GetJoinTileRowFunc()
+{
+#ifdef USE_NEON
+	return JoinTileRow_NEON;
+#else
+#ifdef USE_X86_DISPATCH
+	int nLevel = GetX86SimdLevel();
+	if (nLevel >= X86_SIMD_AVX2)
+		return JoinTileRow_AVX2;
+	if (nLevel >= X86_SIMD_SSE41)
+		return JoinTileRow_SSE41;
+#endif
+	return JoinTileRow_C;
+#endif
+}
+struct TFFT16Kernel
+{
+	FFT16ColumnsFunc pColumns;
+	Transpose16x16RevFunc pTranspose;
+	WienerAccumulateFunc pWiener;
+	SplitTileFunc pSplit;
+	JoinTileRowFunc pJoin;
+};
+// 二维正变换:输入行位反序的[y][x],输出自然顺序的[fx][fy]到pOutRe/pOutIm,输入被改写
+static void FFT16x16Forward(float *pRe, float *pIm, float *pOutRe, float *pOutIm, const TFFT16Kernel &tKernel)
+{
+	tKernel.pColumns(pRe, pIm, 0);
+	tKernel.pTranspose(pRe, pOutRe);
+	tKernel.pTranspose(pIm, pOutIm);
+	tKernel.pColumns(pOutRe, pOutIm, 0);
+}
+// 二维逆变换(未除以256):输入行位反序的[fx][fy],输出自然顺序的[y][x]到pOutRe/pOutIm,输入被改写
+static void FFT16x16Inverse(float *pRe, float *pIm, float *pOutRe, float *pOutIm, const TFFT16Kernel &tKernel)
+{
+	tKernel.pColumns(pRe, pIm, 1);
+	tKernel.pTranspose(pRe, pOutRe);
+	tKernel.pTranspose(pIm, pOutIm);
+	tKernel.pColumns(pOutRe, pOutIm, 1);
+}
+// 频域融合第k帧块(X,Y)对齐后的原点,亚像素对齐时整数部分x2,小数部分在Fracx/Fracy
+static inline void WienerTileOrigin(MultiShortImage *pOffsetxImage, MultiShortImage *pOffsetyImage, MultiShortImage *pSubOffsetxImage, MultiShortImage *pSubOffsetyImage, int k, int X, int Y, int &Newx, int &Newy, int &Fracx, int &Fracy)
+{
+	const int Step = 16;
+	if (pSubOffsetxImage != NULL && pSubOffsetyImage != NULL)
+	{
+		int Subx = pSubOffsetxImage[k].GetImageLine(Y)[X];
+		int Suby = pSubOffsetyImage[k].GetImageLine(Y)[X];
+		Newx = X * Step + (Subx >> SUBPIXELBIT) * 2;
+		Newy = Y * Step + (Suby >> SUBPIXELBIT) * 2;
+		Fracx = Subx & (SUBPIXELVALUE - 1);
+		Fracy = Suby & (SUBPIXELVALUE - 1);
+	}
+	else
+	{
+		Newx = X * Step + pOffsetxImage[k].GetImageLine(Y)[X] * 2;
+		Newy = Y * Step + pOffsetyImage[k].GetImageLine(Y)[X] * 2;
+		Fracx = 0;
+		Fracy = 0;
+	}
+}
+// 预取下一个块的32行(亚像素插值多取2行2列),每个块的FFT计算量大,取数延迟不能靠乱序执行隐藏
+static inline void PrefetchTile(TRawPadView *pRawImage, int x, int y)
+{
+	const int Blocksize = 32;
+	if (!pRawImage->IsInside(x, y, Blocksize + 2, Blocksize + 2))
+		return;
+	for (int t = 0; t < Blocksize + 2; t++)
+	{
+		const unsigned short *pLine = pRawImage->GetImagePos(x, y + t);
+		__builtin_prefetch(pLine);
+		__builtin_prefetch(pLine + Blocksize + 1);
+	}
+}
+// 32x32的raw块抽取为4个16x16同色平面,按(行奇偶)两两打包:pPlane[r*512]为实部(偶列),pPlane[r*512+256]为虚部(奇列)
+// 平面内的行按位反序存放,直接作为列FFT的输入
+static void GatherTilePlanes(TRawPadView *pRawImage, int Newx, int Newy, int Fracx, int Fracy, float *pPlane, float *pTile, const TFFT16Kernel &tKernel)
+{
+	const int Blocksize = 32;
+	if (Fracx == 0 && Fracy == 0)
+	{
+		if (pRawImage->IsInside(Newx, Newy, Blocksize, Blocksize))
+		{
+			tKernel.pSplit(pRawImage->GetImagePos(Newx, Newy), pRawImage->pImage->GetImagePitch(), pPlane);
+			return;
+		}
+		// 碰到填充区的块先按行取到连续的块里
+		unsigned short pRaw[Blocksize * Blocksize];
+		for (int a = 0; a < Blocksize; a++)
+		{
+			pRawImage->GetImageRow(Newx, Newy + a, Blocksize, pRaw + a * Blocksize);
+		}
+		tKernel.pSplit(pRaw, Blocksize, pPlane);
+		return;
+	}
+	memset(pTile, 0, sizeof(float) * Blocksize * Blocksize);
+	AccumulateTile<Blocksize>(pRawImage, Newx, Newy, Fracx, Fracy, 1.0f, pTile);
+	for (int t = 0; t < Blocksize; t++)
+	{
+		const float *pTileline = pTile + t * Blocksize;
+		float *pRe = pPlane + (t & 1) * 512 + g_nFFT16Rev[t >> 1] * 16;
+		float *pIm = pRe + 256;
+		for (int u = 0; u < 16; u++)
+		{
+			pRe[u] = pTileline[2 * u];
+			pIm[u] = pTileline[2 * u + 1];
+		}
+	}
+}
+// 一行Blocksize x Blocksize块(块间步长为半个块)中[Xstart,Xend)的块所有帧加权累加,pMergeRow从块Xstart开始存放,每块Blocksize^2个累加值
+template <int Blocksize>
+void CHDRPlus_BlockMatchFusion::MergeTileRow(TRawPadView *pRawPadView, int nFrame, int Y, int Xstart, int Xend, MultiShortImage *pOffsetxImage, MultiShortImage *pOffsetyImage, CImage_FLOAT *pInWeightImage, unsigned int *pMergeRow, MultiShortImage *pSubOffsetxImage, MultiShortImage *pSubOffsetyImage)
+{
+	const int Step = Blocksize / 2;
+	const int Blocksize2 = Blocksize * Blocksize;
+	int y = Y * Step;
+	bool bSubPixel = (pSubOffsetxImage != NULL && pSubOffsetyImage != NULL);
+	memset(pMergeRow, 0, sizeof(unsigned int) * (Xend - Xstart) * Blocksize2);
+	for (int k = 0; k < nFrame; k++)
+	{
+		short *PreOffsetxline = ((bSubPixel && k != 0) ? pSubOffsetxImage[k].GetImageLine(Y) : pOffsetxImage[k].GetImageLine(Y)) + Xstart;
+		short *PreOffsetyline = ((bSubPixel && k != 0) ? pSubOffsetyImage[k].GetImageLine(Y) : pOffsetyImage[k].GetImageLine(Y)) + Xstart;
+		float *pWeightline = pInWeightImage[k].GetImageLine(Y) + Xstart;
+		float *pTotalWeight = pInWeightImage[0].GetImageLine(Y) + Xstart;
+		for (int X = Xstart; X < Xend; X++)
+		{
+			int x = X * Step;
+			unsigned short weiget = 0;
+			int Newy = 0;
+			int Newx = 0;
+			int Fracx = 0;
+			int Fracy = 0;
+			if (k == 0)
+			{
+				weiget = (unsigned short)((float)SCALEVALUE / (*pTotalWeight++)); // 放大2的14次方
+				Newy = y;
+				Newx = x;
+			}
+			else if (bSubPixel)
+			{
+				// 亚像素偏移在x2层,全分辨率上整数部分x2,小数部分插值
+				weiget = (unsigned short)((float)SCALEVALUE * (*pWeightline++) / (*pTotalWeight++)); // 放大2的14次方
+				int Suby = *PreOffsetyline++;
+				int Subx = *PreOffsetxline++;
+				Newy = y + (Suby >> SUBPIXELBIT) * 2;
+				Newx = x + (Subx >> SUBPIXELBIT) * 2;
+				Fracy = Suby & (SUBPIXELVALUE - 1);
+				Fracx = Subx & (SUBPIXELVALUE - 1);
+			}
+			else
+			{
+				weiget = (unsigned short)((float)SCALEVALUE * (*pWeightline++) / (*pTotalWeight++)); // 放大2的14次方
+				Newy = y + (*PreOffsetyline++) * 2;
+				Newx = x + (*PreOffsetxline++) * 2;
+			}
+			AccumulateTile<Blocksize>(&pRawPadView[k], Newx, Newy, Fracx, Fracy, weiget, pMergeRow + (X - Xstart) * Blocksize2);
+		}
+	}
+}
+// 频域融合(nMergeMode=1):每个同色平面与参考帧逐频点做维纳收缩 F + A*(R - F),
+// A = |R-F|^2 / (|R-F|^2 + c*噪声),噪声由参考块均值按散粒+读出噪声模型估计
+// 参考帧和各帧收缩后的频谱直接累加,每个块只做一次逆变换
+void CHDRPlus_BlockMatchFusion::MergeTileRowWiener(TRawPadView *pRawPadView, int nFrame, int Y, int Xstart, int Xend, MultiShortImage *pOffsetxImage, MultiShortImage *pOffsetyImage, unsigned int *pMergeRow, MultiShortImage *pSubOffsetxImage, MultiShortImage *pSubOffsetyImage)
+{
+	const int Step = 16;
+	const int Blocksize = 32;
+	const int Blocksize2 = Blocksize * Blocksize;
+	int y = Y * Step;
+	TFFT16Kernel tKernel;
+	tKernel.pColumns = GetFFT16ColumnsFunc();
+	tKernel.pTranspose = GetTranspose16x16RevFunc();
+	tKernel.pWiener = GetWienerAccumulateFunc();
+	tKernel.pSplit = GetSplitTileFunc();
+	tKernel.pJoin = GetJoinTileRowFunc();
+	float pTile[Blocksize2];
+	float pPlane[Blocksize2];
+	float pSpec[Blocksize2];
+	float pRefSpec[WIENERCHUNK][Blocksize2];
+	float pCorrSpec[WIENERCHUNK][Blocksize2];
+	float fNoise[WIENERCHUNK][4];
+	// 两帧之差的每个频点方差为 2*256*sigma^2
+	float fNoiseScale = m_nWienerFactor * 2.0f * 256.0f * m_fBurstAmount / 16.0f;
+	// 逆变换未除以256
+	float fOutScale = (float)SCALEVALUE / nFrame / 256.0f;
+	// 每次处理WIENERCHUNK个块,参考帧频谱和累加频谱留在L1内
+	for (int X0 = Xstart; X0 < Xend; X0 += WIENERCHUNK)
+	{
+		int nTiles = MIN2(WIENERCHUNK, Xend - X0);
+		for (int c = 0; c < nTiles; c++)
+		{
+			GatherTilePlanes(&pRawPadView[0], (X0 + c) * Step, y, 0, 0, pPlane, pTile, tKernel);
+			if (c + 1 < nTiles)
+				PrefetchTile(&pRawPadView[0], (X0 + c + 1) * Step, y);
+			for (int r = 0; r < 2; r++)
+			{
+				FFT16x16Forward(pPlane + r * 512, pPlane + r * 512 + 256, pRefSpec[c] + r * 512, pRefSpec[c] + r * 512 + 256, tKernel);
+			}
+			// 平面n的和即打包频谱的直流分量(实部为偶列,虚部为奇列)
+			for (int n = 0; n < 4; n++)
+			{
+				float fSignal = MAX2(pRefSpec[c][n * 256] / 256.0f - m_nBurstBLC, 0.0f);
+				fNoise[c][n] = (m_nWienerShotNoise * fSignal + m_nWienerReadNoise) * fNoiseScale;
+			}
+			// 累加频谱按行位反序存放,直接作为逆变换的输入
+			for (int a = 0; a < 64; a++)
+			{
+				memcpy(pCorrSpec[c] + (a >> 4) * 256 + g_nFFT16Rev[a & 15] * 16, pRefSpec[c] + a * 16, sizeof(float) * 16);
+			}
+		}
+		// 帧在外层,块按(帧,块)的顺序处理,取完当前块后预取下一个块,与当前块的FFT重叠
+		int Newx, Newy, Fracx, Fracy;
+		WienerTileOrigin(pOffsetxImage, pOffsetyImage, pSubOffsetxImage, pSubOffsetyImage, 1, X0, Y, Newx, Newy, Fracx, Fracy);
+		for (int n = 0; n < (nFrame - 1) * nTiles; n++)
+		{
+			int k = n / nTiles + 1;
+			int c = n % nTiles;
+			GatherTilePlanes(&pRawPadView[k], Newx, Newy, Fracx, Fracy, pPlane, pTile, tKernel);
+			int NextNewx = 0, NextNewy = 0, NextFracx = 0, NextFracy = 0;
+			if (n + 1 < (nFrame - 1) * nTiles)
+			{
+				int kn = (n + 1) / nTiles + 1;
+				WienerTileOrigin(pOffsetxImage, pOffsetyImage, pSubOffsetxImage, pSubOffsetyImage, kn, X0 + (n + 1) % nTiles, Y, NextNewx, NextNewy, NextFracx, NextFracy);
+				PrefetchTile(&pRawPadView[kn], NextNewx, NextNewy);
+			}
+			for (int r = 0; r < 2; r++)
+			{
+				float *pSr = pSpec + r * 512;
+				float *pSi = pSr + 256;
+				FFT16x16Forward(pPlane + r * 512, pPlane + r * 512 + 256, pSr, pSi, tKernel);
+				tKernel.pWiener(pRefSpec[c] + r * 512, pRefSpec[c] + r * 512 + 256, pSr, pSi, fNoise[c][r * 2], fNoise[c][r * 2 + 1], pCorrSpec[c] + r * 512, pCorrSpec[c] + r * 512 + 256);
+			}
+			Newx = NextNewx;
+			Newy = NextNewy;
+			Fracx = NextFracx;
+			Fracy = NextFracy;
+		}
+		// 逆变换为自然顺序的[y][x],按行交错写回,放大到与空域融合相同的定点精度
+		for (int c = 0; c < nTiles; c++)
+		{
+			unsigned int *pMergeTile = pMergeRow + (X0 + c - Xstart) * Blocksize2;
+			for (int r = 0; r < 2; r++)
+			{
+				FFT16x16Inverse(pCorrSpec[c] + r * 512, pCorrSpec[c] + r * 512 + 256, pSpec, pSpec + 256, tKernel);
+				for (int v = 0; v < 16; v++)
+				{
+					tKernel.pJoin(pSpec + v * 16, pSpec + 256 + v * 16, fOutScale, pMergeTile + (2 * v + r) * Blocksize);
+				}
+			}
+		}
+	}
+}
+// 块行Y的上半(pTop)与块行Y-1的下半(pBottom)做余弦窗叠加,得到[Y*Step,(Y+1)*Step)行中x在[xs,xe)的部分(填充坐标),
+// 两者都按块存放,块X从(X-nTile0)*nTileStride开始,块内每行Blocksize个累加值;
+// pAccImage为NULL时归一化后写入pOutImage,否则为增量融合,叠加值降到Q10累加到pAccImage
+template <int Blocksize>
+static void OverlapAddTileRow(const unsigned int *pTop, const unsigned int *pBottom, int nTileStride, int nTile0, const float *weight, int Y, int xs, int xe, int nPadx, int nPady, MultiUshortImage *pOutImage, CImageData_UINT32 *pAccImage, unsigned int Max)
+{
+	const int Step = Blocksize / 2;
+	int nOutWidth = (pAccImage != NULL) ? pAccImage->GetImageWidth() : pOutImage->GetImageWidth();
+	int nOutHeight = (pAccImage != NULL) ? pAccImage->GetImageHeight() : pOutImage->GetImageHeight();
+	xs = MAX2(xs, nPadx);
+	xe = MIN2(xe, nPadx + nOutWidth);
+	for (int lyu16 = 0; lyu16 < Step; lyu16++)
+	{
+		int y = Y * Step + lyu16;
+		if (y < nPady || y >= nPady + nOutHeight)
+			continue;
+		// 行内四个块的窗权重只与块内x有关
+		float weight00[Blocksize / 2], weight10[Blocksize / 2], weight01[Blocksize / 2], weight11[Blocksize / 2];
+		for (int lxu16 = 0; lxu16 < Step; lxu16++)
+		{
+			weight00[lxu16] = weight[lxu16 + Step] * weight[lyu16 + Step];
+			weight10[lxu16] = weight[lxu16] * weight[lyu16 + Step];
+			weight01[lxu16] = weight[lxu16 + Step] * weight[lyu16];
+			weight11[lxu16] = weight[lxu16] * weight[lyu16];
+		}
+		unsigned short *pmerged = (pAccImage != NULL) ? NULL : pOutImage->GetImageLine(y - nPady) + (xs - nPadx);
+		unsigned int *pacc = (pAccImage != NULL) ? pAccImage->GetImageLine(y - nPady) + (xs - nPadx) : NULL;
+		// 按块分段,段内四个块的行指针不变
+		for (int x = xs; x < xe;)
+		{
+			int lxz16 = x / Step;
+			int lxz16d1 = (lxz16 - 1);
+			if (lxz16d1 < 0)
+			{
+				lxz16d1 = 0;
+			}
+			const unsigned int *pline00 = pBottom + (lxz16d1 - nTile0) * nTileStride + lyu16 * Blocksize + Step;
+			const unsigned int *pline10 = pBottom + (lxz16 - nTile0) * nTileStride + lyu16 * Blocksize;
+			const unsigned int *pline01 = pTop + (lxz16d1 - nTile0) * nTileStride + lyu16 * Blocksize + Step;
+			const unsigned int *pline11 = pTop + (lxz16 - nTile0) * nTileStride + lyu16 * Blocksize;
+			int nStart = x - lxz16 * Step;
+			int nEnd = MIN2(xe - lxz16 * Step, Step);
+			if (pacc != NULL)
+			{
+				for (int lxu16 = nStart; lxu16 < nEnd; lxu16++)
+				{
+					pacc[lxu16 - nStart] += (unsigned int)(weight00[lxu16] * pline00[lxu16] + weight11[lxu16] * pline11[lxu16] + weight01[lxu16] * pline01[lxu16] + weight10[lxu16] * pline10[lxu16] + (1 << (MERGEACCBIT - 1))) >> MERGEACCBIT;
+				}
+				pacc += nEnd - nStart;
+			}
+			else
+			{
+				for (int lxu16 = nStart; lxu16 < nEnd; lxu16++)
+				{
+					unsigned int tmp = (unsigned int)(weight00[lxu16] * pline00[lxu16] + weight11[lxu16] * pline11[lxu16] + weight01[lxu16] * pline01[lxu16] + weight10[lxu16] * pline10[lxu16] + SCALEVALUEHALF);
+					tmp = tmp >> SCALEBIT;
+					if (tmp > Max)
 					{
-						MinSad = Sad;
-						Bestofsetx = m;
-						Bestofsety = n;
+						tmp = Max;
 					}
+					*pmerged++ = (unsigned short)tmp;
 				}
 			}
-			NewOffsetxline[0] = Bestofsetx + PreOffsetx;
-			NewOffsetyline[0] = Bestofsety + PreOffsety;
-			NewOffsetxline++;
-			NewOffsetyline++;
+			x = lxz16 * Step + nEnd;
 		}
 	}
-	return true;
 }
-bool CHDRPlus_BlockMatchFusion::EstimatedWeight(MultiUshortImage *pInImage, int nFrame, MultiShortImage *pPreOffsetxImage, MultiShortImage *pPreOffsetyImage, CImage_FLOAT *pOutWeightImage)
+// 增量融合:单帧一行块中[Xstart,Xend)的块按未归一化的Q14权重写入pMergeRow,权重同时累加到总权重图(Q14整数和)
+// pOffsetxImage为NULL时为参考帧,权重为1
+template <int Blocksize>
+void CHDRPlus_BlockMatchFusion::MergeTileRowFrame(TRawPadView *pRawPadView, int Y, int Xstart, int Xend, MultiShortImage *pOffsetxImage, MultiShortImage *pOffsetyImage, MultiUshortImage *pSadImage, CImage_FLOAT *pTotalWeightImage, unsigned int *pMergeRow, MultiShortImage *pSubOffsetxImage, MultiShortImage *pSubOffsetyImage)
 {
-	const int Step = 8;
-	const int Blocksize = 16;
+	const int Step = Blocksize / 2;
 	const int Blocksize2 = Blocksize * Blocksize;
-	int nWidth = pInImage->GetImageWidth();
-	int nHeight = pInImage->GetImageHeight();
-	int NeonBlocksizex = (nWidth - Blocksize);
-	int NeonBlocksizey = (nHeight - Blocksize);
-	int nProcs = omp_get_num_procs();
-	for (int k = 1; k < nFrame; k++)
+	int y = Y * Step;
+	bool bRef = (pOffsetxImage == NULL || pOffsetyImage == NULL);
+	bool bSubPixel = (!bRef && pSubOffsetxImage != NULL && pSubOffsetyImage != NULL);
+	memset(pMergeRow, 0, sizeof(unsigned int) * (Xend - Xstart) * Blocksize2);
+	float *pTotalWeight = pTotalWeightImage->GetImageLine(Y);
+	for (int X = Xstart; X < Xend; X++)
 	{
-#pragma omp parallel for num_threads(nProcs) schedule(dynamic, 16)
-		for (int y = 0; y < nHeight; y += Step)
+		int x = X * Step;
+		unsigned short weiget = SCALEVALUE;
+		int Newy = y;
+		int Newx = x;
+		int Fracx = 0;
+		int Fracy = 0;
+		if (!bRef)
 		{
-			int Y = y / Step;
-			short *PreOffsetxline = pPreOffsetxImage[k].GetImageLine(Y);
-			short *PreOffsetyline = pPreOffsetyImage[k].GetImageLine(Y);
-			float *pOutWeightline = pOutWeightImage[k].GetImageLine(Y);
-			float *pOutTotalWeightline = pOutWeightImage[0].GetImageLine(Y);
-			// unsigned short *pSadAline = pOutSadAImage->GetImageLine(Y);
-			for (int x = 0; x < nWidth; x += Step)
-			{
-				int X = x / Step;
-				int PreOffsetx = 0;
-				int PreOffsety = 0;
-				// unsigned short sada = *pSadAline++;
-				/*if (sada >= m_nSadAThre)
-				{*/
-				PreOffsetx = PreOffsetxline[0];
-				PreOffsety = PreOffsetyline[0];
-				/*}
-				else
-				{
-					PreOffsetxline[0] = 0;
-					PreOffsetyline[0] = 0;
-				}*/
-				int Predebugy = y + PreOffsety;
-				int Predebugx = x + PreOffsetx;
-				float CurrentAvgSad = 0.0f;
-				unsigned int Sad = 0;
-#ifdef USE_NEON
-				if (Predebugy >= 0 && Predebugy < NeonBlocksizey && Predebugx >= 0 && Predebugx < NeonBlocksizex)
-				{
-					uint32x4_t nsumabs = vdupq_n_u32(0);
-					unsigned short *pRef = pInImage[0].GetImagePixel(x, y);
-					unsigned short *pDebug = pInImage[k].GetImagePixel(Predebugx, Predebugy);
-					for (unsigned int a = 0; a < Blocksize; a++)
-					{
-						nsumabs = vaddq_u32(nsumabs, vpaddlq_u16(vabdq_u16(vld1q_u16(pRef), vld1q_u16(pDebug))));
-						nsumabs = vaddq_u32(nsumabs, vpaddlq_u16(vabdq_u16(vld1q_u16(pRef + 8), vld1q_u16(pDebug + 8))));
-						pRef += nWidth;
-						pDebug += nWidth;
-					}
-					uint64x2_t nsad = vpaddlq_u32(nsumabs);
-#ifdef _WIN32
-					Sad = nsad.m128i_u64[0] + nsad.m128i_u64[1];
-#else
-					Sad = nsad[0] + nsad[1];
-#endif
-				}
-				else
-				{
-					for (int a = 0; a < Blocksize; a++)
-					{
-						int refy = y + a;
-						int debugynew = Predebugy + a;
-						for (int b = 0; b < Blocksize; b++)
-						{
-							int refx = x + b;
-							int debugxnew = Predebugx + b;
-							int Dif = (int)(pInImage[0].GetImagePixel(refx, refy)[0] - pInImage[k].GetImagePixel(debugxnew, debugynew)[0]);
-							Sad += (unsigned int)ABS(Dif);
-						}
-					}
-				}
-#else
-				for (int a = 0; a < Blocksize; a++)
-				{
-					int refy = y + a;
-					int debugynew = Predebugy + a;
-					for (int b = 0; b < Blocksize; b++)
-					{
-						int refx = x + b;
-						int debugxnew = Predebugx + b;
-						Sad += (unsigned int)ABS(pInImage[0].GetImagePixel(refx, refy)[0] - pInImage[k].GetImagePixel(debugxnew, debugynew)[0]);
-					}
-				}
-#endif
-				Sad = Sad >> 8; // Sad / (float)Blocksize2
-				CurrentAvgSad = (float)Sad;
-				float NormDist = MAX2(1.0f, (float)(CurrentAvgSad - m_nMinDist) / (float)m_nAmountFactor);
-				if (NormDist > (m_nMaxDist - m_nMinDist))
-				{
-					pOutWeightline[X] = 0.f;
-				}
-				else
-				{
-					pOutWeightline[X] = 1.f / NormDist;
-				}
-				pOutTotalWeightline[X] += pOutWeightline[X];
-				PreOffsetxline++;
-				PreOffsetyline++;
+			weiget = (unsigned short)((float)SCALEVALUE * SadToWeight(pSadImage->GetImageLine(Y)[X])); // 放大2的14次方
+			if (bSubPixel)
+			{
+				int Suby = pSubOffsetyImage->GetImageLine(Y)[X];
+				int Subx = pSubOffsetxImage->GetImageLine(Y)[X];
+				Newy = y + (Suby >> SUBPIXELBIT) * 2;
+				Newx = x + (Subx >> SUBPIXELBIT) * 2;
+				Fracy = Suby & (SUBPIXELVALUE - 1);
+				Fracx = Subx & (SUBPIXELVALUE - 1);
+			}
+			else
+			{
+				Newy = y + pOffsetyImage->GetImageLine(Y)[X] * 2;
+				Newx = x + pOffsetxImage->GetImageLine(Y)[X] * 2;
 			}
 		}
+		pTotalWeight[X] += weiget;
+		if (weiget == 0)
+			continue;
+		AccumulateTile<Blocksize>(pRawPadView, Newx, Newy, Fracx, Fracy, weiget, pMergeRow + (X - Xstart) * Blocksize2);
 	}
-	return true;
 }
-void CHDRPlus_BlockMatchFusion::MergeTemporal(MultiUshortImage *pRawPadImage, int nFrame, MultiShortImage *pOffsetxImage, MultiShortImage *pOffsetyImage, CImage_FLOAT *pInWeightImage, CImageData_UINT32 *pMergeImage)
+// 一个带[Ystart,Yend)的块行按列条带融合,条带内只保留当前和上一块行的累加值(在L2内),相邻块行完成后立即叠加输出;
+// 条带左边界的块由上一条带交接,带内第一块行的上半和最后一块行的下半存到pTopHalf/pBottomHalf,留到所有带完成后再叠加
+template <int Blocksize>
+void CHDRPlus_BlockMatchFusion::MergeTemporalBand(TRawPadView *pRawPadView, int nFrame, MultiShortImage *pOffsetxImage, MultiShortImage *pOffsetyImage, CImage_FLOAT *pInWeightImage, MultiUshortImage *pOutImage, int nPadx, int nPady, unsigned int Max, MultiShortImage *pSubOffsetxImage, MultiShortImage *pSubOffsetyImage, CImageData_UINT32 *pAccImage, MultiUshortImage *pSadImage, const float *weight, int Ystart, int Yend, int nStrips, unsigned int *pStripBuffer, unsigned int *pEdge, unsigned int *pTopHalf, unsigned int *pBottomHalf)
 {
-	const int Step = 16;
-	const int Blocksize = 32;
+	const int Step = Blocksize / 2;
 	const int Blocksize2 = Blocksize * Blocksize;
-	int nWidth = pRawPadImage->GetImageWidth();
-	int nHeight = pRawPadImage->GetImageHeight();
-	int NeonBlocksizex = (nWidth - Blocksize);
-	int NeonBlocksizey = (nHeight - Blocksize);
-	int nProcs = omp_get_num_procs();
-#pragma omp parallel for num_threads(nProcs) schedule(dynamic, 16)
-	for (int y = 0; y < nHeight; y += Step)
-	{
-		int Y = y / Step; //
-		for (int k = 0; k < nFrame; k++)
-		{
-			unsigned int *pMergeline = pMergeImage->GetImageLine(Y);
-			short *PreOffsetxline = pOffsetxImage[k].GetImageLine(Y);
-			short *PreOffsetyline = pOffsetyImage[k].GetImageLine(Y);
-			float *pWeightline = pInWeightImage[k].GetImageLine(Y);
-			float *pTotalWeight = pInWeightImage[0].GetImageLine(Y);
-			for (int x = 0; x < nWidth; x += Step)
-			{
-				int X = x / Step;
-				unsigned short weiget = 0;
-				int Newy = 0;
-				int Newx = 0;
-				if (k == 0)
-				{
-					weiget = (unsigned short)((float)SCALEVALUE / (*pTotalWeight++)); // 放大2的14次方
-					Newy = y;
-					Newx = x;
-				}
+	const int HalfSize = Step * Blocksize;
+	int nTilesX = pRawPadView->GetImageWidth() / Step;
+	int nTilesY = pRawPadView->GetImageHeight() / Step;
+	int nStripLen = (nTilesX / nStrips + 2) * Blocksize2;
+	// 频域融合的16点FFT对应32x32的融合块,BeginBurst已保证频域融合时对齐块为16、非增量融合
+	bool bWiener = (m_nMergeMode == 1 && Blocksize == 32 && pAccImage == NULL);
+	// 全在填充区、与输出图不相交的块叠加时不会被读到,不做融合
+	int nOutWidth = (pAccImage != NULL) ? pAccImage->GetImageWidth() : pOutImage->GetImageWidth();
+	int nOutHeight = (pAccImage != NULL) ? pAccImage->GetImageHeight() : pOutImage->GetImageHeight();
+	int nTileX0 = MAX2(nPadx - Blocksize + Step, 0) / Step;
+	int nTileX1 = MIN2((nPadx + nOutWidth + Step - 1) / Step, nTilesX);
+	int nTileY0 = MAX2(nPady - Blocksize + Step, 0) / Step;
+	int nTileY1 = MIN2((nPady + nOutHeight + Step - 1) / Step, nTilesY);
+	unsigned int *pMergeRow[2];
+	pMergeRow[0] = pStripBuffer;
+	pMergeRow[1] = pStripBuffer + nStripLen;
+	for (int s = 0; s < nStrips; s++)
+	{
+		int X0 = s * nTilesX / nStrips;
+		int X1 = (s + 1) * nTilesX / nStrips;
+		for (int Y = Ystart; Y < Yend; Y++)
+		{
+			// 条带的块X存放在pRow的第X-X0+1块,第0块为左边界块
+			unsigned int *pRow = pMergeRow[Y & 1];
+			int Xs = (Y < nTileY0 || Y >= nTileY1) ? X1 : MIN2(MAX2(nTileX0, X0), X1);
+			int Xe = MAX2(Xs, MIN2(X1, nTileX1));
+			memset(pRow + Blocksize2, 0, sizeof(unsigned int) * Blocksize2 * (Xs - X0));
+			memset(pRow + (Xe - X0 + 1) * Blocksize2, 0, sizeof(unsigned int) * Blocksize2 * (X1 - Xe));
+			if (Xs < Xe)
+			{
+				unsigned int *pMergeTile = pRow + (Xs - X0 + 1) * Blocksize2;
+				if (pAccImage != NULL)
+					MergeTileRowFrame<Blocksize>(pRawPadView, Y, Xs, Xe, pOffsetxImage, pOffsetyImage, pSadImage, pInWeightImage, pMergeTile, pSubOffsetxImage, pSubOffsetyImage);
+				else if (bWiener)
+					MergeTileRowWiener(pRawPadView, nFrame, Y, Xs, Xe, pOffsetxImage, pOffsetyImage, pMergeTile, pSubOffsetxImage, pSubOffsetyImage);
 				else
+					MergeTileRow<Blocksize>(pRawPadView, nFrame, Y, Xs, Xe, pOffsetxImage, pOffsetyImage, pInWeightImage, pMergeTile, pSubOffsetxImage, pSubOffsetyImage);
+			}
+			// 第一个条带没有左边的块,与整行叠加时一样取块0
+			unsigned int *pEdgeTile = pEdge + (Y - Ystart) * Blocksize2;
+			memcpy(pRow, (s == 0) ? pRow + Blocksize2 : pEdgeTile, sizeof(unsigned int) * Blocksize2);
+			memcpy(pEdgeTile, pRow + (X1 - X0) * Blocksize2, sizeof(unsigned int) * Blocksize2);
+			if (Y == Ystart && Y > 0)
+			{
+				// 上一块行属于上一个带,只保存上半
+				for (int X = X0; X < X1; X++)
 				{
-					weiget = (unsigned short)((float)SCALEVALUE * (*pWeightline++) / (*pTotalWeight++)); // 放大2的14次方
-					Newy = y + (*PreOffsetyline++) * 2;
-					Newx = x + (*PreOffsetxline++) * 2;
-				}
-				if (Newy < NeonBlocksizey && Newx < NeonBlocksizex && Newy >= 0 && Newx >= 0)
-				{
-					for (int a = 0; a < Blocksize; a++)
-					{
-						unsigned short *pRawDataline = pRawPadImage[k].GetImageLine(Newy + a);
-						// for (int b = 0; b < Blocksize; b += 4)
-						// {
-						// 	uint32x4_t npmerge = vld1q_u32(pMergeline);
-						// 	npmerge = vmlal_n_u16(npmerge, vld1_u16(&pRawDataline[Newx + b]), weiget);
-						// 	vst1q_u32(pMergeline, npmerge);
-						// 	pMergeline += 4;
-						// }
-						for (int b = 0; b < Blocksize; ++b)
-						{
-							pMergeline[b] +=
-								static_cast<uint32_t>(pRawDataline[Newx + b]) * weiget;
-						}
-					}
+					memcpy(pTopHalf + X * HalfSize, pRow + (X - X0 + 1) * Blocksize2, sizeof(unsigned int) * HalfSize);
 				}
-				else
+			}
+			else
+			{
+				unsigned int *pPrevRow = (Y > 0) ? pMergeRow[(Y - 1) & 1] : pRow;
+				OverlapAddTileRow<Blocksize>(pRow, pPrevRow + HalfSize, Blocksize2, X0 - 1, weight, Y, X0 * Step, X1 * Step, nPadx, nPady, pOutImage, pAccImage, Max);
+			}
+			if (Y == Yend - 1 && Yend < nTilesY)
+			{
+				for (int X = X0; X < X1; X++)
 				{
-					for (int a = 0; a < Blocksize; a++)
-					{
-						if (Newx <= NeonBlocksizex && Newx >= 0)
-						{
-							unsigned short *pRawDataline = pRawPadImage[k].GetImageLine(Newy + a);
-							// for (int b = 0; b < Blocksize; b += 4)
-							// {
-							// 	uint32x4_t npmerge = vld1q_u32(pMergeline);
-							// 	npmerge = vmlal_n_u16(npmerge, vld1_u16(&pRawDataline[Newx + b]), weiget);
-							// 	vst1q_u32(pMergeline, npmerge);
-							// 	pMergeline += 4;
-							// }
-							for (int b = 0; b < Blocksize; ++b)
-							{
-								pMergeline[b] +=
-									static_cast<uint32_t>(pRawDataline[Newx + b]) * weiget;
-							}
-						}
-						else
-						{
-							unsigned short *pRawDataline = pRawPadImage[k].GetImageLine(Newy + a);
-							for (int b = 0; b < Blocksize; b++)
-							{
-								(*pMergeline++) += (unsigned int)(weiget * pRawDataline[Newx + b]);
-							}
-						}
-					}
+					memcpy(pBottomHalf + X * HalfSize, pRow + (X - X0 + 1) * Blocksize2 + HalfSize, sizeof(unsigned int) * HalfSize);
 				}
 			}
 		}
 	}
 }
-void CHDRPlus_BlockMatchFusion::MergeWeight(MultiUshortImage *pOutMergeSingleImage, CImageData_UINT32 *pInMergeMultiImage, unsigned int Max)
+// 按块行融合:每个线程负责连续的若干块行(MergeTemporalBand),带间的块行在所有带完成后叠加,每个块只算一次;
+// pAccImage非NULL时为增量融合,只融合pRawPadView这一帧,权重由pSadImage换算,叠加后累加到pAccImage,
+// pInWeightImage为累加的总权重图,pOutImage不使用
+template <int Blocksize>
+void CHDRPlus_BlockMatchFusion::MergeTemporal(TRawPadView *pRawPadView, int nFrame, MultiShortImage *pOffsetxImage, MultiShortImage *pOffsetyImage, CImage_FLOAT *pInWeightImage, MultiUshortImage *pOutImage, int nPadx, int nPady, unsigned int Max, MultiShortImage *pSubOffsetxImage, MultiShortImage *pSubOffsetyImage, CImageData_UINT32 *pAccImage, MultiUshortImage *pSadImage)
+{
+	const int Step = Blocksize / 2;
+	const int Blocksize2 = Blocksize * Blocksize;
+	const int HalfSize = Step * Blocksize;
+	int nWidth = pRawPadView->GetImageWidth();
+	int nHeight = pRawPadView->GetImageHeight();
+	int nTilesX = nWidth / Step;
+	int nTilesY = nHeight / Step;
+	if (pAccImage == NULL && !pOutImage->SetImageSize(nWidth - 2 * nPadx, nHeight - 2 * nPady, 1))
+		return;
+	float weight[Blocksize];
+	for (int v = 0; v < Blocksize; v++)
+	{
+		weight[v] = 0.5f - 0.5f * cos(2 * 3.141592f * (v + 0.5f) / (float)Blocksize);
+	}
+	int nProcs = omp_get_num_procs();
+	int nBands = MIN2(nProcs, nTilesY);
+	int nBandRows = (nTilesY + nBands - 1) / nBands;
+	// 条带内两块行各多存左边一块
+	int nStripTiles = MAX2((int)(MERGESTRIPBYTES / (2 * Blocksize2 * sizeof(unsigned int))) - 1, 1);
+	int nStrips = (nTilesX + nStripTiles - 1) / nStripTiles;
+	int nStripLen = (nTilesX / nStrips + 2) * Blocksize2;
+	int nHalfRowLen = nTilesX * HalfSize;
+	unsigned int *pStripBuffer = new unsigned int[nStripLen * 2 * nBands];
+	unsigned int *pEdgeBuffer = new unsigned int[nBandRows * Blocksize2 * nBands];
+	unsigned int *pTopBuffer = new unsigned int[nHalfRowLen * nBands];
+	unsigned int *pBottomBuffer = new unsigned int[nHalfRowLen * nBands];
+	if (omp_in_parallel())
+	{
+		// 在帧级任务内调用时(增量融合)按带拆成子任务
+#pragma omp taskloop grainsize(1)
+		for (int band = 0; band < nBands; band++)
+		{
+			MergeTemporalBand<Blocksize>(pRawPadView, nFrame, pOffsetxImage, pOffsetyImage, pInWeightImage, pOutImage, nPadx, nPady, Max, pSubOffsetxImage, pSubOffsetyImage, pAccImage, pSadImage, weight, band * nTilesY / nBands, (band + 1) * nTilesY / nBands, nStrips, pStripBuffer + band * nStripLen * 2, pEdgeBuffer + band * nBandRows * Blocksize2, pTopBuffer + band * nHalfRowLen, pBottomBuffer + band * nHalfRowLen);
+		}
+	}
+	else
+	{
+#pragma omp parallel for num_threads(nProcs) schedule(dynamic, 1)
+		for (int band = 0; band < nBands; band++)
+		{
+			MergeTemporalBand<Blocksize>(pRawPadView, nFrame, pOffsetxImage, pOffsetyImage, pInWeightImage, pOutImage, nPadx, nPady, Max, pSubOffsetxImage, pSubOffsetyImage, pAccImage, pSadImage, weight, band * nTilesY / nBands, (band + 1) * nTilesY / nBands, nStrips, pStripBuffer + band * nStripLen * 2, pEdgeBuffer + band * nBandRows * Blocksize2, pTopBuffer + band * nHalfRowLen, pBottomBuffer + band * nHalfRowLen);
+		}
+	}
+	// 带间的块行:上一个带最后一块行的下半与本带第一块行的上半叠加,各带互不重叠,不需要并行
+	for (int band = 1; band < nBands; band++)
+	{
+		int Y = band * nTilesY / nBands;
+		OverlapAddTileRow<Blocksize>(pTopBuffer + band * nHalfRowLen, pBottomBuffer + (band - 1) * nHalfRowLen, HalfSize, 0, weight, Y, 0, nWidth, nPadx, nPady, pOutImage, pAccImage, Max);
+	}
+	delete[] pStripBuffer;
+	delete[] pEdgeBuffer;
+	delete[] pTopBuffer;
+	delete[] pBottomBuffer;
+}
+// 增量融合的单帧累加:pOffsetxImage为NULL时为参考帧
+void CHDRPlus_BlockMatchFusion::MergeFrame(TRawPadView *pRawPadView, MultiShortImage *pOffsetxImage, MultiShortImage *pOffsetyImage, MultiUshortImage *pSadImage, MultiShortImage *pSubOffsetxImage, MultiShortImage *pSubOffsetyImage)
+{
+	switch (m_nBurstBlockSize)
+	{
+	case 32:
+		MergeTemporal<64>(pRawPadView, 1, pOffsetxImage, pOffsetyImage, &m_WeightImage[0], NULL, m_nBurstPadx, m_nBurstPady, m_nBurstMax, pSubOffsetxImage, pSubOffsetyImage, &m_MergeAccImage, pSadImage);
+		break;
+	case 64:
+		MergeTemporal<128>(pRawPadView, 1, pOffsetxImage, pOffsetyImage, &m_WeightImage[0], NULL, m_nBurstPadx, m_nBurstPady, m_nBurstMax, pSubOffsetxImage, pSubOffsetyImage, &m_MergeAccImage, pSadImage);
+		break;
+	default:
+		MergeTemporal<32>(pRawPadView, 1, pOffsetxImage, pOffsetyImage, &m_WeightImage[0], NULL, m_nBurstPadx, m_nBurstPady, m_nBurstMax, pSubOffsetxImage, pSubOffsetyImage, &m_MergeAccImage, pSadImage);
+		break;
+	}
+}
+// 增量融合的累加器为各帧加权叠加后的Q10值,除以同样做余弦窗叠加的总权重(Q14)得到输出
+// 累加器和输出图都为未填充的尺寸,(x,y)对应填充坐标(x+nPadx,y+nPady)
+template <int Blocksize>
+void CHDRPlus_BlockMatchFusion::MergeNormalize(MultiUshortImage *pOutImage, CImageData_UINT32 *pAccImage, CImage_FLOAT *pTotalWeightImage, int nPadx, int nPady, unsigned int Max)
 {
-	int nOutWidth = pOutMergeSingleImage->GetImageWidth();
-	int nOutHeight = pOutMergeSingleImage->GetImageHeight();
-	int nInWidth = pInMergeMultiImage->GetImageWidth();
-	int nInHeight = pInMergeMultiImage->GetImageHeight();
-	int fang = 32;
-	int fangxfang = fang * fang;
-	int patch = nInWidth * fangxfang;
-	float weight[32];
-	for (int v = 0; v < 32; v++)
+	const int Step = Blocksize / 2;
+	int nOutWidth = pOutImage->GetImageWidth();
+	int nOutHeight = pOutImage->GetImageHeight();
+	float weight[Blocksize];
+	for (int v = 0; v < Blocksize; v++)
 	{
-		weight[v] = 0.5f - 0.5f * cos(2 * 3.141592f * (v + 0.5f) / 32.0f);
+		weight[v] = 0.5f - 0.5f * cos(2 * 3.141592f * (v + 0.5f) / (float)Blocksize);
 	}
 	int nProcs = omp_get_num_procs();
 #pragma omp parallel for num_threads(nProcs) schedule(dynamic, 16)
-	for (int y = 0; y < nOutHeight; y++)
+	for (int oy = 0; oy < nOutHeight; oy++)
 	{
-		int lyu16 = y % 16;
-		int lyz16 = y / 16;
+		int y = oy + nPady;
+		int lyu16 = y % Step;
+		int lyz16 = y / Step;
 		int lyz16d1 = (lyz16 - 1);
 		if (lyz16d1 < 0)
 		{
 			lyz16d1 = 0;
 		}
-		unsigned int *pmergeline0 = pInMergeMultiImage->GetImageLine(lyz16);
-		unsigned int *pmergeline1 = pInMergeMultiImage->GetImageLine(lyz16d1);
-		unsigned short *pmerged = pOutMergeSingleImage[0].GetImageLine(y);
-		for (int x = 0; x < nOutWidth; x++)
+		float *pweightline0 = pTotalWeightImage->GetImageLine(lyz16);
+		float *pweightline1 = pTotalWeightImage->GetImageLine(lyz16d1);
+		unsigned int *pacc = pAccImage->GetImageLine(oy);
+		unsigned short *pmerged = pOutImage->GetImageLine(oy);
+		for (int x = nPadx; x < nPadx + nOutWidth; x++)
 		{
-			unsigned int lxu16 = x % 16;
-			unsigned int lxz16 = x / 16;
+			int lxu16 = x % Step;
+			int lxz16 = x / Step;
 			int lxz16d1 = (lxz16 - 1);
 			if (lxz16d1 < 0)
 			{
 				lxz16d1 = 0;
 			}
-			float weight00 = weight[lxu16 + 16] * weight[lyu16 + 16];
-			float weight10 = weight[lxu16] * weight[lyu16 + 16];
-			float weight01 = weight[lxu16 + 16] * weight[lyu16];
-			float weight11 = weight[lxu16] * weight[lyu16];
-			unsigned int val_00 = /* lyz16d1 * patch +*/ lxz16d1 * fangxfang + (lyu16 + 16) * fang + lxu16 + 16;
-			unsigned int val_10 = /* lyz16d1 * patch +*/ lxz16 * fangxfang + (lyu16 + 16) * fang + lxu16;
-			unsigned int val_01 = /*lyz16 * patch +*/ lxz16d1 * fangxfang + lyu16 * fang + lxu16 + 16;
-			unsigned int val_11 = /* lyz16 * patch +*/ lxz16 * fangxfang + lyu16 * fang + lxu16;
-			unsigned int tmp = (unsigned int)(weight00 * pmergeline1[val_00] + weight11 * pmergeline0[val_11] + weight01 * pmergeline0[val_01] + weight10 * pmergeline1[val_10] + SCALEVALUEHALF);
-			tmp = tmp >> SCALEBIT;
+			float fWeight = weight[lxu16 + Step] * weight[lyu16 + Step] * pweightline1[lxz16d1] + weight[lxu16] * weight[lyu16 + Step] * pweightline1[lxz16] + weight[lxu16 + Step] * weight[lyu16] * pweightline0[lxz16d1] + weight[lxu16] * weight[lyu16] * pweightline0[lxz16];
+			// 参考帧权重恒为1,窗函数之和为1,总权重不小于1(Q14)
+			unsigned int tmp = (unsigned int)((float)*pacc++ * (float)(1 << MERGEACCBIT) / fWeight + 0.5f);
 			if (tmp > Max)
 			{
 				tmp = Max;
@@ -648,45 +2490,193 @@ void CHDRPlus_BlockMatchFusion::MergeWeight(MultiUshortImage *pOutMergeSingleIma
 		}
 	}
 }
-bool CHDRPlus_BlockMatchFusion::UpScaleOffsetAndValuex2(MultiShortImage *pInImage, MultiShortImage *pOutImage) // 小 大
+// 偏移图x2上采样,偏移值同时x2;nOutWidth/nOutHeight给出时输出为下一层的块数,
+// 大块时上一层块数的2倍与下一层块数可能差一行一列,多出的块取最近的上一层块
+bool CHDRPlus_BlockMatchFusion::UpScaleOffsetAndValuex2(MultiShortImage *pInImage, MultiShortImage *pOutImage, int nOutWidth, int nOutHeight) // 小 大
 {
 	int nWidth = pInImage->GetImageWidth();
 	int nHeight = pInImage->GetImageHeight();
-	int tnx2 = nWidth * 2;
-	int tny2 = nHeight * 2;
+	int tnx2 = (nOutWidth > 0) ? nOutWidth : nWidth * 2;
+	int tny2 = (nOutHeight > 0) ? nOutHeight : nHeight * 2;
 	if (pOutImage->GetImageWidth() != tnx2 || pOutImage->GetImageHeight() != tny2)
 	{
 		if (!pOutImage->CreateImageFillValue(tnx2, tny2, 1, 0))
 			return false;
 	}
-	/*int ofx = tnx2 * 2 - nWidth;
-	int ofy = tny2 * 2 - nHeight;
-	int tmptny2 = tny2;
-	int tmptnx2 = tnx2;*/
-	// if (ofx != 0 || ofy != 0)
-	//{
-	//	tmptny2 = tmptny2 - 1;
-	//	tmptnx2 = tmptnx2 - 1;
-	// }
+	if (nWidth == 0 || nHeight == 0)
+	{
+		pOutImage->FillValue(0);
+		return true;
+	}
 	int nProcs = omp_get_num_procs();
 #pragma omp parallel for num_threads(nProcs) schedule(dynamic, 16)
-	for (int y = 0; y < nHeight; y++)
+	for (int y = 0; y < tny2; y++)
 	{
-		short *pline0 = pOutImage->GetImageLine(y * 2);
-		short *pline1 = pOutImage->GetImageLine(y * 2 + 1);
-		short *pin = pInImage->GetImageLine(y);
-		for (int x = 0; x < nWidth; x++)
+		short *pout = pOutImage->GetImageLine(y);
+		short *pin = pInImage->GetImageLine(MIN2(y >> 1, nHeight - 1));
+		for (int x = 0; x < tnx2; x++)
 		{
-			short tmp = (*pin++);
-			tmp = tmp * 2;
-			*pline0++ = tmp;
-			*pline0++ = tmp;
-			*pline1++ = tmp;
-			*pline1++ = tmp;
+			pout[x] = pin[MIN2(x >> 1, nWidth - 1)] * 2;
 		}
 	}
+	return true;
 }
-void CHDRPlus_BlockMatchFusion::Forward(MultiUshortImage *pInImages, int nFrameID[], int Framenum, TGlobalControl *pControl)
+void CHDRPlus_BlockMatchFusion::BuildPyramid(int k)
+{
+	MultiUshortImage *pLevel[4] = {&m_RawDatax2[k], &m_RawDatax4[k], &m_RawDatax8[k], &m_RawDatax16[k]};
+	BoxDownPyramid(&m_RawPadView[k], pLevel, 4);
+}
+// 16->8->4->2逐层对齐,上一层偏移上采样后作为下一层的预测偏移
+template <int Blocksize>
+void CHDRPlus_BlockMatchFusion::AlignPyramid(int k)
+{
+	const int Step = Blocksize / 2;
+	// 静止块阈值按x2层给出,每粗一层2x2均值后噪声减半,阈值也减半
+	MultiUshortImage *pLevel[4] = {m_RawDatax16, m_RawDatax8, m_RawDatax4, m_RawDatax2};
+	int nStaticThre[4];
+	int nBlockW[4];
+	int nBlockH[4];
+	for (int l = 0; l < 4; l++)
+	{
+		nStaticThre[l] = m_nBurstStaticThre >> (3 - l);
+		nBlockW[l] = pLevel[l][k].GetImageWidth() / Step;
+		nBlockH[l] = pLevel[l][k].GetImageHeight() / Step;
+		m_nStaticBlockNum[k][l] = 0;
+		m_nAlignBlockNum[k][l] = nBlockW[l] * nBlockH[l];
+	}
+	EstimatedOffsetNoRef<Blocksize>(m_RawDatax16, &m_RawDatax16[k], &m_OffsetxImage[k], &m_OffsetyImage[k], m_nOffsetxLevel[0], m_nOffsetyLevel[0], nStaticThre[0], &m_nStaticBlockNum[k][0]);
+	UpScaleOffsetAndValuex2(&m_OffsetxImage[k], &m_tmpOffsetxImage[k], nBlockW[1], nBlockH[1]);
+	UpScaleOffsetAndValuex2(&m_OffsetyImage[k], &m_tmpOffsetyImage[k], nBlockW[1], nBlockH[1]);
+	EstimatedOffsetAndRef<Blocksize>(m_RawDatax8, &m_RawDatax8[k], &m_tmpOffsetxImage[k], &m_tmpOffsetyImage[k], &m_OffsetxImage[k], &m_OffsetyImage[k], m_nOffsetxLevel[1], m_nOffsetyLevel[1], NULL, NULL, NULL, nStaticThre[1], &m_nStaticBlockNum[k][1]);
+	UpScaleOffsetAndValuex2(&m_OffsetxImage[k], &m_tmpOffsetxImage[k], nBlockW[2], nBlockH[2]);
+	UpScaleOffsetAndValuex2(&m_OffsetyImage[k], &m_tmpOffsetyImage[k], nBlockW[2], nBlockH[2]);
+	EstimatedOffsetAndRef<Blocksize>(m_RawDatax4, &m_RawDatax4[k], &m_tmpOffsetxImage[k], &m_tmpOffsetyImage[k], &m_OffsetxImage[k], &m_OffsetyImage[k], m_nOffsetxLevel[2], m_nOffsetyLevel[2], NULL, NULL, NULL, nStaticThre[2], &m_nStaticBlockNum[k][2]);
+	UpScaleOffsetAndValuex2(&m_OffsetxImage[k], &m_tmpOffsetxImage[k], nBlockW[3], nBlockH[3]);
+	UpScaleOffsetAndValuex2(&m_OffsetyImage[k], &m_tmpOffsetyImage[k], nBlockW[3], nBlockH[3]);
+	if (m_bSubPixelEnable)
+	{
+		EstimatedOffsetAndRef<Blocksize>(m_RawDatax2, &m_RawDatax2[k], &m_tmpOffsetxImage[k], &m_tmpOffsetyImage[k], &m_OffsetxImage[k], &m_OffsetyImage[k], m_nOffsetxLevel[3], m_nOffsetyLevel[3], &m_SubOffsetxImage[k], &m_SubOffsetyImage[k], &m_SadImage[k], nStaticThre[3], &m_nStaticBlockNum[k][3]);
+	}
+	else
+	{
+		EstimatedOffsetAndRef<Blocksize>(m_RawDatax2, &m_RawDatax2[k], &m_tmpOffsetxImage[k], &m_tmpOffsetyImage[k], &m_OffsetxImage[k], &m_OffsetyImage[k], m_nOffsetxLevel[3], m_nOffsetyLevel[3], NULL, NULL, &m_SadImage[k], nStaticThre[3], &m_nStaticBlockNum[k][3]);
+	}
+}
+void CHDRPlus_BlockMatchFusion::AlignFrame(int k)
+{
+	switch (m_nBurstBlockSize)
+	{
+	case 32:
+		AlignPyramid<32>(k);
+		break;
+	case 64:
+		AlignPyramid<64>(k);
+		break;
+	default:
+		AlignPyramid<16>(k);
+		break;
+	}
+	if (m_bDumpFileEnable)
+	{
+		char name[255];
+		sprintf(name, "outbmp/ofx%d.bmp", k);
+		m_OffsetxImage[k].SaveSingleChannelToBitmapFile(name, 0, m_OffsetxImage[k].GetMaxVal(), 256, 0);
+		sprintf(name, "outbmp/ofy%d.bmp", k);
+		m_OffsetyImage[k].SaveSingleChannelToBitmapFile(name, 0, m_OffsetyImage[k].GetMaxVal(), 256, 0);
+	}
+}
+// 各层静止块提前退出的块数/总块数,按帧累加后输出
+void CHDRPlus_BlockMatchFusion::PrintAlignStatistics(int Framenum)
+{
+	if (m_nBurstStaticThre <= 0 || Framenum < 2)
+		return;
+	const char *pLevelName[4] = {"x16", "x8", "x4", "x2"};
+	printf("BlockMatchFusion static early exit (thre %d):", m_nBurstStaticThre);
+	for (int l = 0; l < 4; l++)
+	{
+		int nStatic = 0;
+		int nTotal = 0;
+		for (int k = 1; k < Framenum; k++)
+		{
+			nStatic += m_nStaticBlockNum[k][l];
+			nTotal += m_nAlignBlockNum[k][l];
+		}
+		printf(" %s %d/%d(%.1f%%)", pLevelName[l], nStatic, nTotal, nTotal > 0 ? 100.0 * nStatic / nTotal : 0.0);
+	}
+	printf("\n");
+}
+// x4层上水平/垂直相邻像素差的平方和(梯度能量)按像素数归一,值越大越清晰
+double CHDRPlus_BlockMatchFusion::FrameSharpness(MultiUshortImage *pInImage)
+{
+	int nWidth = pInImage->GetImageWidth();
+	int nHeight = pInImage->GetImageHeight();
+	if (nWidth < 2 || nHeight < 2)
+		return 0;
+	long long nEnergy = 0;
+	int nProcs = omp_get_num_procs();
+#pragma omp parallel for num_threads(nProcs) reduction(+ : nEnergy)
+	for (int y = 0; y < nHeight - 1; y++)
+	{
+		unsigned short *pline0 = pInImage->GetImageLine(y);
+		unsigned short *pline1 = pInImage->GetImageLine(y + 1);
+		long long nLineEnergy = 0;
+		for (int x = 0; x < nWidth - 1; x++)
+		{
+			int dx = (int)pline0[x + 1] - (int)pline0[x];
+			int dy = (int)pline1[x] - (int)pline0[x];
+			nLineEnergy += dx * dx + dy * dy;
+		}
+		nEnergy += nLineEnergy;
+	}
+	return (double)nEnergy / ((double)(nWidth - 1) * (nHeight - 1));
+}
+// 在已建好的x4层上选最清晰的一帧作为参考帧,和第0帧交换填充图与金字塔,nFrameID同步交换
+int CHDRPlus_BlockMatchFusion::SelectReference(int nFrameID[], int Framenum)
+{
+	if (Framenum < 2)
+		return 0;
+	double t0 = omp_get_wtime();
+	double Score[12] = {0};
+	int nBest = 0;
+	for (int k = 0; k < Framenum; k++)
+	{
+		Score[k] = FrameSharpness(&m_RawDatax4[k]);
+		if (Score[k] > Score[nBest])
+		{
+			nBest = k;
+		}
+	}
+	// 只有明显比第0帧清晰(超过nRefSelectThre百分比)才换参考帧,清晰度相当时保留第0帧
+	if (Score[nBest] * 100 <= Score[0] * (100 + m_nRefSelectThre))
+	{
+		nBest = 0;
+	}
+	double t1 = omp_get_wtime();
+	printf("BlockMatchFusion sharpness:");
+	for (int k = 0; k < Framenum; k++)
+	{
+		printf(" %d:%.1f", nFrameID[k], Score[k]);
+	}
+	printf(" ref=%d (%.2fms)\n", nFrameID[nBest], (t1 - t0) * 1000);
+	if (nBest != 0)
+	{
+		TRawPadView tmpView = m_RawPadView[0];
+		m_RawPadView[0] = m_RawPadView[nBest];
+		m_RawPadView[nBest] = tmpView;
+		m_RawDatax2[0].SwapImage(&m_RawDatax2[nBest]);
+		m_RawDatax4[0].SwapImage(&m_RawDatax4[nBest]);
+		m_RawDatax8[0].SwapImage(&m_RawDatax8[nBest]);
+		m_RawDatax16[0].SwapImage(&m_RawDatax16[nBest]);
+		int tmpStage = m_nFrameStage[0];
+		m_nFrameStage[0] = m_nFrameStage[nBest];
+		m_nFrameStage[nBest] = tmpStage;
+		int tmp = nFrameID[0];
+		nFrameID[0] = nFrameID[nBest];
+		nFrameID[nBest] = tmp;
+	}
+	return nBest;
+}
+bool CHDRPlus_BlockMatchFusion::BeginBurst(TGlobalControl *pControl)
 {
 	int nGain = pControl->nCameraGain; // nGain x128
 	float Amount;
@@ -731,96 +2721,348 @@ void CHDRPlus_BlockMatchFusion::Forward(MultiUshortImage *pInImages, int nFrameI
 	}
 	Amount = Amount / 16.0;
 	printf("%d %f\n", nGain, Amount);
-	m_nAmountFactor = m_nAmountFactor * Amount;
-	unsigned short *pInraw[10];
-	for (int k = 0; k < Framenum; k++)
+	// 每个burst单独计算,不再在参数m_nAmountFactor上累乘
+	m_nBurstAmountFactor = m_nAmountFactor * Amount;
+	m_fBurstAmount = Amount;
+	// 静止块阈值随增益线性放大,nStaticSadThre对应1倍增益(128)下x2层的平均SAD
+	m_nBurstStaticThre = m_bStaticEarlyExit ? m_nStaticSadThre * pControl->nCameraGain / 128 : 0;
+	// 对齐块只有16/32/64三种实例;频域融合的16点FFT固定为32x32的融合块,只能用16,且只有整burst融合
+	if (m_nAlignBlockBit < 4 || m_nAlignBlockBit > 6)
 	{
-		pInraw[k] = pInImages[nFrameID[k]].GetImageData();
+		printf("BlockMatchFusion nAlignBlockBit %d not supported\n", m_nAlignBlockBit);
+		return false;
 	}
-	// 最大支持10帧输入
-	/////swap first frame and last frame////
-	int div = 128;
-	/*unsigned short *ptmpraw = pInraw[0];
-	pInraw[0] = pInraw[Framenum - 1];
-	pInraw[Framenum - 1] = ptmpraw;*/
-	int nMax = pInImages[0].m_nRawMAXS;
-	int nWidth = pInImages[0].GetImageWidth();
-	int nHeight = pInImages[0].GetImageHeight();
-	int NewnWidth = ((nWidth + div) / div) * div;
-	int NewnHeight = ((nHeight + div) / div) * div;
-	int padx = (NewnWidth - nWidth) / 2;
-	int pady = (NewnHeight - nHeight) / 2;
-	MultiUshortImage RawPadImage[12];
-	for (int k = 0; k < Framenum; k++)
+	m_nBurstBlockSize = 1 << m_nAlignBlockBit;
+	if (m_nMergeMode == 1 && m_nBurstBlockSize != 16)
 	{
-		pInImages[k].FillImageAround(&RawPadImage[k], padx, pady);
+		printf("BlockMatchFusion nMergeMode 1 needs nAlignBlockBit 4\n");
+		return false;
 	}
-	MultiUshortImage RawDatax2[12];	 //
-	MultiUshortImage RawDatax4[12];	 //
-	MultiUshortImage RawDatax8[12];	 //
-	MultiUshortImage RawDatax16[12]; //
-	MultiShortImage OffsetxImage[12], OffsetyImage[12];
-	MultiShortImage tmpOffsetxImage[12], tmpOffsetyImage[12];
-	CImage_FLOAT WeightImage[12];
-	CImageData_UINT32 SumblockMergedata;
-	for (int k = 0; k < Framenum; k++)
+	if (m_nMergeMode == 1 && m_bIncrementalMerge)
+	{
+		printf("BlockMatchFusion nMergeMode 1 not supported with bIncrementalMerge\n");
+		return false;
+	}
+	if (m_bIncrementalMerge && m_bRefSelectEnable)
+	{
+		printf("BlockMatchFusion bRefSelectEnable ignored in incremental merge, frame 0 is reference\n");
+	}
+	m_nBurstFrameNum = 0;
+	return true;
+}
+// 不再实际填充:帧只记录一个填充视图,bCopy为false时直接引用调用方的图,
+// 调用方在Finish之前可能改写或复用该图时(流式输入、与输出图相同)才拷贝一份原尺寸的图
+bool CHDRPlus_BlockMatchFusion::PadFrame(MultiUshortImage *pInImage, int k, bool bCopy)
+{
+	int div = 128;
+	if (k == 0)
 	{
-		/*BoxDownx2(&RawPadImage[k], &RawDatax2[k]);
-		RawDatax2[k].DownScaleImagex2(&RawDatax4[k], false);
-		RawDatax4[k].DownScaleImagex2(&RawDatax8[k], false);
-		RawDatax8[k].DownScaleImagex2(&RawDatax16[k], false);*/
-		BoxDownx2(&RawPadImage[k], &RawDatax2[k]);
-		BoxDownx2(&RawDatax2[k], &RawDatax4[k]);
-		BoxDownx2(&RawDatax4[k], &RawDatax8[k]);
-		BoxDownx2(&RawDatax8[k], &RawDatax16[k]);
+		m_nBurstMax = pInImage->m_nRawMAXS;
+		m_nBurstBLC = pInImage->m_nRawBLC;
+		m_nBurstWidth = pInImage->GetImageWidth();
+		m_nBurstHeight = pInImage->GetImageHeight();
+		int NewnWidth = ((m_nBurstWidth + div) / div) * div;
+		int NewnHeight = ((m_nBurstHeight + div) / div) * div;
+		// 最靠边的融合块步长内只有一个块覆盖,这部分要落在填充区,每边至少留一个融合块步长
+		int nMinPad = m_nBurstBlockSize * 2;
+		if (NewnWidth - m_nBurstWidth < nMinPad)
+		{
+			NewnWidth += div;
+		}
+		if (NewnHeight - m_nBurstHeight < nMinPad)
+		{
+			NewnHeight += div;
+		}
+		m_nBurstPadx = (NewnWidth - m_nBurstWidth) / 2;
+		m_nBurstPady = (NewnHeight - m_nBurstHeight) / 2;
 	}
-	for (int k = 1; k < Framenum; k++)
+	else if (pInImage->GetImageWidth() != m_nBurstWidth || pInImage->GetImageHeight() != m_nBurstHeight)
 	{
-		EstimatedOffsetNoRef(RawDatax16, &RawDatax16[k], &OffsetxImage[k], &OffsetyImage[k], m_nOffsetxLevel[0], m_nOffsetyLevel[0]);
-		UpScaleOffsetAndValuex2(&OffsetxImage[k], &tmpOffsetxImage[k]);
-		UpScaleOffsetAndValuex2(&OffsetyImage[k], &tmpOffsetyImage[k]);
+		printf("BlockMatchFusion frame %d size mismatch\n", k);
+		return false;
 	}
-	for (int k = 1; k < Framenum; k++)
+	TRawPadView *pView = &m_RawPadView[k];
+	if (bCopy)
 	{
-		EstimatedOffsetAndRef(RawDatax8, &RawDatax8[k], &tmpOffsetxImage[k], &tmpOffsetyImage[k], &OffsetxImage[k], &OffsetyImage[k], m_nOffsetxLevel[1], m_nOffsetyLevel[1]);
-		UpScaleOffsetAndValuex2(&OffsetxImage[k], &tmpOffsetxImage[k]);
-		UpScaleOffsetAndValuex2(&OffsetyImage[k], &tmpOffsetyImage[k]);
+		if (!m_RawImage[k].Clone(pInImage))
+			return false;
+		pView->pImage = &m_RawImage[k];
 	}
-	for (int k = 1; k < Framenum; k++)
+	else
 	{
-		EstimatedOffsetAndRef(RawDatax4, &RawDatax4[k], &tmpOffsetxImage[k], &tmpOffsetyImage[k], &OffsetxImage[k], &OffsetyImage[k], m_nOffsetxLevel[2], m_nOffsetyLevel[2]);
-		UpScaleOffsetAndValuex2(&OffsetxImage[k], &tmpOffsetxImage[k]);
-		UpScaleOffsetAndValuex2(&OffsetyImage[k], &tmpOffsetyImage[k]);
+		pView->pImage = pInImage;
 	}
-	for (int k = 1; k < Framenum; k++)
+	pView->nPadx = m_nBurstPadx;
+	pView->nPady = m_nBurstPady;
+	pView->nWidth = m_nBurstWidth + 2 * m_nBurstPadx;
+	pView->nHeight = m_nBurstHeight + 2 * m_nBurstPady;
+	return true;
+}
+bool CHDRPlus_BlockMatchFusion::PushFrame(MultiUshortImage *pInImage, bool bCopy)
+{
+	// 最大支持12帧输入
+	int k = m_nBurstFrameNum;
+	if (k >= 12)
+		return false;
+	// 调用方PushFrame返回后可以复用输入图(bCopy),需要留到Finish或交给任务异步处理的帧要拷贝;
+	// 不在并行域内时增量融合的非参考帧在本次调用内就融合并释放,不用拷贝
+	bool bTask = omp_in_parallel();
+	if (!PadFrame(pInImage, k, bCopy && (bTask || !m_bIncrementalMerge || k == 0)))
+		return false;
+	m_nBurstFrameID[k] = k;
+	m_nFrameStage[k] = 0;
+	m_nBurstFrameNum++;
+	if (bTask)
 	{
-		EstimatedOffsetAndRef(RawDatax2, &RawDatax2[k], &tmpOffsetxImage[k], &tmpOffsetyImage[k], &OffsetxImage[k], &OffsetyImage[k], m_nOffsetxLevel[3], m_nOffsetyLevel[3]);
-		if (m_bDumpFileEnable)
+		// 调用方在整个burst外包一个并行域时,每帧作为一个任务,本线程读下一帧时前面各帧仍在其它线程上处理,
+		// 帧之间并行;非参考帧依赖参考帧的任务(参考帧金字塔,增量融合时还有累加器初始化)
+		if (k == 0)
+		{
+#pragma omp task depend(out : m_nFrameStage[0])
+			ProcessFrame(0);
+		}
+		else
 		{
-			char name[255];
-			sprintf(name, "outbmp/ofx%d.bmp", k);
-			OffsetxImage[k].SaveSingleChannelToBitmapFile(name, 0, OffsetxImage[k].GetMaxVal(), 256, 0);
-			sprintf(name, "outbmp/ofy%d.bmp", k);
-			OffsetyImage[k].SaveSingleChannelToBitmapFile(name, 0, OffsetyImage[k].GetMaxVal(), 256, 0);
+#pragma omp task firstprivate(k) depend(in : m_nFrameStage[0])
+			ProcessFrame(k);
 		}
+		return true;
 	}
-	OffsetxImage[0].CreateImageFillValue(OffsetyImage[1].GetImageWidth(), OffsetyImage[1].GetImageHeight(), 1, 0);
-	OffsetyImage[0].CreateImageFillValue(OffsetyImage[1].GetImageWidth(), OffsetyImage[1].GetImageHeight(), 1, 0);
-	for (int k = 0; k < Framenum; k++)
+	if (!m_bIncrementalMerge)
 	{
-		WeightImage[k].SetImageSize(OffsetyImage[1].GetImageWidth(), OffsetyImage[1].GetImageHeight(), 1);
-		if (k == 0)
+		// 没有外层并行域时金字塔和对齐都推迟到Finish,所有帧一起按帧并行
+		return true;
+	}
+	return ProcessFrame(k);
+}
+// 单帧的金字塔、对齐和增量融合;选参考帧时参考帧要等所有帧到齐才确定,非增量融合的对齐推迟到Finish
+bool CHDRPlus_BlockMatchFusion::ProcessFrame(int k)
+{
+	BuildPyramid(k);
+	m_nFrameStage[k] = 1;
+	if (k > 0 && (m_bIncrementalMerge || !m_bRefSelectEnable))
+	{
+		if (omp_in_parallel())
 		{
-			WeightImage[k].FillValue(1);
+			AlignFrame(k);
 		}
 		else
 		{
-			WeightImage[k].FillValue(0);
+			// 单帧对齐时仍在自己的并行域内按行带拆任务
+			int nProcs = omp_get_num_procs();
+#pragma omp parallel num_threads(nProcs)
+			{
+#pragma omp single
+				AlignFrame(k);
+			}
+		}
+		m_nFrameStage[k] = 2;
+	}
+	if (m_bIncrementalMerge)
+	{
+		bool bRet;
+		// 帧任务并发时累加器同一时刻只允许一帧写入
+#pragma omp critical(BlockMatchFusionMerge)
+		bRet = MergeFrameIncremental(k);
+		if (!bRet)
+		{
+			printf("BlockMatchFusion frame %d merge fail\n", k);
+		}
+		return bRet;
+	}
+	return true;
+}
+bool CHDRPlus_BlockMatchFusion::MergeFrameIncremental(int k)
+{
+	// 融合块为对齐块(x2层)在全分辨率上的大小,块间步长为对齐块大小,块数与x2层对齐块数一致
+	int nWidth16 = m_RawPadView[0].GetImageWidth() / m_nBurstBlockSize;
+	int nHeight16 = m_RawPadView[0].GetImageHeight() / m_nBurstBlockSize;
+	if (k == 0)
+	{
+		// 累加器为输出尺寸的逐像素整数图(按块行叠加后再累加),总权重按块累加Q14整数,参考帧权重为1
+		if (!m_WeightImage[0].SetImageSize(nWidth16, nHeight16, 1))
+			return false;
+		m_WeightImage[0].FillValue(0);
+		if (!m_MergeAccImage.SetImageSize(m_nBurstWidth, m_nBurstHeight, 1))
+			return false;
+		m_MergeAccImage.FillValue(0);
+		MergeFrame(&m_RawPadView[0], NULL, NULL, NULL, NULL, NULL);
+		return true;
+	}
+	if (m_bSubPixelEnable)
+	{
+		MergeFrame(&m_RawPadView[k], &m_OffsetxImage[k], &m_OffsetyImage[k], &m_SadImage[k], &m_SubOffsetxImage[k], &m_SubOffsetyImage[k]);
+	}
+	else
+	{
+		MergeFrame(&m_RawPadView[k], &m_OffsetxImage[k], &m_OffsetyImage[k], &m_SadImage[k], NULL, NULL);
+	}
+	ReleaseFrame(k);
+	return true;
+}
+// 已经累加进融合结果的帧不再需要,全分辨率图/金字塔/偏移都还给内存池
+void CHDRPlus_BlockMatchFusion::ReleaseFrame(int k)
+{
+	m_RawImage[k].ClearMem();
+	m_RawPadView[k].pImage = NULL;
+	m_RawDatax2[k].ClearMem();
+	m_RawDatax4[k].ClearMem();
+	m_RawDatax8[k].ClearMem();
+	m_RawDatax16[k].ClearMem();
+	m_OffsetxImage[k].ClearMem();
+	m_OffsetyImage[k].ClearMem();
+	m_tmpOffsetxImage[k].ClearMem();
+	m_tmpOffsetyImage[k].ClearMem();
+	m_SubOffsetxImage[k].ClearMem();
+	m_SubOffsetyImage[k].ClearMem();
+	m_SadImage[k].ClearMem();
+	m_WeightImage[k].ClearMem();
+}
+// 补齐还没建的金字塔,需要时选参考帧,再把还没对齐的帧各作为一个独立任务对齐,帧之间不在层间同步
+void CHDRPlus_BlockMatchFusion::AlignBurst(int Framenum)
+{
+	int nProcs = omp_get_num_procs();
+	if (m_bRefSelectEnable)
+	{
+		// 选参考帧要用到所有帧的x4层,金字塔先全部建好
+#pragma omp parallel for num_threads(nProcs) schedule(dynamic, 1)
+		for (int k = 0; k < Framenum; k++)
+		{
+			if (m_nFrameStage[k] < 1)
+			{
+				BuildPyramid(k);
+				m_nFrameStage[k] = 1;
+			}
+		}
+		if (SelectReference(m_nBurstFrameID, Framenum) != 0)
+		{
+			// 参考帧换了,之前对齐到原参考帧的偏移作废
+			for (int k = 1; k < Framenum; k++)
+			{
+				m_nFrameStage[k] = MIN2(m_nFrameStage[k], 1);
+			}
+		}
+	}
+	else if (m_nFrameStage[0] < 1)
+	{
+		BuildPyramid(0);
+		m_nFrameStage[0] = 1;
+	}
+#pragma omp parallel num_threads(nProcs)
+	{
+#pragma omp single
+		{
+			for (int k = 1; k < Framenum; k++)
+			{
+				if (m_nFrameStage[k] >= 2)
+					continue;
+#pragma omp task firstprivate(k)
+				{
+					if (m_nFrameStage[k] < 1)
+					{
+						BuildPyramid(k);
+					}
+					AlignFrame(k);
+					m_nFrameStage[k] = 2;
+				}
+			}
+		}
+	}
+}
+void CHDRPlus_BlockMatchFusion::Finish(MultiUshortImage *pOutImage)
+{
+	int Framenum = m_nBurstFrameNum;
+	if (Framenum == 0)
+		return;
+	if (omp_in_parallel())
+	{
+		// 在PushFrame所在的并行域内调用时,先等本线程生成的帧任务全部完成
+#pragma omp taskwait
+	}
+	if (Framenum == 1)
+	{
+		if (m_RawPadView[0].pImage != pOutImage)
+		{
+			pOutImage->CopyImageRect(m_RawPadView[0].pImage, 0, 0, m_nBurstWidth, m_nBurstHeight);
+		}
+		return;
+	}
+	if (!m_bIncrementalMerge)
+	{
+		AlignBurst(Framenum);
+	}
+	PrintAlignStatistics(Framenum);
+	if (m_bIncrementalMerge)
+	{
+		if (!pOutImage->SetImageSize(m_nBurstWidth, m_nBurstHeight, 1))
+			return;
+		switch (m_nBurstBlockSize)
+		{
+		case 32:
+			MergeNormalize<64>(pOutImage, &m_MergeAccImage, &m_WeightImage[0], m_nBurstPadx, m_nBurstPady, m_nBurstMax);
+			break;
+		case 64:
+			MergeNormalize<128>(pOutImage, &m_MergeAccImage, &m_WeightImage[0], m_nBurstPadx, m_nBurstPady, m_nBurstMax);
+			break;
+		default:
+			MergeNormalize<32>(pOutImage, &m_MergeAccImage, &m_WeightImage[0], m_nBurstPadx, m_nBurstPady, m_nBurstMax);
+			break;
+		}
+		return;
+	}
+	m_OffsetxImage[0].CreateImageFillValue(m_OffsetyImage[1].GetImageWidth(), m_OffsetyImage[1].GetImageHeight(), 1, 0);
+	m_OffsetyImage[0].CreateImageFillValue(m_OffsetyImage[1].GetImageWidth(), m_OffsetyImage[1].GetImageHeight(), 1, 0);
+	// 非参考帧的权重在EstimatedWeight里逐块整体写入,不需要先清零
+	for (int k = 0; k < Framenum; k++)
+	{
+		m_WeightImage[k].SetImageSize(m_OffsetyImage[1].GetImageWidth(), m_OffsetyImage[1].GetImageHeight(), 1);
+	}
+	m_WeightImage[0].FillValue(1);
+	if (m_nMergeMode == 0)
+	{
+		EstimatedWeight(m_SadImage, Framenum, m_WeightImage);
+	}
+	MultiShortImage *pSubOffsetxImage = m_bSubPixelEnable ? m_SubOffsetxImage : NULL;
+	MultiShortImage *pSubOffsetyImage = m_bSubPixelEnable ? m_SubOffsetyImage : NULL;
+	switch (m_nBurstBlockSize)
+	{
+	case 32:
+		MergeTemporal<64>(m_RawPadView, Framenum, m_OffsetxImage, m_OffsetyImage, m_WeightImage, pOutImage, m_nBurstPadx, m_nBurstPady, m_nBurstMax, pSubOffsetxImage, pSubOffsetyImage);
+		break;
+	case 64:
+		MergeTemporal<128>(m_RawPadView, Framenum, m_OffsetxImage, m_OffsetyImage, m_WeightImage, pOutImage, m_nBurstPadx, m_nBurstPady, m_nBurstMax, pSubOffsetxImage, pSubOffsetyImage);
+		break;
+	default:
+		MergeTemporal<32>(m_RawPadView, Framenum, m_OffsetxImage, m_OffsetyImage, m_WeightImage, pOutImage, m_nBurstPadx, m_nBurstPady, m_nBurstMax, pSubOffsetxImage, pSubOffsetyImage);
+		break;
+	}
+}
+void CHDRPlus_BlockMatchFusion::Forward(MultiUshortImage *pInImages, int nFrameID[], int Framenum, TGlobalControl *pControl)
+{
+	if (!BeginBurst(pControl))
+		return;
+	Framenum = MIN2(Framenum, 12);
+	if (m_bIncrementalMerge)
+	{
+		// 增量融合逐帧对齐累加,同一时刻只保留参考帧和当前帧
+		for (int k = 0; k < Framenum; k++)
+		{
+			PushFrame(&pInImages[nFrameID[k]]);
 		}
+		Finish(&pInImages[0]);
+		return;
+	}
+	for (int k = 0; k < Framenum; k++)
+	{
+		// 融合结果写回pInImages[0],只有这一帧要拷贝,其它帧直接引用
+		PadFrame(&pInImages[nFrameID[k]], k, nFrameID[k] == 0);
+		m_nBurstFrameID[k] = nFrameID[k];
+		m_nFrameStage[k] = 0;
+	}
+	m_nBurstFrameNum = Framenum;
+	Finish(&pInImages[0]);
+	for (int k = 0; k < Framenum; k++)
+	{
+		nFrameID[k] = m_nBurstFrameID[k];
 	}
-	EstimatedWeight(RawDatax2, Framenum, OffsetxImage, OffsetyImage, WeightImage);
-	SumblockMergedata.SetImageSize(OffsetyImage[1].GetImageWidth(), OffsetyImage[1].GetImageHeight(), 1024);
-	MergeTemporal(RawPadImage, Framenum, OffsetxImage, OffsetyImage, WeightImage, &SumblockMergedata);
-	MergeWeight(RawPadImage, &SumblockMergedata, nMax);
-	pInImages[0].CopyImageRect(&RawPadImage[0], padx, pady, RawPadImage[0].GetImageWidth() - padx, RawPadImage[0].GetImageHeight() - pady);
 }
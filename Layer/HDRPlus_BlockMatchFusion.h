@@ -2,6 +2,59 @@
 #define __HDRPlus_BlockMatchFusion_H_
 #include "../Mat/WeightConfig.h"
 #include "../Mat/Mat.h"
+// 未填充的raw帧按填充后的坐标访问,填充区按FillImageAround的规则(以边界行列为轴镜像)映射回原图,
+// 超出填充范围的坐标再钳位,读出的值与真正填充后的图逐像素一致
+struct TRawPadView
+{
+	MultiUshortImage *pImage;
+	int nPadx;
+	int nPady;
+	int nWidth;	 // 填充后的宽
+	int nHeight; // 填充后的高
+	inline int GetImageWidth() { return nWidth; }
+	inline int GetImageHeight() { return nHeight; }
+	inline int MapCol(int x)
+	{
+		int nSrcWidth = pImage->GetImageWidth();
+		x = (x < 0) ? 0 : ((x >= nWidth) ? nWidth - 1 : x);
+		x -= nPadx;
+		if (x < 0)
+			x = -x;
+		else if (x >= nSrcWidth)
+			x = 2 * (nSrcWidth - 1) - x;
+		return (x < 0) ? 0 : ((x >= nSrcWidth) ? nSrcWidth - 1 : x);
+	}
+	inline int MapRow(int y)
+	{
+		int nSrcHeight = pImage->GetImageHeight();
+		y = (y < 0) ? 0 : ((y >= nHeight) ? nHeight - 1 : y);
+		y -= nPady;
+		if (y < 0)
+			y = -y;
+		else if (y >= nSrcHeight)
+			y = 2 * (nSrcHeight - 1) - y;
+		return (y < 0) ? 0 : ((y >= nSrcHeight) ? nSrcHeight - 1 : y);
+	}
+	// [x,x+w)x[y,y+h)整块落在原图内,可以直接用GetImagePos取行指针
+	inline bool IsInside(int x, int y, int w, int h)
+	{
+		return x >= nPadx && y >= nPady && x + w <= nPadx + pImage->GetImageWidth() && y + h <= nPady + pImage->GetImageHeight();
+	}
+	inline unsigned short *GetImagePos(int x, int y) { return pImage->GetImageLine(y - nPady) + (x - nPadx); }
+	inline unsigned short GetImagePixel(int x, int y) { return pImage->GetImageLine(MapRow(y))[MapCol(x)]; }
+	// 取第y行[x,x+nLen)到pLine,行号只映射一次,落在原图内的部分直接拷贝
+	inline void GetImageRow(int x, int y, int nLen, unsigned short *pLine)
+	{
+		const unsigned short *pRawline = pImage->GetImageLine(MapRow(y));
+		int xs = MIN2(MAX2(nPadx - x, 0), nLen);
+		int xe = MAX2(MIN2(nPadx + pImage->GetImageWidth() - x, nLen), xs);
+		for (int b = 0; b < xs; b++)
+			pLine[b] = pRawline[MapCol(x + b)];
+		memcpy(pLine + xs, pRawline + (x + xs - nPadx), sizeof(unsigned short) * (xe - xs));
+		for (int b = xe; b < nLen; b++)
+			pLine[b] = pRawline[MapCol(x + b)];
+	}
+};
 class CHDRPlus_BlockMatchFusion : public CSingleConfigTitleFILE
 {
 protected:
@@ -42,6 +95,28 @@ protected:
 		{
 			m_nOffsetyLevel[k] = 2;
 		}
+		m_nConfigParamList.ConfigParamListAddVariable("bSubPixelEnable", &m_bSubPixelEnable, 0, 1);
+		m_bSubPixelEnable = 0;
+		m_nConfigParamList.ConfigParamListAddVariable("bIncrementalMerge", &m_bIncrementalMerge, 0, 1);
+		m_bIncrementalMerge = 0;
+		m_nConfigParamList.ConfigParamListAddVariable("nMergeMode", &m_nMergeMode, 0, 1);
+		m_nMergeMode = 0;
+		m_nConfigParamList.ConfigParamListAddVariable("nWienerFactor", &m_nWienerFactor, 0, 1000);
+		m_nWienerFactor = 8;
+		m_nConfigParamList.ConfigParamListAddVariable("nWienerShotNoise", &m_nWienerShotNoise, 0, 10000);
+		m_nWienerShotNoise = 16;
+		m_nConfigParamList.ConfigParamListAddVariable("nWienerReadNoise", &m_nWienerReadNoise, 0, 100000);
+		m_nWienerReadNoise = 64;
+		m_nConfigParamList.ConfigParamListAddVariable("bRefSelectEnable", &m_bRefSelectEnable, 0, 1);
+		m_bRefSelectEnable = 0;
+		m_nConfigParamList.ConfigParamListAddVariable("nRefSelectThre", &m_nRefSelectThre, 0, 1000);
+		m_nRefSelectThre = 10;
+		m_nConfigParamList.ConfigParamListAddVariable("bStaticEarlyExit", &m_bStaticEarlyExit, 0, 1);
+		m_bStaticEarlyExit = 0;
+		m_nConfigParamList.ConfigParamListAddVariable("nStaticSadThre", &m_nStaticSadThre, 0, 10000);
+		m_nStaticSadThre = 8;
+		m_nConfigParamList.ConfigParamListAddVariable("nAlignBlockBit", &m_nAlignBlockBit, 4, 6);
+		m_nAlignBlockBit = 4;
 	}
 	virtual void CreateConfigTitleName()
 	{
@@ -52,6 +127,11 @@ public:
 	CHDRPlus_BlockMatchFusion()
 	{
 		Initialize();
+		m_nBurstAmountFactor = m_nAmountFactor;
+		m_fBurstAmount = 1.0f;
+		m_nBurstFrameNum = 0;
+		m_nBurstStaticThre = 0;
+		m_nBurstBlockSize = 16;
 	}
 	int m_bDumpFileEnable;
 	int m_nManualAmount;
@@ -64,14 +144,87 @@ public:
 	int m_nMaxDist;
 	int m_nOffsetxLevel[4];
 	int m_nOffsetyLevel[4];
-	void MergeWeight(MultiUshortImage *pOutMergeSingleImage, CImageData_UINT32 *pInMergeMultiImage, unsigned int Max);
-	bool EstimatedOffsetNoRef(MultiUshortImage *pInRefImage, MultiUshortImage *pInDebugImage, MultiShortImage *pOutOffsetxImage, MultiShortImage *pOutOffsetyImage, int nMoveRangex, int nMoveRangey);
-	bool EstimatedOffsetAndRef(MultiUshortImage *pInRefImage, MultiUshortImage *pInDebugImage, MultiShortImage *pPreOffsetxImage, MultiShortImage *pPreOffsetyImage, MultiShortImage *pOutOffsetxImage, MultiShortImage *pOutOffsetyImage, int nMoveRangex, int nMoveRangey);
-	bool EstimatedWeight(MultiUshortImage *pInImage, int nFrame, MultiShortImage *pPreOffsetxImage, MultiShortImage *pPreOffsetyImage, CImage_FLOAT *pOutWeightImage);
-	void MergeTemporal(MultiUshortImage *pRawPadImage, int nFrame, MultiShortImage *pOffsetxImage, MultiShortImage *pOffsetyImage, CImage_FLOAT *pInWeightImage, CImageData_UINT32 *pMergeImage);
+	int m_bSubPixelEnable;
+	int m_bIncrementalMerge;
+	int m_nMergeMode;
+	int m_nWienerFactor;
+	int m_nWienerShotNoise;
+	int m_nWienerReadNoise;
+	int m_bRefSelectEnable;
+	int m_nRefSelectThre;
+	int m_bStaticEarlyExit;
+	int m_nStaticSadThre;
+	int m_nAlignBlockBit; // 对齐块大小为1<<nAlignBlockBit(16/32/64),融合块为其2倍
+	int m_nBurstBlockSize;
+	int m_nBurstStaticThre;
+	int m_nStaticBlockNum[12][4];
+	int m_nAlignBlockNum[12][4];
+	int m_nBurstAmountFactor;
+	int m_nBurstFrameNum;
+	float m_fBurstAmount;
+	int m_nBurstMax;
+	int m_nBurstBLC;
+	int m_nBurstWidth;
+	int m_nBurstHeight;
+	int m_nBurstPadx;
+	int m_nBurstPady;
+	int m_nBurstFrameID[12]; // 各帧的输入序号,选参考帧后第0帧为参考帧
+	int m_nFrameStage[12];	 // 0:已填充 1:金字塔已建 2:已对齐
+	MultiUshortImage m_RawImage[12];
+	TRawPadView m_RawPadView[12];
+	MultiUshortImage m_RawDatax2[12];
+	MultiUshortImage m_RawDatax4[12];
+	MultiUshortImage m_RawDatax8[12];
+	MultiUshortImage m_RawDatax16[12];
+	MultiShortImage m_OffsetxImage[12], m_OffsetyImage[12];
+	MultiShortImage m_tmpOffsetxImage[12], m_tmpOffsetyImage[12];
+	MultiShortImage m_SubOffsetxImage[12], m_SubOffsetyImage[12];
+	MultiUshortImage m_SadImage[12];
+	CImage_FLOAT m_WeightImage[12];
+	CImageData_UINT32 m_MergeAccImage; // 增量融合的逐像素累加器(Q10),与输出图同尺寸
+	template <int Blocksize>
+	bool EstimatedOffsetNoRef(MultiUshortImage *pInRefImage, MultiUshortImage *pInDebugImage, MultiShortImage *pOutOffsetxImage, MultiShortImage *pOutOffsetyImage, int nMoveRangex, int nMoveRangey, int nStaticThre = 0, int *pStaticNum = NULL);
+	template <int Blocksize>
+	bool EstimatedOffsetAndRef(MultiUshortImage *pInRefImage, MultiUshortImage *pInDebugImage, MultiShortImage *pPreOffsetxImage, MultiShortImage *pPreOffsetyImage, MultiShortImage *pOutOffsetxImage, MultiShortImage *pOutOffsetyImage, int nMoveRangex, int nMoveRangey, MultiShortImage *pOutSubOffsetxImage = NULL, MultiShortImage *pOutSubOffsetyImage = NULL, MultiUshortImage *pOutSadImage = NULL, int nStaticThre = 0, int *pStaticNum = NULL);
+	template <int Blocksize>
+	void MergeNormalize(MultiUshortImage *pOutImage, CImageData_UINT32 *pAccImage, CImage_FLOAT *pTotalWeightImage, int nPadx, int nPady, unsigned int Max);
+	float SadToWeight(unsigned short AvgSad);
+	bool EstimatedWeight(MultiUshortImage *pSadImage, int nFrame, CImage_FLOAT *pOutWeightImage);
+	template <int Blocksize>
+	void MergeTileRow(TRawPadView *pRawPadView, int nFrame, int Y, int Xstart, int Xend, MultiShortImage *pOffsetxImage, MultiShortImage *pOffsetyImage, CImage_FLOAT *pInWeightImage, unsigned int *pMergeRow, MultiShortImage *pSubOffsetxImage, MultiShortImage *pSubOffsetyImage);
+	void MergeTileRowWiener(TRawPadView *pRawPadView, int nFrame, int Y, int Xstart, int Xend, MultiShortImage *pOffsetxImage, MultiShortImage *pOffsetyImage, unsigned int *pMergeRow, MultiShortImage *pSubOffsetxImage, MultiShortImage *pSubOffsetyImage);
+	template <int Blocksize>
+	void MergeTileRowFrame(TRawPadView *pRawPadView, int Y, int Xstart, int Xend, MultiShortImage *pOffsetxImage, MultiShortImage *pOffsetyImage, MultiUshortImage *pSadImage, CImage_FLOAT *pTotalWeightImage, unsigned int *pMergeRow, MultiShortImage *pSubOffsetxImage, MultiShortImage *pSubOffsetyImage);
+	template <int Blocksize>
+	void MergeTemporalBand(TRawPadView *pRawPadView, int nFrame, MultiShortImage *pOffsetxImage, MultiShortImage *pOffsetyImage, CImage_FLOAT *pInWeightImage, MultiUshortImage *pOutImage, int nPadx, int nPady, unsigned int Max, MultiShortImage *pSubOffsetxImage, MultiShortImage *pSubOffsetyImage, CImageData_UINT32 *pAccImage, MultiUshortImage *pSadImage, const float *weight, int Ystart, int Yend, int nStrips, unsigned int *pStripBuffer, unsigned int *pEdge, unsigned int *pTopHalf, unsigned int *pBottomHalf);
+	template <int Blocksize>
+	void MergeTemporal(TRawPadView *pRawPadView, int nFrame, MultiShortImage *pOffsetxImage, MultiShortImage *pOffsetyImage, CImage_FLOAT *pInWeightImage, MultiUshortImage *pOutImage, int nPadx, int nPady, unsigned int Max, MultiShortImage *pSubOffsetxImage = NULL, MultiShortImage *pSubOffsetyImage = NULL, CImageData_UINT32 *pAccImage = NULL, MultiUshortImage *pSadImage = NULL);
+	void MergeFrame(TRawPadView *pRawPadView, MultiShortImage *pOffsetxImage, MultiShortImage *pOffsetyImage, MultiUshortImage *pSadImage, MultiShortImage *pSubOffsetxImage, MultiShortImage *pSubOffsetyImage);
 	void FillUnsignedShortImage(unsigned short *pInImage, unsigned short *pOutImage, int nx, int ny, int padx, int pady);
 	bool BoxDownx2(MultiUshortImage *pInImage, MultiUshortImage *pOutImage);
-	bool UpScaleOffsetAndValuex2(MultiShortImage *InImage, MultiShortImage *pOutImage);
+	bool BoxDownPyramid(TRawPadView *pInView, MultiUshortImage *pOutImage[], int nLevel);
+	bool UpScaleOffsetAndValuex2(MultiShortImage *InImage, MultiShortImage *pOutImage, int nOutWidth = 0, int nOutHeight = 0);
+	template <int Blocksize>
+	void EstimatedOffsetBand(MultiUshortImage *pInRefImage, MultiUshortImage *pInDebugImage, MultiShortImage *pPreOffsetxImage, MultiShortImage *pPreOffsetyImage, MultiShortImage *pOutOffsetxImage, MultiShortImage *pOutOffsetyImage, int nMoveRangex, int nMoveRangey, MultiShortImage *pOutSubOffsetxImage, MultiShortImage *pOutSubOffsetyImage, MultiUshortImage *pOutSadImage, int nStaticThre, int *pStaticNum, int Ystart, int Yend, unsigned int *pSadCache, short *pBoxCache);
+	bool PadFrame(MultiUshortImage *pInImage, int k, bool bCopy);
+	void BuildPyramid(int k);
+	template <int Blocksize>
+	void AlignPyramid(int k);
+	void AlignFrame(int k);
+	void PrintAlignStatistics(int Framenum);
+	double FrameSharpness(MultiUshortImage *pInImage);
+	int SelectReference(int nFrameID[], int Framenum);
+	void AlignBurst(int Framenum);
+	bool ProcessFrame(int k);
+	bool MergeFrameIncremental(int k);
+	void ReleaseFrame(int k);
+	// 流式接口:BeginBurst后逐帧PushFrame,最后Finish融合输出;
+	// 在调用方的并行域内PushFrame时每帧的金字塔/对齐作为任务与读下一帧重叠,否则推迟到Finish按帧并行;
+	// 选参考帧(bRefSelectEnable)要看到所有帧,对齐在Finish选完参考帧后进行;增量融合时第一帧固定为参考帧;
+	// bCopy为false时调用方保证输入图在Finish之前不改写、不释放,帧直接引用输入图,不拷贝,Finish的输出图也不能是这些输入图
+	bool BeginBurst(TGlobalControl *pControl);
+	bool PushFrame(MultiUshortImage *pInImage, bool bCopy = true);
+	void Finish(MultiUshortImage *pOutImage);
 	void Forward(MultiUshortImage *pInImages, int nFrameID[], int Framenum, TGlobalControl *pControl);
 };
 #endif
@@ -1,129 +1,259 @@
 #include "HDRPlus_DPCorrection.h"
-int CHDRPlus_DPCorrection::ProcessBlock(unsigned int nBlock[][5], unsigned int nMax[5], unsigned int nMin[5])
+typedef struct tagDPCParam
 {
-	unsigned int Y, Max, Min;
-	bool bDPC = false;
-	Y = nBlock[1][2];
-	int nWhitePointCThre = m_nWhitePointCThre;
-	int nBlackPointCThre = m_nBlackPointCThre;
-	if (Y >= m_nBLC)
+	int bWhite;
+	int bBlack;
+	unsigned int nBLC;
+	unsigned int nWhiteThre;
+	unsigned int nBlackThre;
+	unsigned int nWhiteRatio;
+	unsigned int nBlackRatio;
+} TDPCParam;
+// 同色8邻域的最大/最小值由左右两列(x-2,x+2)的3行和上下两点(y-2,y+2)组成,
+// 亮点超过最大值加阈值时取最大值,暗点低于最小值减阈值时取最小值,阈值随亮度线性增加
+static inline unsigned short DPCPixel(const TDPCParam *pParam, unsigned int Y, unsigned int Max, unsigned int Min)
+{
+	unsigned int nWhiteThre = pParam->nWhiteThre;
+	unsigned int nBlackThre = pParam->nBlackThre;
+	if (Y >= pParam->nBLC)
 	{
-		nWhitePointCThre += ((Y - m_nBLC) * m_nWhitePointLRatioT) >> 8;
-		nBlackPointCThre += ((Y - m_nBLC) * m_nBlackPointLRatioT) >> 8;
+		nWhiteThre += ((Y - pParam->nBLC) * pParam->nWhiteRatio) >> 8;
+		nBlackThre += ((Y - pParam->nBLC) * pParam->nBlackRatio) >> 8;
 	}
-	Max = MAX2(MAX2(nMax[0], nMax[4]), MAX2(nBlock[0][2], nBlock[2][2]));
-	Min = MIN2(MIN2(nMin[0], nMin[4]), MIN2(nBlock[0][2], nBlock[2][2]));
-	if (m_bWhitePointCEnable == 1 && Y > Max + nWhitePointCThre)
+	if (pParam->bWhite && Y > Max + nWhiteThre)
 	{
 		Y = Max;
 	}
-	if (m_bBlackPointCEnable == 1 && Y + nBlackPointCThre < Min)
+	if (pParam->bBlack && Y + nBlackThre < Min)
 	{
 		Y = Min;
 	}
-	return Y;
+	return (unsigned short)Y;
 }
-void CHDRPlus_DPCorrection::ProcessLine(unsigned short *pInLines[], unsigned short *pOutLine, int nWidth)
+// 单个像素,左右越界时取另一侧的同色列
+static inline unsigned short DPCPixelBorder(const TDPCParam *pParam, unsigned short *pInLines[], int x, int nWidth)
 {
-	unsigned short *pIn[3];
-	unsigned int nBlock[3][5];
-	unsigned int nMax[5];
-	unsigned int nMin[5];
+	int xl = (x - 2 >= 0) ? (x - 2) : (x + 2);
+	int xr = (x + 2 < nWidth) ? (x + 2) : (x - 2);
+	if (xl >= nWidth)
+		xl = x;
+	if (xr < 0)
+		xr = x;
+	unsigned int Max = MAX2(pInLines[0][x], pInLines[2][x]);
+	unsigned int Min = MIN2(pInLines[0][x], pInLines[2][x]);
 	for (int i = 0; i < 3; i++)
 	{
-		pIn[i] = pInLines[i * 2];
-		nBlock[i][0] = pIn[i][2];
-		nBlock[i][1] = pIn[i][3];
-		nBlock[i][2] = *(pIn[i]++);
-		nBlock[i][3] = *(pIn[i]++);
+		Max = MAX2(Max, MAX2(pInLines[i][xl], pInLines[i][xr]));
+		Min = MIN2(Min, MIN2(pInLines[i][xl], pInLines[i][xr]));
 	}
-	for (int i = 0; i < 4; i++)
+	return DPCPixel(pParam, pInLines[1][x], Max, Min);
+}
+typedef int (*DPCLineFunc)(const TDPCParam *pParam, unsigned short *pInLines[], unsigned short *pOutLine, int x, int nEnd);
+static int DPCLine_C(const TDPCParam *pParam, unsigned short *pInLines[], unsigned short *pOutLine, int x, int nEnd)
+{
+	unsigned short *pU = pInLines[0];
+	unsigned short *pC = pInLines[1];
+	unsigned short *pD = pInLines[2];
+	for (; x < nEnd; x++)
 	{
-		if (m_bWhitePointCEnable == 1)
-		{
-			nMax[i] = MAX2(nBlock[0][i], MAX2(nBlock[1][i], nBlock[2][i]));
-		}
-		if (m_bBlackPointCEnable == 1)
-		{
-			nMin[i] = MIN2(nBlock[0][i], MIN2(nBlock[1][i], nBlock[2][i]));
-		}
+		unsigned int Max = MAX2(MAX2(pU[x], pD[x]), MAX2(MAX2(pU[x - 2], pU[x + 2]), MAX2(MAX2(pC[x - 2], pC[x + 2]), MAX2(pD[x - 2], pD[x + 2]))));
+		unsigned int Min = MIN2(MIN2(pU[x], pD[x]), MIN2(MIN2(pU[x - 2], pU[x + 2]), MIN2(MIN2(pC[x - 2], pC[x + 2]), MIN2(pD[x - 2], pD[x + 2]))));
+		pOutLine[x] = DPCPixel(pParam, pC[x], Max, Min);
 	}
-	int x = 0;
-	for (; x < nWidth - 2; x++)
+	return x;
+}
+#ifdef USE_NEON
+static int DPCLine_NEON(const TDPCParam *pParam, unsigned short *pInLines[], unsigned short *pOutLine, int x, int nEnd)
+{
+	unsigned short *pU = pInLines[0];
+	unsigned short *pC = pInLines[1];
+	unsigned short *pD = pInLines[2];
+	uint16x8_t vBLC = vdupq_n_u16((unsigned short)pParam->nBLC);
+	uint32x4_t vWhiteThre = vdupq_n_u32(pParam->nWhiteThre);
+	uint32x4_t vBlackThre = vdupq_n_u32(pParam->nBlackThre);
+	uint32x4_t vWhiteRatio = vdupq_n_u32(pParam->nWhiteRatio);
+	uint32x4_t vBlackRatio = vdupq_n_u32(pParam->nBlackRatio);
+	uint16x8_t vWhiteEnable = vdupq_n_u16(pParam->bWhite ? 0xFFFF : 0);
+	uint16x8_t vBlackEnable = vdupq_n_u16(pParam->bBlack ? 0xFFFF : 0);
+	for (; x + 8 <= nEnd; x += 8)
 	{
-		for (int i = 0; i < 3; i++)
+		uint16x8_t vU = vld1q_u16(pU + x);
+		uint16x8_t vC = vld1q_u16(pC + x);
+		uint16x8_t vD = vld1q_u16(pD + x);
+		uint16x8_t vL[3] = {vld1q_u16(pU + x - 2), vld1q_u16(pC + x - 2), vld1q_u16(pD + x - 2)};
+		uint16x8_t vR[3] = {vld1q_u16(pU + x + 2), vld1q_u16(pC + x + 2), vld1q_u16(pD + x + 2)};
+		uint16x8_t vMax = vmaxq_u16(vmaxq_u16(vU, vD), vmaxq_u16(vmaxq_u16(vL[0], vR[0]), vmaxq_u16(vmaxq_u16(vL[1], vR[1]), vmaxq_u16(vL[2], vR[2]))));
+		uint16x8_t vMin = vminq_u16(vminq_u16(vU, vD), vminq_u16(vminq_u16(vL[0], vR[0]), vminq_u16(vminq_u16(vL[1], vR[1]), vminq_u16(vL[2], vR[2]))));
+		// 阈值与判断用32位
+		uint16x8_t vDiff = vqsubq_u16(vC, vBLC);
+		uint32x4_t vY32[2] = {vmovl_u16(vget_low_u16(vC)), vmovl_u16(vget_high_u16(vC))};
+		uint32x4_t vDiff32[2] = {vmovl_u16(vget_low_u16(vDiff)), vmovl_u16(vget_high_u16(vDiff))};
+		uint32x4_t vMax32[2] = {vmovl_u16(vget_low_u16(vMax)), vmovl_u16(vget_high_u16(vMax))};
+		uint32x4_t vMin32[2] = {vmovl_u16(vget_low_u16(vMin)), vmovl_u16(vget_high_u16(vMin))};
+		uint32x4_t vWhite[2], vBlack[2];
+		for (int i = 0; i < 2; i++)
 		{
-			nBlock[i][4] = *(pIn[i]++);
-			if (m_bWhitePointCEnable == 1)
-			{
-				nMax[4] = MAX2(nBlock[0][4], MAX2(nBlock[1][4], nBlock[2][4]));
-			}
-			if (m_bBlackPointCEnable == 1)
-			{
-				nMin[4] = MIN2(nBlock[0][4], MIN2(nBlock[1][4], nBlock[2][4]));
-			}
+			uint32x4_t vThre = vaddq_u32(vWhiteThre, vshrq_n_u32(vmulq_u32(vDiff32[i], vWhiteRatio), 8));
+			vWhite[i] = vcgtq_u32(vY32[i], vaddq_u32(vMax32[i], vThre));
+			vThre = vaddq_u32(vBlackThre, vshrq_n_u32(vmulq_u32(vDiff32[i], vBlackRatio), 8));
+			vBlack[i] = vcltq_u32(vaddq_u32(vY32[i], vThre), vMin32[i]);
 		}
-		*(pOutLine++) = (unsigned short)ProcessBlock(nBlock, nMax, nMin);
-		for (int i = 0; i < 3; i++)
+		uint16x8_t vWhiteMask = vandq_u16(vcombine_u16(vmovn_u32(vWhite[0]), vmovn_u32(vWhite[1])), vWhiteEnable);
+		uint16x8_t vBlackMask = vandq_u16(vcombine_u16(vmovn_u32(vBlack[0]), vmovn_u32(vBlack[1])), vBlackEnable);
+		uint16x8_t vOut = vbslq_u16(vWhiteMask, vMax, vC);
+		vOut = vbslq_u16(vBlackMask, vMin, vOut);
+		vst1q_u16(pOutLine + x, vOut);
+	}
+	return x;
+}
+#endif
+#ifdef USE_X86_DISPATCH
+// 两个判断互斥(亮点要求Y>Max,暗点要求Y<Min),各自由32位比较得到掩码后选择
+X86_TARGET("sse4.1") static int DPCLine_SSE41(const TDPCParam *pParam, unsigned short *pInLines[], unsigned short *pOutLine, int x, int nEnd)
+{
+	unsigned short *pU = pInLines[0];
+	unsigned short *pC = pInLines[1];
+	unsigned short *pD = pInLines[2];
+	const __m128i vZero = _mm_setzero_si128();
+	const __m128i vBLC = _mm_set1_epi16((short)pParam->nBLC);
+	const __m128i vWhiteThre = _mm_set1_epi32(pParam->nWhiteThre);
+	const __m128i vBlackThre = _mm_set1_epi32(pParam->nBlackThre);
+	const __m128i vWhiteRatio = _mm_set1_epi32(pParam->nWhiteRatio);
+	const __m128i vBlackRatio = _mm_set1_epi32(pParam->nBlackRatio);
+	const __m128i vWhiteEnable = _mm_set1_epi16(pParam->bWhite ? -1 : 0);
+	const __m128i vBlackEnable = _mm_set1_epi16(pParam->bBlack ? -1 : 0);
+	for (; x + 8 <= nEnd; x += 8)
+	{
+		__m128i vU = _mm_loadu_si128((const __m128i *)(pU + x));
+		__m128i vC = _mm_loadu_si128((const __m128i *)(pC + x));
+		__m128i vD = _mm_loadu_si128((const __m128i *)(pD + x));
+		__m128i vMax = _mm_max_epu16(vU, vD);
+		__m128i vMin = _mm_min_epu16(vU, vD);
+		for (int k = -2; k <= 2; k += 4)
 		{
-			for (int j = 0; j < 4; j++)
-			{
-				nBlock[i][j] = nBlock[i][j + 1];
-			}
+			__m128i v0 = _mm_loadu_si128((const __m128i *)(pU + x + k));
+			__m128i v1 = _mm_loadu_si128((const __m128i *)(pC + x + k));
+			__m128i v2 = _mm_loadu_si128((const __m128i *)(pD + x + k));
+			vMax = _mm_max_epu16(vMax, _mm_max_epu16(v0, _mm_max_epu16(v1, v2)));
+			vMin = _mm_min_epu16(vMin, _mm_min_epu16(v0, _mm_min_epu16(v1, v2)));
 		}
-		for (int j = 0; j < 4; j++)
+		__m128i vDiff = _mm_subs_epu16(vC, vBLC);
+		__m128i vWhite[2], vBlack[2];
+		for (int i = 0; i < 2; i++)
 		{
-			if (m_bWhitePointCEnable == 1)
-			{
-				nMax[j] = nMax[j + 1];
-			}
-			if (m_bBlackPointCEnable == 1)
-			{
-				nMin[j] = nMin[j + 1];
-			}
+			__m128i vY32 = i ? _mm_unpackhi_epi16(vC, vZero) : _mm_unpacklo_epi16(vC, vZero);
+			__m128i vDiff32 = i ? _mm_unpackhi_epi16(vDiff, vZero) : _mm_unpacklo_epi16(vDiff, vZero);
+			__m128i vMax32 = i ? _mm_unpackhi_epi16(vMax, vZero) : _mm_unpacklo_epi16(vMax, vZero);
+			__m128i vMin32 = i ? _mm_unpackhi_epi16(vMin, vZero) : _mm_unpacklo_epi16(vMin, vZero);
+			__m128i vThre = _mm_add_epi32(vWhiteThre, _mm_srli_epi32(_mm_mullo_epi32(vDiff32, vWhiteRatio), 8));
+			vWhite[i] = _mm_cmpgt_epi32(vY32, _mm_add_epi32(vMax32, vThre));
+			vThre = _mm_add_epi32(vBlackThre, _mm_srli_epi32(_mm_mullo_epi32(vDiff32, vBlackRatio), 8));
+			vBlack[i] = _mm_cmplt_epi32(_mm_add_epi32(vY32, vThre), vMin32);
 		}
+		__m128i vWhiteMask = _mm_and_si128(_mm_packs_epi32(vWhite[0], vWhite[1]), vWhiteEnable);
+		__m128i vBlackMask = _mm_and_si128(_mm_packs_epi32(vBlack[0], vBlack[1]), vBlackEnable);
+		__m128i vOut = _mm_blendv_epi8(vC, vMax, vWhiteMask);
+		vOut = _mm_blendv_epi8(vOut, vMin, vBlackMask);
+		_mm_storeu_si128((__m128i *)(pOutLine + x), vOut);
 	}
-	for (; x < nWidth; x++)
+	return x;
+}
+X86_TARGET("avx2") static int DPCLine_AVX2(const TDPCParam *pParam, unsigned short *pInLines[], unsigned short *pOutLine, int x, int nEnd)
+{
+	unsigned short *pU = pInLines[0];
+	unsigned short *pC = pInLines[1];
+	unsigned short *pD = pInLines[2];
+	const __m256i vBLC = _mm256_set1_epi16((short)pParam->nBLC);
+	const __m256i vWhiteThre = _mm256_set1_epi32(pParam->nWhiteThre);
+	const __m256i vBlackThre = _mm256_set1_epi32(pParam->nBlackThre);
+	const __m256i vWhiteRatio = _mm256_set1_epi32(pParam->nWhiteRatio);
+	const __m256i vBlackRatio = _mm256_set1_epi32(pParam->nBlackRatio);
+	const __m256i vWhiteEnable = _mm256_set1_epi16(pParam->bWhite ? -1 : 0);
+	const __m256i vBlackEnable = _mm256_set1_epi16(pParam->bBlack ? -1 : 0);
+	for (; x + 16 <= nEnd; x += 16)
 	{
-		for (int i = 0; i < 3; i++)
+		__m256i vU = _mm256_loadu_si256((const __m256i *)(pU + x));
+		__m256i vC = _mm256_loadu_si256((const __m256i *)(pC + x));
+		__m256i vD = _mm256_loadu_si256((const __m256i *)(pD + x));
+		__m256i vMax = _mm256_max_epu16(vU, vD);
+		__m256i vMin = _mm256_min_epu16(vU, vD);
+		for (int k = -2; k <= 2; k += 4)
 		{
-			nBlock[i][4] = nBlock[i][0];
-			if (m_bWhitePointCEnable == 1)
-			{
-				nMax[4] = nMax[0];
-			}
-			if (m_bBlackPointCEnable == 1)
-			{
-				nMin[4] = nMin[0];
-			}
+			__m256i v0 = _mm256_loadu_si256((const __m256i *)(pU + x + k));
+			__m256i v1 = _mm256_loadu_si256((const __m256i *)(pC + x + k));
+			__m256i v2 = _mm256_loadu_si256((const __m256i *)(pD + x + k));
+			vMax = _mm256_max_epu16(vMax, _mm256_max_epu16(v0, _mm256_max_epu16(v1, v2)));
+			vMin = _mm256_min_epu16(vMin, _mm256_min_epu16(v0, _mm256_min_epu16(v1, v2)));
 		}
-		*(pOutLine++) = (unsigned short)ProcessBlock(nBlock, nMax, nMin);
-		for (int i = 0; i < 3; i++)
+		__m256i vDiff = _mm256_subs_epu16(vC, vBLC);
+		__m256i vWhite[2], vBlack[2];
+		for (int i = 0; i < 2; i++)
 		{
-			for (int j = 0; j < 4; j++)
-			{
-				nBlock[i][j] = nBlock[i][j + 1];
-			}
-		}
-		for (int j = 0; j < 4; j++)
-		{
-			if (m_bWhitePointCEnable == 1)
-			{
-				nMax[j] = nMax[j + 1];
-			}
-			if (m_bBlackPointCEnable == 1)
-			{
-				nMin[j] = nMin[j + 1];
-			}
+			__m256i vY32 = _mm256_cvtepu16_epi32(i ? _mm256_extracti128_si256(vC, 1) : _mm256_castsi256_si128(vC));
+			__m256i vDiff32 = _mm256_cvtepu16_epi32(i ? _mm256_extracti128_si256(vDiff, 1) : _mm256_castsi256_si128(vDiff));
+			__m256i vMax32 = _mm256_cvtepu16_epi32(i ? _mm256_extracti128_si256(vMax, 1) : _mm256_castsi256_si128(vMax));
+			__m256i vMin32 = _mm256_cvtepu16_epi32(i ? _mm256_extracti128_si256(vMin, 1) : _mm256_castsi256_si128(vMin));
+			__m256i vThre = _mm256_add_epi32(vWhiteThre, _mm256_srli_epi32(_mm256_mullo_epi32(vDiff32, vWhiteRatio), 8));
+			vWhite[i] = _mm256_cmpgt_epi32(vY32, _mm256_add_epi32(vMax32, vThre));
+			vThre = _mm256_add_epi32(vBlackThre, _mm256_srli_epi32(_mm256_mullo_epi32(vDiff32, vBlackRatio), 8));
+			vBlack[i] = _mm256_cmpgt_epi32(vMin32, _mm256_add_epi32(vY32, vThre));
 		}
+		// packs按128位通道交织,permute恢复顺序
+		__m256i vWhiteMask = _mm256_and_si256(_mm256_permute4x64_epi64(_mm256_packs_epi32(vWhite[0], vWhite[1]), 0xD8), vWhiteEnable);
+		__m256i vBlackMask = _mm256_and_si256(_mm256_permute4x64_epi64(_mm256_packs_epi32(vBlack[0], vBlack[1]), 0xD8), vBlackEnable);
+		__m256i vOut = _mm256_blendv_epi8(vC, vMax, vWhiteMask);
+		vOut = _mm256_blendv_epi8(vOut, vMin, vBlackMask);
+		_mm256_storeu_si256((__m256i *)(pOutLine + x), vOut);
+	}
+	return x;
+}
+#endif
+static DPCLineFunc GetDPCLineFunc()
+{
+#ifdef USE_NEON
+	return DPCLine_NEON;
+#else
+#ifdef USE_X86_DISPATCH
+	int nLevel = GetX86SimdLevel();
+	if (nLevel >= X86_SIMD_AVX2)
+		return DPCLine_AVX2;
+	if (nLevel >= X86_SIMD_SSE41)
+		return DPCLine_SSE41;
+#endif
+	return DPCLine_C;
+#endif
+}
+// pInLines为同色的3行(y-2,y,y+2),直接指向图像行,不再拷贝
+void CHDRPlus_DPCorrection::ProcessLine(unsigned short *pInLines[], unsigned short *pOutLine, int nWidth, int nThreAdd)
+{
+	static const DPCLineFunc DPCLine = GetDPCLineFunc();
+	TDPCParam tParam;
+	tParam.bWhite = (m_bWhitePointCEnable == 1);
+	tParam.bBlack = (m_bBlackPointCEnable == 1);
+	tParam.nBLC = (m_nBLC < 0 || m_nBLC > 65535) ? 65535 : m_nBLC;
+	tParam.nWhiteThre = m_nWhitePointCThre + nThreAdd;
+	tParam.nBlackThre = m_nBlackPointCThre + nThreAdd;
+	tParam.nWhiteRatio = m_nWhitePointLRatioT;
+	tParam.nBlackRatio = m_nBlackPointLRatioT;
+	int x = 0;
+	for (; x < MIN2(2, nWidth); x++)
+	{
+		pOutLine[x] = DPCPixelBorder(&tParam, pInLines, x, nWidth);
+	}
+	if (nWidth > 4)
+	{
+		x = DPCLine(&tParam, pInLines, pOutLine, x, nWidth - 2);
+		x = DPCLine_C(&tParam, pInLines, pOutLine, x, nWidth - 2);
+	}
+	for (; x < nWidth; x++)
+	{
+		pOutLine[x] = DPCPixelBorder(&tParam, pInLines, x, nWidth);
 	}
 }
 bool CHDRPlus_DPCorrection::Forward(MultiUshortImage *pInImage, MultiUshortImage *pOutImage, TGlobalControl *pControl)
 {
 	int nWidth = pInImage->GetImageWidth();
 	int nHeight = pInImage->GetImageHeight();
-	unsigned short *pInLines[5];
-	unsigned short *pBuffer = NULL;
 	if (pOutImage->GetImageWidth() != nWidth || pOutImage->GetImageHeight() != nHeight)
 	{
 		if (!pOutImage->CreateImage(nWidth, nHeight, pInImage->m_nRawBits))
@@ -132,64 +262,214 @@ bool CHDRPlus_DPCorrection::Forward(MultiUshortImage *pInImage, MultiUshortImage
 	pOutImage->CopyParameters(pInImage);
 	pOutImage->m_nRawBLC = m_nBLC = pControl->nBLC;
 	pOutImage->m_nRawMAXS = m_nMAXS = pControl->nWP;
-	int nProcs = omp_get_num_procs();
-	pBuffer = new unsigned short[nWidth * 5 * nProcs];
-	if (pBuffer == NULL)
-		return false;
-	int loop = 0;
-#pragma omp parallel for num_threads(nProcs) firstprivate(loop) private(pInLines)
-	for (int y = 0; y < nHeight; y++)
+	if (!m_bStaticMapEnable)
+	{
+		DynamicCorrection(pInImage, pOutImage, 0);
+		return true;
+	}
+	if (m_nStaticMapWidth != nWidth || m_nStaticMapHeight != nHeight)
 	{
-		int nThreadId = omp_get_thread_num();
-		if (loop == 0)
+		m_nStaticMapWidth = nWidth;
+		m_nStaticMapHeight = nHeight;
+		m_nStaticMapBurstCount = 0;
+		m_bStaticMapReady = LoadStaticMap(nWidth, nHeight);
+	}
+	if (m_bStaticMapReady)
+	{
+		// 表内的坏点直接修正,另加一遍高阈值的动态检测兜底新出现的强坏点
+		if (m_bStaticMapDynamicEnable)
 		{
-			pInLines[0] = pBuffer + nWidth * 5 * nThreadId;
-			pInLines[1] = pBuffer + nWidth * 5 * nThreadId + nWidth * 1;
-			pInLines[2] = pBuffer + nWidth * 5 * nThreadId + nWidth * 2;
-			pInLines[3] = pBuffer + nWidth * 5 * nThreadId + nWidth * 3;
-			pInLines[4] = pBuffer + nWidth * 5 * nThreadId + nWidth * 4;
-			if (y == 0)
-			{
-				memcpy(pInLines[0], pInImage->GetImageLine(2), nWidth * sizeof(unsigned short));
-				memcpy(pInLines[1], pInImage->GetImageLine(3), nWidth * sizeof(unsigned short));
-				memcpy(pInLines[2], pInImage->GetImageLine(0), nWidth * sizeof(unsigned short));
-				memcpy(pInLines[3], pInImage->GetImageLine(1), nWidth * sizeof(unsigned short));
-			}
-			else
+			DynamicCorrection(pInImage, pOutImage, m_nStaticMapDynamicThreAdd);
+		}
+		else
+		{
+#pragma omp parallel for
+			for (int y = 0; y < nHeight; y++)
 			{
-				memcpy(pInLines[0], pInImage->GetImageLine(y - 2), nWidth * sizeof(unsigned short));
-				memcpy(pInLines[1], pInImage->GetImageLine(y - 1), nWidth * sizeof(unsigned short));
-				memcpy(pInLines[2], pInImage->GetImageLine(y + 0), nWidth * sizeof(unsigned short));
-				memcpy(pInLines[3], pInImage->GetImageLine(y + 1), nWidth * sizeof(unsigned short));
+				memcpy(pOutImage->GetImageLine(y), pInImage->GetImageLine(y), nWidth * sizeof(unsigned short));
 			}
-			loop++;
 		}
-		if (y < nHeight - 2)
+		StaticCorrection(pOutImage);
+		return true;
+	}
+	// 学习阶段:正常动态检测,同时累计每个像素被修正的burst数
+	DynamicCorrection(pInImage, pOutImage, 0);
+	if (!AccumulateDefectHits(pInImage, pOutImage))
+		return false;
+	if (++m_nStaticMapBurstCount >= m_nStaticMapBurstNum)
+	{
+		if (!BuildStaticMap())
+			return false;
+		m_bStaticMapReady = 1;
+		if (!SaveStaticMap())
 		{
-			memcpy(pInLines[4], pInImage->GetImageLine(y + 2), nWidth * sizeof(unsigned short));
+			printf("DPCorrection: save static map fail\n");
 		}
-		else
+	}
+	return true;
+}
+void CHDRPlus_DPCorrection::DynamicCorrection(MultiUshortImage *pInImage, MultiUshortImage *pOutImage, int nThreAdd)
+{
+	int nWidth = pInImage->GetImageWidth();
+	int nHeight = pInImage->GetImageHeight();
+#pragma omp parallel for
+	for (int y = 0; y < nHeight; y++)
+	{
+		// 上下越界时取另一侧的同色行
+		unsigned short *pInLines[3];
+		pInLines[0] = pInImage->GetImageLine((y - 2 >= 0) ? (y - 2) : (y + 2));
+		pInLines[1] = pInImage->GetImageLine(y);
+		pInLines[2] = pInImage->GetImageLine((y + 2 < nHeight) ? (y + 2) : (y - 2));
+		ProcessLine(pInLines, pOutImage->GetImageLine(y), nWidth, nThreAdd);
+	}
+}
+// 按传感器和分辨率区分坏点表文件
+void CHDRPlus_DPCorrection::GetStaticMapFileName(char *pFileName, int nWidth, int nHeight)
+{
+	sprintf(pFileName, "./config/DPCMap_%d_%dx%d.bin", m_nSensorID, nWidth, nHeight);
+}
+// 文件格式:int[4]{magic,宽,高,坏点数} + 坏点数x(unsigned short x,unsigned short y)
+#define DPC_STATIC_MAP_MAGIC 0x4D435044 // "DPCM"
+bool CHDRPlus_DPCorrection::LoadStaticMap(int nWidth, int nHeight)
+{
+	char pFileName[256];
+	int nHeader[4];
+	GetStaticMapFileName(pFileName, nWidth, nHeight);
+	FILE *fp = fopen(pFileName, "rb");
+	if (fp == NULL)
+		return false;
+	if (fread(nHeader, sizeof(int), 4, fp) != 4 || nHeader[0] != DPC_STATIC_MAP_MAGIC || nHeader[1] != nWidth || nHeader[2] != nHeight || nHeader[3] < 0)
+	{
+		printf("DPCorrection: invalid static map %s\n", pFileName);
+		fclose(fp);
+		return false;
+	}
+	m_nDefectNum = nHeader[3];
+	if (m_nDefectNum > 0)
+	{
+		if (!m_DefectList.SetImageSize(m_nDefectNum, 1, 2))
 		{
-			pInLines[4] = pInLines[0];
+			fclose(fp);
+			return false;
 		}
-		ProcessLine(pInLines, pOutImage->GetImageLine(y), nWidth);
-		if (y < nHeight - 2)
+		if (fread(m_DefectList.GetImageData(), sizeof(unsigned short) * 2, m_nDefectNum, fp) != (size_t)m_nDefectNum)
 		{
-			unsigned short *pTemp = pInLines[0];
-			for (int i = 0; i < 4; i++)
-			{
-				pInLines[i] = pInLines[i + 1];
-			}
-			pInLines[4] = pTemp;
+			printf("DPCorrection: invalid static map %s\n", pFileName);
+			fclose(fp);
+			return false;
 		}
-		else
+	}
+	fclose(fp);
+	unsigned short *pList = m_DefectList.GetImageData();
+	for (int i = 0; i < m_nDefectNum; i++)
+	{
+		if (pList[i * 2] >= nWidth || pList[i * 2 + 1] >= nHeight)
+		{
+			printf("DPCorrection: invalid static map %s\n", pFileName);
+			return false;
+		}
+	}
+	printf("DPCorrection: load %d static defects from %s\n", m_nDefectNum, pFileName);
+	return true;
+}
+bool CHDRPlus_DPCorrection::SaveStaticMap()
+{
+	char pFileName[256];
+	int nHeader[4] = {DPC_STATIC_MAP_MAGIC, m_nStaticMapWidth, m_nStaticMapHeight, m_nDefectNum};
+	GetStaticMapFileName(pFileName, m_nStaticMapWidth, m_nStaticMapHeight);
+	FILE *fp = fopen(pFileName, "wb");
+	if (fp == NULL)
+		return false;
+	if (fwrite(nHeader, sizeof(int), 4, fp) != 4)
+	{
+		fclose(fp);
+		return false;
+	}
+	if (m_nDefectNum > 0 && fwrite(m_DefectList.GetImageData(), sizeof(unsigned short) * 2, m_nDefectNum, fp) != (size_t)m_nDefectNum)
+	{
+		fclose(fp);
+		return false;
+	}
+	fclose(fp);
+	printf("DPCorrection: save %d static defects to %s\n", m_nDefectNum, pFileName);
+	return true;
+}
+bool CHDRPlus_DPCorrection::AccumulateDefectHits(MultiUshortImage *pInImage, MultiUshortImage *pOutImage)
+{
+	int nWidth = pInImage->GetImageWidth();
+	int nHeight = pInImage->GetImageHeight();
+	if (m_nStaticMapBurstCount == 0)
+	{
+		if (!m_DefectHitImage.SetImageSize(nWidth, nHeight, 1))
+			return false;
+		m_DefectHitImage.FillValue(0);
+	}
+#pragma omp parallel for
+	for (int y = 0; y < nHeight; y++)
+	{
+		unsigned short *pIn = pInImage->GetImageLine(y);
+		unsigned short *pOut = pOutImage->GetImageLine(y);
+		unsigned char *pHit = m_DefectHitImage.GetImageLine(y);
+		for (int x = 0; x < nWidth; x++)
 		{
-			for (int i = 0; i < 4; i++)
+			pHit[x] += (pIn[x] != pOut[x]);
+		}
+	}
+	return true;
+}
+bool CHDRPlus_DPCorrection::BuildStaticMap()
+{
+	int nWidth = m_DefectHitImage.GetImageWidth();
+	int nHeight = m_DefectHitImage.GetImageHeight();
+	int nMinHit = MIN2(m_nStaticMapMinHit, m_nStaticMapBurstNum);
+	m_nDefectNum = 0;
+	for (int y = 0; y < nHeight; y++)
+	{
+		unsigned char *pHit = m_DefectHitImage.GetImageLine(y);
+		for (int x = 0; x < nWidth; x++)
+		{
+			m_nDefectNum += (pHit[x] >= nMinHit);
+		}
+	}
+	if (m_nDefectNum > 0)
+	{
+		if (!m_DefectList.SetImageSize(m_nDefectNum, 1, 2))
+			return false;
+		unsigned short *pList = m_DefectList.GetImageData();
+		for (int y = 0; y < nHeight; y++)
+		{
+			unsigned char *pHit = m_DefectHitImage.GetImageLine(y);
+			for (int x = 0; x < nWidth; x++)
 			{
-				pInLines[i] = pInLines[i + 1];
+				if (pHit[x] >= nMinHit)
+				{
+					*(pList++) = (unsigned short)x;
+					*(pList++) = (unsigned short)y;
+				}
 			}
 		}
 	}
-	delete[] pBuffer;
+	m_DefectHitImage.ClearMem();
 	return true;
 }
+// 表内坏点取上下左右4个同色点中间两个的均值,相邻坏点最多污染其中一个
+void CHDRPlus_DPCorrection::StaticCorrection(MultiUshortImage *pOutImage)
+{
+	int nWidth = pOutImage->GetImageWidth();
+	int nHeight = pOutImage->GetImageHeight();
+	unsigned short *pList = m_DefectList.GetImageData();
+	for (int i = 0; i < m_nDefectNum; i++)
+	{
+		int x = pList[i * 2];
+		int y = pList[i * 2 + 1];
+		int xl = (x - 2 >= 0) ? (x - 2) : MIN2(x + 2, nWidth - 1);
+		int xr = (x + 2 < nWidth) ? (x + 2) : MAX2(x - 2, 0);
+		int yu = (y - 2 >= 0) ? (y - 2) : MIN2(y + 2, nHeight - 1);
+		int yd = (y + 2 < nHeight) ? (y + 2) : MAX2(y - 2, 0);
+		unsigned short *pLine = pOutImage->GetImageLine(y);
+		int V[4] = {pLine[xl], pLine[xr], pOutImage->GetImageLine(yu)[x], pOutImage->GetImageLine(yd)[x]};
+		int nMax = MAX2(MAX2(V[0], V[1]), MAX2(V[2], V[3]));
+		int nMin = MIN2(MIN2(V[0], V[1]), MIN2(V[2], V[3]));
+		pLine[x] = (unsigned short)((V[0] + V[1] + V[2] + V[3] - nMax - nMin + 1) >> 1);
+	}
+}
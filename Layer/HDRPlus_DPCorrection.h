@@ -6,7 +6,21 @@ class CHDRPlus_DPCorrection : public CSingleConfigTitleFILE
 private:
 	int m_nBLC;
 	int m_nMAXS;
-	int ProcessBlock(unsigned int nWindow[][5], unsigned int nMax[5], unsigned int nMin[5]);
+	// 静态坏点表:学习阶段逐像素累计动态检测命中的burst数,学满后转成坐标表并存盘
+	int m_nStaticMapWidth;
+	int m_nStaticMapHeight;
+	int m_nStaticMapBurstCount;
+	int m_bStaticMapReady;
+	int m_nDefectNum;
+	CImageData_UINT8 m_DefectHitImage;
+	CImageData_UINT16 m_DefectList;
+	void DynamicCorrection(MultiUshortImage *pInImage, MultiUshortImage *pOutImage, int nThreAdd);
+	void GetStaticMapFileName(char *pFileName, int nWidth, int nHeight);
+	bool LoadStaticMap(int nWidth, int nHeight);
+	bool SaveStaticMap();
+	bool AccumulateDefectHits(MultiUshortImage *pInImage, MultiUshortImage *pOutImage);
+	bool BuildStaticMap();
+	void StaticCorrection(MultiUshortImage *pOutImage);
 
 protected:
 	virtual void InitConfigParamList()
@@ -25,6 +39,18 @@ protected:
 		m_nBlackPointCThre = 5;
 		m_nConfigParamList.ConfigParamListAddVariable("nBlackPointLRatioT", &m_nBlackPointLRatioT, 0, 65536);
 		m_nBlackPointLRatioT = 0;
+		m_nConfigParamList.ConfigParamListAddVariable("bStaticMapEnable", &m_bStaticMapEnable, 0, 1);
+		m_bStaticMapEnable = 0;
+		m_nConfigParamList.ConfigParamListAddVariable("nSensorID", &m_nSensorID, 0, 65535);
+		m_nSensorID = 0;
+		m_nConfigParamList.ConfigParamListAddVariable("nStaticMapBurstNum", &m_nStaticMapBurstNum, 1, 255);
+		m_nStaticMapBurstNum = 8;
+		m_nConfigParamList.ConfigParamListAddVariable("nStaticMapMinHit", &m_nStaticMapMinHit, 1, 255);
+		m_nStaticMapMinHit = 6;
+		m_nConfigParamList.ConfigParamListAddVariable("bStaticMapDynamicEnable", &m_bStaticMapDynamicEnable, 0, 1);
+		m_bStaticMapDynamicEnable = 1;
+		m_nConfigParamList.ConfigParamListAddVariable("nStaticMapDynamicThreAdd", &m_nStaticMapDynamicThreAdd, 0, 65536);
+		m_nStaticMapDynamicThreAdd = 64;
 	}
 	virtual void CreateConfigTitleName()
 	{
@@ -39,11 +65,22 @@ public:
 	int m_bBlackPointCEnable;
 	int m_nBlackPointCThre;
 	int m_nBlackPointLRatioT;
+	int m_bStaticMapEnable;
+	int m_nSensorID;
+	int m_nStaticMapBurstNum;
+	int m_nStaticMapMinHit;
+	int m_bStaticMapDynamicEnable;
+	int m_nStaticMapDynamicThreAdd;
 	CHDRPlus_DPCorrection()
 	{
 		Initialize();
+		m_nStaticMapWidth = 0;
+		m_nStaticMapHeight = 0;
+		m_nStaticMapBurstCount = 0;
+		m_bStaticMapReady = 0;
+		m_nDefectNum = 0;
 	}
-	void ProcessLine(unsigned short *pInLines[], unsigned short *pOutLine, int nWidth);
+	void ProcessLine(unsigned short *pInLines[], unsigned short *pOutLine, int nWidth, int nThreAdd = 0);
 	bool Forward(MultiUshortImage *pInImage, MultiUshortImage *pOutImage, TGlobalControl *pControl);
 };
 
@@ -177,7 +177,6 @@ bool CHDRPlus_Demosaicing::Forward(MultiUshortImage *pInRAWImage, MultiUshortIma
 }
 void CHDRPlus_Demosaicing::RAWToYUVH(unsigned short BlockRaw[5][5], int nCFA, int HVYUVH[6], int bYFlag, int bXFlag, int bHGreenFlag, int bVGreenFlag)
 {
-	int i, HYUVH[4], VYUVH[4];
 	// int bHGreenFlag = (nCFA & 1) ^ bYFlag;
 	// int bVGreenFlag = bXFlag ^ bYFlag;
 	unsigned short VRAW[5];
@@ -220,7 +219,11 @@ void CHDRPlus_Demosaicing::RAWToYUVH(unsigned short BlockRaw[5][5], int nCFA, in
 	VRAW[3] = BlockRaw[3][4];
 	VRAW[4] = BlockRaw[4][4];
 	Bayer2GC(VRAW, pVGC[4], bVGreenFlag);
-
+	GCToYUVH(pHGC, pVGC, HVYUVH, bYFlag, bXFlag);
+}
+void CHDRPlus_Demosaicing::GCToYUVH(int pHGC[5][2], int pVGC[5][2], int HVYUVH[6], int bYFlag, int bXFlag)
+{
+	int i, HYUVH[4], VYUVH[4];
 	GCFilter51(pHGC, HYUVH, bYFlag);
 	GCFilter51(pVGC, VYUVH, bXFlag);
 	/////////////////////
@@ -242,141 +245,153 @@ void CHDRPlus_Demosaicing::RAWToYUVH(unsigned short BlockRaw[5][5], int nCFA, in
 			HVYUVH[i] = 65535;
 	}
 }
+// 取第y行,上下越界按CFA同相镜像(-y、2(H-1)-y),左右各镜像扩nPad个像素
+void CHDRPlus_Demosaicing::PadRawLine(MultiUshortImage *pInImage, int y, unsigned short *pOutLine, int nPad)
+{
+	int nWidth = pInImage->GetImageWidth();
+	int nHeight = pInImage->GetImageHeight();
+	if (y < 0)
+		y = -y;
+	if (y > nHeight - 1)
+		y = 2 * (nHeight - 1) - y;
+	unsigned short *pInLine = pInImage->GetImageLine(y);
+	memcpy(pOutLine + nPad, pInLine, nWidth * sizeof(unsigned short));
+	for (int x = 1; x <= nPad; x++)
+	{
+		pOutLine[nPad - x] = pInLine[x];
+		pOutLine[nPad + nWidth - 1 + x] = pInLine[nWidth - 1 - x];
+	}
+}
+// 按行并行,每个线程5行扩边后的环形缓存;
+// 每行的水平GC(Bayer2GC)只算一次存入5行环形缓存,当前行每列的垂直GC也只算一次,
+// 每个像素再从缓存里取5x2个GC做GCToYUVH,结果与逐像素RAWToYUVH一致
 bool CHDRPlus_Demosaicing::RawToHVYUVHImage(MultiUshortImage *pInImage, MultiUshortImage *pOutImage)
 {
 	int nWidth = pInImage->GetImageWidth();
 	int nHeight = pInImage->GetImageHeight();
-	if (!pOutImage->SetImageSize(nWidth, nHeight, 6))
-		return false;
-	int bYFlag = (m_nCFAPattern >> 1) & 1;
 	const int WIN = 5;
-	const int WINSub_1 = (WIN - 1);
 	const int WINcenter = (WIN / 2);
-	unsigned short rawPixel;
-	int HVYUVH[6] = {0, 0, 0, 0, 0, 0};
-	unsigned short BlockRaw[WIN][WIN];
-	unsigned short lineBuf[WINSub_1][6000];
-	for (int n = 0; n < WIN; n++)
-	{
-		for (int m = 0; m < WIN; m++)
-		{
-			BlockRaw[n][m] = 0;
-		}
-	}
-	for (int n = 0; n < WINSub_1; n++)
-	{
-		for (int m = 0; m < 6000; m++)
-		{
-			lineBuf[n][m] = 0;
-		}
-	}
-	unsigned short *pRaw = pInImage->GetImageData();
-	unsigned short *pOutYUVH = pOutImage->GetImageData();
+	if (nWidth <= WINcenter || nHeight <= WINcenter)
+		return false;
+	if (!pOutImage->SetImageSize(nWidth, nHeight, 6))
+		return false;
+	int nPadWidth = nWidth + WINcenter * 2;
+	int nProcs = omp_get_num_procs();
+	unsigned short *pBuffer = new unsigned short[nPadWidth * WIN * nProcs];
+	int *pGCBuffer = new int[(nWidth * WIN + nPadWidth) * 2 * nProcs];
+	if (pBuffer == NULL || pGCBuffer == NULL)
+		return false;
+	unsigned short *pInLines[WIN];
+	int *pHGCLines[WIN];
+	int loop = 0;
+#pragma omp parallel for num_threads(nProcs) firstprivate(loop) private(pInLines, pHGCLines)
 	for (int y = 0; y < nHeight; y++)
 	{
-		int bHGreenFlag = (m_nCFAPattern & 1) ^ bYFlag;
-		int bXFlag = (m_nCFAPattern & 1);
-		for (int x = 0; x < nWidth; x++)
+		int nThreadId = omp_get_thread_num();
+		int *pVGCLine = pGCBuffer + (nWidth * WIN + nPadWidth) * 2 * nThreadId;
+		if (loop == 0)
 		{
-			int bVGreenFlag = bXFlag ^ bYFlag;
-			rawPixel = (int)(*pRaw++);
 			for (int k = 0; k < WIN; k++)
 			{
-				for (int l = 0; l < WINSub_1; l++)
-				{
-					BlockRaw[k][l] = BlockRaw[k][l + 1];
-				}
-			}
-			for (int k = 0; k < WINSub_1; k++)
-			{
-				BlockRaw[k][WINSub_1] = lineBuf[k][x];
-			}
-			BlockRaw[WINSub_1][WINSub_1] = rawPixel;
-			for (int k = 0; k < WINSub_1; k++)
-			{
-				lineBuf[k][x] = BlockRaw[k + 1][WINSub_1];
+				pInLines[k] = pBuffer + nPadWidth * (WIN * nThreadId + k);
+				pHGCLines[k] = pVGCLine + nPadWidth * 2 + nWidth * 2 * k;
 			}
-			if ((y > WINcenter + 1) && (x > WINcenter + 1))
+			for (int k = 0; k < WIN - 1; k++)
 			{
-				RAWToYUVH(BlockRaw, m_nCFAPattern, HVYUVH, bYFlag, bXFlag, bHGreenFlag, bVGreenFlag);
+				PadRawLine(pInImage, y - WINcenter + k, pInLines[k], WINcenter);
+				RawToHGCLine(pInLines[k], pHGCLines[k], nWidth, y - WINcenter + k);
 			}
-			else
-			{
-				RAWToYUVH(BlockRaw, m_nCFAPattern, HVYUVH, bYFlag, bXFlag, bHGreenFlag, bVGreenFlag);
-			}
-			if ((y > WINcenter) || ((y == WINcenter) && (x > WINcenter - 1)))
-			{
-				pOutYUVH[0] = ((unsigned short)HVYUVH[0]);
-				pOutYUVH[1] = ((unsigned short)HVYUVH[1]);
-				pOutYUVH[2] = ((unsigned short)HVYUVH[2]);
-				pOutYUVH[3] = ((unsigned short)HVYUVH[3]);
-				pOutYUVH[4] = ((unsigned short)HVYUVH[4]);
-				pOutYUVH[5] = ((unsigned short)HVYUVH[5]);
-				pOutYUVH += 6;
-			}
-			bHGreenFlag ^= 1;
-			bXFlag ^= 1;
+			loop++;
 		}
-		bYFlag ^= 1;
+		PadRawLine(pInImage, y + WINcenter, pInLines[WIN - 1], WINcenter);
+		RawToHGCLine(pInLines[WIN - 1], pHGCLines[WIN - 1], nWidth, y + WINcenter);
+		RawToHVYUVHLine(pInLines, pHGCLines, pVGCLine, pOutImage->GetImageLine(y), nWidth, y);
+		unsigned short *pTemp = pInLines[0];
+		int *pHGCTemp = pHGCLines[0];
+		for (int k = 0; k < WIN - 1; k++)
+		{
+			pInLines[k] = pInLines[k + 1];
+			pHGCLines[k] = pHGCLines[k + 1];
+		}
+		pInLines[WIN - 1] = pTemp;
+		pHGCLines[WIN - 1] = pHGCTemp;
 	}
-	for (int x = 0; x < WINcenter; x++)
+	delete[] pBuffer;
+	delete[] pGCBuffer;
+	return true;
+}
+// 扩边后的5行RAW及其水平GC -> 第y行的HVYUVH,pVGCLine为扩边宽度的垂直GC临时行
+void CHDRPlus_Demosaicing::RawToHVYUVHLine(unsigned short *pInLines[], int *pHGCLines[], int *pVGCLine, unsigned short *pOutLine, int nWidth, int y)
+{
+	const int WIN = 5;
+	int nPadWidth = nWidth + (WIN / 2) * 2;
+	int bYFlag = ((m_nCFAPattern >> 1) & 1) ^ (y & 1);
+	int bXFlag = (m_nCFAPattern & 1);
+	// 垂直GC,扩边后的每一列
+	int bVGreenFlag = bXFlag ^ bYFlag;
+	for (int x = 0; x < nPadWidth; x++)
 	{
-		pOutYUVH[0] = ((unsigned short)HVYUVH[0]);
-		pOutYUVH[1] = ((unsigned short)HVYUVH[1]);
-		pOutYUVH[2] = ((unsigned short)HVYUVH[2]);
-		pOutYUVH[3] = ((unsigned short)HVYUVH[3]);
-		pOutYUVH[4] = ((unsigned short)HVYUVH[4]);
-		pOutYUVH[5] = ((unsigned short)HVYUVH[5]);
-		pOutYUVH += 6;
+		unsigned short VRAW[WIN];
+		VRAW[0] = pInLines[0][x];
+		VRAW[1] = pInLines[1][x];
+		VRAW[2] = pInLines[2][x];
+		VRAW[3] = pInLines[3][x];
+		VRAW[4] = pInLines[4][x];
+		Bayer2GC(VRAW, pVGCLine + x * 2, bVGreenFlag);
+		bVGreenFlag ^= 1;
 	}
-	for (int y = 0; y < WINcenter; y++)
+	int pHGC[WIN][2];
+	int pVGC[WIN][2];
+	int HVYUVH[6];
+	for (int x = 0; x < nWidth; x++)
 	{
-		int bHGreenFlag = (m_nCFAPattern & 1) ^ bYFlag;
-		int bXFlag = (m_nCFAPattern & 1);
-		for (int x = 0; x < nWidth; x++)
+		for (int k = 0; k < WIN; k++)
 		{
-			int bVGreenFlag = bXFlag ^ bYFlag;
-			for (int k = 0; k < WIN; k++)
-			{
-				for (int l = 0; l < WINSub_1; l++)
-				{
-					BlockRaw[k][l] = BlockRaw[k][l + 1];
-				}
-			}
-			for (int k = 0; k < WINSub_1; k++)
-			{
-				BlockRaw[k][WINSub_1] = lineBuf[k][x];
-			}
-			// BlockRaw[WINSub_1][WINSub_1] = rawPixel;
-			for (int k = 0; k < WINSub_1; k++)
-			{
-				lineBuf[k][x] = BlockRaw[k + 1][WINSub_1];
-			}
-			RAWToYUVH(BlockRaw, m_nCFAPattern, HVYUVH, bYFlag, bXFlag, bHGreenFlag, bVGreenFlag);
-			pOutYUVH[0] = ((unsigned short)HVYUVH[0]);
-			pOutYUVH[1] = ((unsigned short)HVYUVH[1]);
-			pOutYUVH[2] = ((unsigned short)HVYUVH[2]);
-			pOutYUVH[3] = ((unsigned short)HVYUVH[3]);
-			pOutYUVH[4] = ((unsigned short)HVYUVH[4]);
-			pOutYUVH[5] = ((unsigned short)HVYUVH[5]);
-			pOutYUVH += 6;
-			bHGreenFlag ^= 1;
-			bXFlag ^= 1;
+			pHGC[k][0] = pHGCLines[k][x * 2];
+			pHGC[k][1] = pHGCLines[k][x * 2 + 1];
+			pVGC[k][0] = pVGCLine[(x + k) * 2];
+			pVGC[k][1] = pVGCLine[(x + k) * 2 + 1];
 		}
-		bYFlag ^= 1;
+		GCToYUVH(pHGC, pVGC, HVYUVH, bYFlag, bXFlag);
+		pOutLine[0] = ((unsigned short)HVYUVH[0]);
+		pOutLine[1] = ((unsigned short)HVYUVH[1]);
+		pOutLine[2] = ((unsigned short)HVYUVH[2]);
+		pOutLine[3] = ((unsigned short)HVYUVH[3]);
+		pOutLine[4] = ((unsigned short)HVYUVH[4]);
+		pOutLine[5] = ((unsigned short)HVYUVH[5]);
+		pOutLine += 6;
+		bXFlag ^= 1;
+	}
+}
+// 扩边后的第y行每个像素的水平GC
+void CHDRPlus_Demosaicing::RawToHGCLine(unsigned short *pPadLine, int *pHGCLine, int nWidth, int y)
+{
+	int bYFlag = ((m_nCFAPattern >> 1) & 1) ^ (y & 1);
+	int bHGreenFlag = (m_nCFAPattern & 1) ^ bYFlag;
+	for (int x = 0; x < nWidth; x++)
+	{
+		Bayer2GC(pPadLine + x, pHGCLine + x * 2, bHGreenFlag);
+		bHGreenFlag ^= 1;
 	}
-	return true;
 }
 
 bool CHDRPlus_Demosaicing::Forward2(MultiUshortImage *pInRAWImage, MultiUshortImage *pOutRGBImage, TGlobalControl *pControl)
 {
+	m_nCFAPattern = pControl->nCFAPattern;
+	m_nMax = (1 << pControl->nBit) - 1;
+	m_nMin = pControl->nBLC;
+	if (m_nPreviewMode > 0)
+	{
+		return PreviewDemosaic(pInRAWImage, pOutRGBImage, m_nPreviewMode);
+	}
+	if (m_bLinePipelineEnable)
+	{
+		return LinePipelineDemosaic(pInRAWImage, pOutRGBImage);
+	}
 	MultiUshortImage HVYUVHImage;
 	CImageData_UINT32 HVImage;
 	MultiShortImage DirImage;
 	MultiUshortImage YUVImage;
-	m_nCFAPattern = pControl->nCFAPattern;
-	m_nMax = (1 << pControl->nBit) - 1;
-	m_nMin = pControl->nBLC;
 	if (!RawToHVYUVHImage(pInRAWImage, &HVYUVHImage))
 		return false;
 	if (!HVYUVHToHV3x3Image(&HVYUVHImage, &HVImage))
@@ -389,142 +404,250 @@ bool CHDRPlus_Demosaicing::Forward2(MultiUshortImage *pInRAWImage, MultiUshortIm
 		return false;
 	if (m_bDeleteMinMaxYEnable)
 	{
-		DeleteMinMaxYImage(&YUVImage);
+		if (!DeleteMinMaxYImage(&YUVImage))
+			return false;
 	}
 	if (!YUVToRGBImage(&YUVImage, pOutRGBImage))
 		return false;
 	return true;
 }
-bool CHDRPlus_Demosaicing::HVYUVHToHV3x3Image(MultiUshortImage *pInImage, CImageData_UINT32 *pOutImage)
+// 整帧各级中间结果都不落地:按线程切成行带,每个行带内各级只保留自身滤波支撑所需的行缓存,
+// RAW(5行)->HVYUVH(5行)->HV3x3水平高斯(7行)->方向/合并YUV(3行)->水平YUV转RGB(3行)->RGB输出行
+bool CHDRPlus_Demosaicing::LinePipelineDemosaic(MultiUshortImage *pInImage, MultiUshortImage *pOutImage)
 {
 	int nWidth = pInImage->GetImageWidth();
 	int nHeight = pInImage->GetImageHeight();
-	if (!pOutImage->SetImageSize(nWidth, nHeight, 2))
+	if (nWidth <= 2 || nHeight <= 2)
 		return false;
-	const int WIN = 3;
-	const int WINSub_1 = (WIN - 1);
-	const int WINcenter = (WIN / 2);
-	int InYU[2], InHVE[4], OUTHV[2];
-	unsigned short BlockA[WIN][WIN];
-	unsigned short BlockB[WIN][WIN];
-	unsigned short BlockC[WIN][WIN];
-	unsigned short BlockD[WIN][WIN];
-	unsigned short lineBufA[WINSub_1][6000];
-	unsigned short lineBufB[WINSub_1][6000];
-	unsigned short lineBufC[WINSub_1][6000];
-	unsigned short lineBufD[WINSub_1][6000];
-	int nVDVBuf[3];
-	int nVDHBuf[3];
-	int nHDVBuf[3];
-	int nHDHBuf[3];
-	for (int n = 0; n < WIN; n++)
-	{
-		for (int m = 0; m < WIN; m++)
-		{
-			BlockA[n][m] = 0;
-			BlockB[n][m] = 0;
-			BlockC[n][m] = 0;
-			BlockD[n][m] = 0;
-		}
-	}
-	for (int n = 0; n < WINSub_1; n++)
+	if (!pOutImage->CreateImage(nWidth, nHeight, 3, 16))
+		return false;
+	int nPadWidth = nWidth + 4;
+	int nProcs = omp_get_num_procs();
+	int nBands = MIN2(nProcs, nHeight);
+	int nBufferSize = nPadWidth * 5 + nWidth * 6 * 5 + nWidth * 3 * 3 + nWidth * 4 * 3 + nWidth * 3; // RAW,HVYUVH,YUV,水平YUVH,去极值Y后的YUV行
+	int nGCBufferSize = (nWidth * 5 + nPadWidth) * 2;
+	int nHVBufferSize = nWidth * 2 * (7 + 1);
+	unsigned short *pBuffer = new unsigned short[nBufferSize * nBands];
+	int *pGCBuffer = new int[nGCBufferSize * nBands];
+	unsigned int *pHVBuffer = new unsigned int[nHVBufferSize * nBands];
+	short *pDirBuffer = new short[nWidth * nBands];
+	if (pBuffer == NULL || pGCBuffer == NULL || pHVBuffer == NULL || pDirBuffer == NULL)
+		return false;
+#pragma omp parallel for num_threads(nProcs) schedule(dynamic, 1)
+	for (int band = 0; band < nBands; band++)
 	{
-		for (int m = 0; m < 6000; m++)
-		{
-			lineBufA[n][m] = 0;
-			lineBufB[n][m] = 0;
-			lineBufC[n][m] = 0;
-			lineBufD[n][m] = 0;
-		}
+		LinePipelineBand(pInImage, pOutImage, band * nHeight / nBands, (band + 1) * nHeight / nBands, pBuffer + nBufferSize * band, pGCBuffer + nGCBufferSize * band, pHVBuffer + nHVBufferSize * band, pDirBuffer + nWidth * band);
 	}
-	unsigned short *pInData = pInImage->GetImageData();
-	unsigned int *pOutData = pOutImage->GetImageData();
-	for (int y = 0; y < nHeight; y++)
+	delete[] pBuffer;
+	delete[] pGCBuffer;
+	delete[] pHVBuffer;
+	delete[] pDirBuffer;
+	return true;
+}
+// 输出[nStartY,nEndY)行RGB;各级环形缓存按行号取模定位,下游缺哪一行就向上游逐行拉取,
+// 行带开头多算几行上游作为预热,越界行与整帧版本一样按GetImageLine钳到边界行
+void CHDRPlus_Demosaicing::LinePipelineBand(MultiUshortImage *pInImage, MultiUshortImage *pOutImage, int nStartY, int nEndY, unsigned short *pBuffer, int *pGCBuffer, unsigned int *pHVBuffer, short *pDirLine)
+{
+	int nWidth = pInImage->GetImageWidth();
+	int nHeight = pInImage->GetImageHeight();
+	int nPadWidth = nWidth + 4;
+	unsigned short *pRawBuffer = pBuffer;
+	unsigned short *pYUVHBuffer = pRawBuffer + nPadWidth * 5;
+	unsigned short *pYUVBuffer = pYUVHBuffer + nWidth * 6 * 5;
+	unsigned short *pRGBHBuffer = pYUVBuffer + nWidth * 3 * 3; // 3行交织,每像素3x4
+	unsigned short *pDMMLine = pRGBHBuffer + nWidth * 4 * 3;
+	int *pVGCLine = pGCBuffer;
+	int *pHGCBuffer = pVGCLine + nPadWidth * 2;
+	unsigned int *pGaussBuffer = pHVBuffer; // 7行交织,每像素7x2
+	unsigned int *pHVLine = pGaussBuffer + nWidth * 2 * 7;
+	unsigned short *pInLines[5];
+	int *pHGCLines[5];
+	unsigned int *pGaussLines[7];
+	// 各级下一个要算的行
+	int nRGBHY = MAX2(nStartY - 1, 0);
+	int nMergeY = MAX2(nRGBHY - 1, 0);
+	int nHVY = MAX2(nMergeY - 3, 0);
+	int nYUVHY = MAX2(nHVY - 1, 0);
+	int nRawY = nYUVHY - 2;
+	for (int y = nStartY; y < nEndY; y++)
 	{
-		for (int x = 0; x < nWidth; x++)
+		int nRGBHEnd = MIN2(y + 1, nHeight - 1);
+		for (; nRGBHY <= nRGBHEnd; nRGBHY++)
 		{
-			InYU[0] = pInData[0];
-			InYU[1] = pInData[0];
-			InHVE[0] = pInData[0];
-			InHVE[1] = pInData[0];
-			InHVE[2] = pInData[0];
-			InHVE[3] = pInData[0];
-			pInData += 6;
-			for (int k = 0; k < WIN; k++)
+			int nMergeEnd = MIN2(nRGBHY + 1, nHeight - 1);
+			for (; nMergeY <= nMergeEnd; nMergeY++)
 			{
-				for (int l = 0; l < WINSub_1; l++)
+				int nHVEnd = MIN2(nMergeY + 3, nHeight - 1);
+				for (; nHVY <= nHVEnd; nHVY++)
 				{
-					BlockA[k][l] = BlockA[k][l + 1];
-					BlockB[k][l] = BlockB[k][l + 1];
-					BlockC[k][l] = BlockC[k][l + 1];
-					BlockD[k][l] = BlockD[k][l + 1];
+					int nYUVHEnd = MIN2(nHVY + 1, nHeight - 1);
+					for (; nYUVHY <= nYUVHEnd; nYUVHY++)
+					{
+						for (; nRawY <= nYUVHY + 2; nRawY++)
+						{
+							int k = (nRawY + 5) % 5;
+							PadRawLine(pInImage, nRawY, pRawBuffer + nPadWidth * k, 2);
+							RawToHGCLine(pRawBuffer + nPadWidth * k, pHGCBuffer + nWidth * 2 * k, nWidth, nRawY);
+						}
+						for (int k = 0; k < 5; k++)
+						{
+							int n = (nYUVHY - 2 + k + 5) % 5;
+							pInLines[k] = pRawBuffer + nPadWidth * n;
+							pHGCLines[k] = pHGCBuffer + nWidth * 2 * n;
+						}
+						RawToHVYUVHLine(pInLines, pHGCLines, pVGCLine, pYUVHBuffer + nWidth * 6 * (nYUVHY % 5), nWidth, nYUVHY);
+					}
+					for (int k = 0; k < 3; k++)
+					{
+						int n = MIN2(MAX2(nHVY - 1 + k, 0), nHeight - 1);
+						pInLines[k] = pYUVHBuffer + nWidth * 6 * (n % 5);
+					}
+					HVYUVHToHV3x3Line(pInLines, pHVLine, nWidth);
+					HGaussHV7Line(pHVLine, pGaussBuffer + 2 * (nHVY % 7), nWidth);
 				}
+				for (int k = 0; k < 7; k++)
+				{
+					int n = MIN2(MAX2(nMergeY - 3 + k, 0), nHeight - 1);
+					pGaussLines[k] = pGaussBuffer + 2 * (n % 7);
+				}
+				VGaussHV7Line(pGaussLines, pHVLine, nWidth);
+				HVToDirLine(pHVLine, pDirLine, nWidth, m_nDirThre);
+				MergeHVLine(pYUVHBuffer + nWidth * 6 * (nMergeY % 5), pDirLine, pYUVBuffer + nWidth * 3 * (nMergeY % 3), nWidth);
 			}
-			for (int k = 0; k < WINSub_1; k++)
-			{
-				BlockA[k][WINSub_1] = lineBufA[k][x];
-				BlockB[k][WINSub_1] = lineBufB[k][x];
-				BlockC[k][WINSub_1] = lineBufC[k][x];
-				BlockD[k][WINSub_1] = lineBufD[k][x];
-			}
-			BlockA[WINSub_1][WINSub_1] = InHVE[0];
-			BlockB[WINSub_1][WINSub_1] = InHVE[1];
-			BlockC[WINSub_1][WINSub_1] = InHVE[2];
-			BlockD[WINSub_1][WINSub_1] = InHVE[3];
-			for (int k = 0; k < WINSub_1 - 1; k++)
+			unsigned short *pYUVLine = pYUVBuffer + nWidth * 3 * (nRGBHY % 3);
+			if (m_bDeleteMinMaxYEnable && nRGBHY > 0 && nRGBHY < nHeight - 1)
 			{
-				lineBufA[k][x] = lineBufA[k + 1][x];
-				lineBufB[k][x] = lineBufB[k + 1][x];
-				lineBufC[k][x] = lineBufC[k + 1][x];
-				lineBufD[k][x] = lineBufD[k + 1][x];
+				// YUV行缓存保持未修改,钳位后的行另存,行带接缝处与整帧一致
+				for (int k = 0; k < 3; k++)
+				{
+					pInLines[k] = pYUVBuffer + nWidth * 3 * ((nRGBHY - 1 + k) % 3);
+				}
+				DeleteMinMaxYLine(pInLines, pDMMLine, nWidth, 3);
+				pYUVLine = pDMMLine;
 			}
-			lineBufA[WINSub_1 - 1][x] = InHVE[0];
-			lineBufB[WINSub_1 - 1][x] = InHVE[1];
-			lineBufC[WINSub_1 - 1][x] = InHVE[2];
-			lineBufD[WINSub_1 - 1][x] = InHVE[3];
-			if ((y > WINcenter + 1) && (x > WINcenter + 1))
+			HYUVToRGBH3Line(pYUVLine, pRGBHBuffer + 4 * (nRGBHY % 3), nWidth);
+		}
+		for (int k = 0; k < 3; k++)
+		{
+			int n = MIN2(MAX2(y - 1 + k, 0), nHeight - 1);
+			pInLines[k] = pRGBHBuffer + 4 * (n % 3);
+		}
+		VYUVToRGB3Line(pInLines, pOutImage->GetImageLine(y), nWidth);
+	}
+}
+// 预览/缩略图用的半分辨率去马赛克,每个2x2 Bayer块输出一个RGB像素,后续模块只处理1/4像素
+// nMode=1: 块内直接合并,R/B取块内唯一的点,G取两点均值
+// nMode=2: 双线性,R/B由离块中心最近的4个同色点按9:3:3:1插到块中心,消除R/G/B半像素错位
+bool CHDRPlus_Demosaicing::PreviewDemosaic(MultiUshortImage *pInImage, MultiUshortImage *pOutImage, int nMode)
+{
+	int nWidth = pInImage->GetImageWidth();
+	int nHeight = pInImage->GetImageHeight();
+	int nOutWidth = nWidth / 2;
+	int nOutHeight = nHeight / 2;
+	if (nOutWidth == 0 || nOutHeight == 0)
+		return false;
+	if (!pOutImage->CreateImage(nOutWidth, nOutHeight, 3, 16))
+		return false;
+	// 块内B点的偏移,R点在对角
+	int nBX = m_nCFAPattern & 1;
+	int nBY = (m_nCFAPattern >> 1) & 1;
+#pragma omp parallel for
+	for (int y = 0; y < nOutHeight; y++)
+	{
+		unsigned short *pInLines[2];
+		pInLines[0] = pInImage->GetImageLine(y * 2);
+		pInLines[1] = pInImage->GetImageLine(y * 2 + 1);
+		unsigned short *pOut = pOutImage->GetImageLine(y);
+		for (int x = 0; x < nOutWidth; x++)
+		{
+			int nX = x * 2;
+			int R, G, B;
+			G = (pInLines[nBY][nX + (nBX ^ 1)] + pInLines[nBY ^ 1][nX + nBX] + 1) >> 1;
+			if (nMode == 1)
 			{
-				// 主方向
-				nVDVBuf[0] = Pos(DIFF(BlockA[0][0], BlockA[2][0]) - DIFF(BlockB[0][0], BlockB[2][0]));
-				nVDVBuf[1] = Pos(DIFF(BlockA[0][1], BlockA[2][1]) - DIFF(BlockB[0][1], BlockB[2][1]));
-				nVDVBuf[2] = Pos(DIFF(BlockA[0][2], BlockA[2][2]) - DIFF(BlockB[0][2], BlockB[2][2]));
-				// 次方向
-				nVDHBuf[0] = Pos(DIFF(BlockC[0][0], BlockC[2][0]) - DIFF(BlockD[0][0], BlockD[2][0]));
-				nVDHBuf[1] = Pos(DIFF(BlockC[0][1], BlockC[2][1]) - DIFF(BlockD[0][1], BlockD[2][1]));
-				nVDHBuf[2] = Pos(DIFF(BlockC[0][2], BlockC[2][2]) - DIFF(BlockD[0][2], BlockD[2][2]));
-				// 主方向
-				nHDVBuf[0] = Pos(DIFF(BlockA[0][0], BlockA[0][2]) - DIFF(BlockB[0][0], BlockB[0][2]));
-				nHDVBuf[1] = Pos(DIFF(BlockA[1][0], BlockA[1][2]) - DIFF(BlockB[1][0], BlockB[1][2]));
-				nHDVBuf[2] = Pos(DIFF(BlockA[2][0], BlockA[2][2]) - DIFF(BlockB[2][0], BlockB[2][2]));
-				// 次方向
-				nHDHBuf[0] = Pos(DIFF(BlockC[0][0], BlockC[0][2]) - DIFF(BlockD[0][0], BlockD[0][2]));
-				nHDHBuf[1] = Pos(DIFF(BlockC[1][0], BlockC[1][2]) - DIFF(BlockD[1][0], BlockD[1][2]));
-				nHDHBuf[2] = Pos(DIFF(BlockC[2][0], BlockC[2][2]) - DIFF(BlockD[2][0], BlockD[2][2]));
-
-				OUTHV[0] = (nVDVBuf[0] + nVDVBuf[1] * 2 + nVDVBuf[2]);
-				OUTHV[0] += (nVDHBuf[0] + nVDHBuf[1] * 2 + nVDHBuf[2]) >> 1;
-				OUTHV[1] = (nHDVBuf[0] + nHDVBuf[1] * 2 + nHDVBuf[2]);
-				OUTHV[1] += (nHDHBuf[0] + nHDHBuf[1] * 2 + nHDHBuf[2]) >> 1;
+				R = pInLines[nBY ^ 1][nX + (nBX ^ 1)];
+				B = pInLines[nBY][nX + nBX];
 			}
 			else
 			{
-				OUTHV[0] = 0;
-				OUTHV[1] = 0;
-			}
-			if ((y > WINcenter) || ((y == WINcenter) && (x > WINcenter - 1)))
-			{
-				pOutData[0] = OUTHV[0];
-				pOutData[1] = OUTHV[1];
+				R = BilinearQuadCenter(pInImage, nX + (nBX ^ 1), y * 2 + (nBY ^ 1), nBX ^ 1, nBY ^ 1);
+				B = BilinearQuadCenter(pInImage, nX + nBX, y * 2 + nBY, nBX, nBY);
 			}
+			pOut[0] = (unsigned short)R;
+			pOut[1] = (unsigned short)G;
+			pOut[2] = (unsigned short)B;
+			pOut += 3;
 		}
 	}
-	for (int cnt = 0; cnt < WINcenter * nWidth + WINcenter; cnt++)
+	return true;
+}
+// (x,y)处的同色点插值到所在2x2块的中心,(bX,bY)为该点在块内的偏移,越界的邻点用自身代替
+int CHDRPlus_Demosaicing::BilinearQuadCenter(MultiUshortImage *pInImage, int x, int y, int bX, int bY)
+{
+	int nWidth = pInImage->GetImageWidth();
+	int nHeight = pInImage->GetImageHeight();
+	int x1 = bX ? (x - 2) : (x + 2);
+	int y1 = bY ? (y - 2) : (y + 2);
+	if (x1 < 0 || x1 >= nWidth)
+		x1 = x;
+	if (y1 < 0 || y1 >= nHeight)
+		y1 = y;
+	unsigned short *pLine0 = pInImage->GetImageLine(y);
+	unsigned short *pLine1 = pInImage->GetImageLine(y1);
+	return (pLine0[x] * 9 + (pLine0[x1] + pLine1[x]) * 3 + pLine1[x1] + 8) >> 4;
+}
+bool CHDRPlus_Demosaicing::HVYUVHToHV3x3Image(MultiUshortImage *pInImage, CImageData_UINT32 *pOutImage)
+{
+	int nWidth = pInImage->GetImageWidth();
+	int nHeight = pInImage->GetImageHeight();
+	if (!pOutImage->SetImageSize(nWidth, nHeight, 2))
+		return false;
+#pragma omp parallel for
+	for (int y = 0; y < nHeight; y++)
 	{
-		pOutData[0] = OUTHV[0];
-		pOutData[1] = OUTHV[0];
+		unsigned short *pInLines[3];
+		pInLines[0] = pInImage->GetImageLine(y - 1);
+		pInLines[1] = pInImage->GetImageLine(y);
+		pInLines[2] = pInImage->GetImageLine(y + 1);
+		HVYUVHToHV3x3Line(pInLines, pOutImage->GetImageLine(y), nWidth);
 	}
 	return true;
 }
+// 3x3邻域内比较水平插值(HVYUVH[2]/[4])与垂直插值(HVYUVH[3]/[5])的色度和边缘起伏,
+// 垂直插值沿垂直方向起伏更大时投票给水平方向(OUTHV[0]),反之投票给垂直方向(OUTHV[1]);
+// 色度为主方向,边缘为次方向权重减半,左右越界钳到边界列
+void CHDRPlus_Demosaicing::HVYUVHToHV3x3Line(unsigned short *pInLines[], unsigned int *pOutLine, int nWidth)
+{
+	int nVDVBuf[3];
+	int nVDHBuf[3];
+	int nHDVBuf[3];
+	int nHDHBuf[3];
+	for (int x = 0; x < nWidth; x++)
+	{
+		int nCol[3];
+		nCol[0] = ((x > 0) ? (x - 1) : 0) * 6;
+		nCol[1] = x * 6;
+		nCol[2] = ((x < nWidth - 1) ? (x + 1) : x) * 6;
+		for (int i = 0; i < 3; i++)
+		{
+			unsigned short *pT = pInLines[0] + nCol[i];
+			unsigned short *pB = pInLines[2] + nCol[i];
+			unsigned short *pL = pInLines[i] + nCol[0];
+			unsigned short *pR = pInLines[i] + nCol[2];
+			// 主方向
+			nVDVBuf[i] = Pos(DIFF(pT[3], pB[3]) - DIFF(pT[2], pB[2]));
+			nHDVBuf[i] = Pos(DIFF(pL[2], pR[2]) - DIFF(pL[3], pR[3]));
+			// 次方向
+			nVDHBuf[i] = Pos(DIFF(pT[5], pB[5]) - DIFF(pT[4], pB[4]));
+			nHDHBuf[i] = Pos(DIFF(pL[4], pR[4]) - DIFF(pL[5], pR[5]));
+		}
+		pOutLine[0] = nVDVBuf[0] + nVDVBuf[1] * 2 + nVDVBuf[2];
+		pOutLine[0] += (nVDHBuf[0] + nVDHBuf[1] * 2 + nVDHBuf[2]) >> 1;
+		pOutLine[1] = nHDVBuf[0] + nHDVBuf[1] * 2 + nHDVBuf[2];
+		pOutLine[1] += (nHDHBuf[0] + nHDHBuf[1] * 2 + nHDHBuf[2]) >> 1;
+		pOutLine += 2;
+	}
+}
 bool CHDRPlus_Demosaicing::HVToDirImage(CImageData_UINT32 *pInImage, MultiShortImage *pOutImage, int nDirThre)
 {
 	int nWidth = pInImage->GetImageWidth();
@@ -534,41 +657,43 @@ bool CHDRPlus_Demosaicing::HVToDirImage(CImageData_UINT32 *pInImage, MultiShortI
 #pragma omp parallel for
 	for (int y = 0; y < nHeight; y++)
 	{
-		unsigned int *pIn = pInImage->GetImageLine(y);
-		short *pOut = pOutImage->GetImageLine(y);
-		for (int x = 0; x < nWidth; x++)
+		HVToDirLine(pInImage->GetImageLine(y), pOutImage->GetImageLine(y), nWidth, nDirThre);
+	}
+	return true;
+}
+void CHDRPlus_Demosaicing::HVToDirLine(unsigned int *pIn, short *pOut, int nWidth, int nDirThre)
+{
+	for (int x = 0; x < nWidth; x++)
+	{
+		unsigned int hw = *(pIn++);
+		unsigned int vw = *(pIn++);
+		int conf = 16;
+		int dw = DIFF(vw, hw);
+		int flag = 0;
+		int dir = 0;
+		if (dw > nDirThre)
 		{
-			unsigned int hw = *(pIn++);
-			unsigned int vw = *(pIn++);
-			int conf = 16;
-			int dw = DIFF(vw, hw);
-			int flag = 0;
-			int dir = 0;
-			if (dw > nDirThre)
+			if (dw <= 5 * nDirThre)
 			{
-				if (dw <= 5 * nDirThre)
-				{
-					conf = ((dw - nDirThre) * 16) / (4 * nDirThre);
-				}
-				if (vw < hw)
-				{
-					unsigned int tmp = vw;
-					vw = hw;
-					hw = tmp;
-					flag = 1;
-				}
-				if (vw > hw * 2)
-					dir = 128;
-				else
-					dir = vw * 128 / hw - 128;
-				dir = (dir * conf) >> 4;
-				if (flag == 1)
-					dir = -dir;
+				conf = ((dw - nDirThre) * 16) / (4 * nDirThre);
 			}
-			*(pOut++) = (short)dir;
+			if (vw < hw)
+			{
+				unsigned int tmp = vw;
+				vw = hw;
+				hw = tmp;
+				flag = 1;
+			}
+			if (vw > hw * 2)
+				dir = 128;
+			else
+				dir = vw * 128 / hw - 128;
+			dir = (dir * conf) >> 4;
+			if (flag == 1)
+				dir = -dir;
 		}
+		*(pOut++) = (short)dir;
 	}
-	return true;
 }
 bool CHDRPlus_Demosaicing::MergeHVImage(MultiUshortImage *pInImage, MultiShortImage *pDirImage, MultiUshortImage *pOutImage)
 {
@@ -579,93 +704,112 @@ bool CHDRPlus_Demosaicing::MergeHVImage(MultiUshortImage *pInImage, MultiShortIm
 #pragma omp parallel for
 	for (int y = 0; y < nHeight; y++)
 	{
-		int HVYUVH[6], YUV[3];
-		unsigned short *pIn = pInImage->GetImageLine(y);
-		short *pDir = pDirImage->GetImageLine(y);
-		unsigned short *pOut = pOutImage->GetImageLine(y);
-		for (int x = 0; x < nWidth; x++)
+		MergeHVLine(pInImage->GetImageLine(y), pDirImage->GetImageLine(y), pOutImage->GetImageLine(y), nWidth);
+	}
+	return true;
+}
+void CHDRPlus_Demosaicing::MergeHVLine(unsigned short *pIn, short *pDir, unsigned short *pOut, int nWidth)
+{
+	int HVYUVH[6], YUV[3];
+	for (int x = 0; x < nWidth; x++)
+	{
+		for (int i = 0; i < 6; i++)
 		{
-			for (int i = 0; i < 6; i++)
-			{
-				HVYUVH[i] = *(pIn++);
-			}
-			int dir = *(pDir++);
-			YUV[0] = HVYUVH[0];
-			YUV[1] = HVYUVH[1];
-			///////////////////////MergeHV//////////////////
-			YUV[2] = (HVYUVH[2] + HVYUVH[3]) / 2;
-			if (dir >= 0)
-			{
-				YUV[2] += ((HVYUVH[3] - YUV[2]) * dir) / 128;
-				YUV[0] += ((HVYUVH[5] - 32768) * dir) / 128;
-			}
-			else
-			{
-				dir = -dir;
-				YUV[2] += ((HVYUVH[2] - YUV[2]) * dir) / 128;
-				YUV[0] += ((HVYUVH[4] - 32768) * dir) / 128;
-			}
-			if (YUV[0] < 0)
-				YUV[0] = 0;
-			if (YUV[0] > m_nMax)
-				YUV[0] = m_nMax;
-			if (YUV[2] < 0)
-				YUV[2] = 0;
-			if (YUV[2] > 65535)
-				YUV[2] = 65535;
-			for (int i = 0; i < 3; i++)
-			{
-				*(pOut++) = (unsigned short)YUV[i];
-			}
+			HVYUVH[i] = *(pIn++);
+		}
+		int dir = *(pDir++);
+		YUV[0] = HVYUVH[0];
+		YUV[1] = HVYUVH[1];
+		///////////////////////MergeHV//////////////////
+		YUV[2] = (HVYUVH[2] + HVYUVH[3]) / 2;
+		if (dir >= 0)
+		{
+			YUV[2] += ((HVYUVH[3] - YUV[2]) * dir) / 128;
+			YUV[0] += ((HVYUVH[5] - 32768) * dir) / 128;
+		}
+		else
+		{
+			dir = -dir;
+			YUV[2] += ((HVYUVH[2] - YUV[2]) * dir) / 128;
+			YUV[0] += ((HVYUVH[4] - 32768) * dir) / 128;
+		}
+		if (YUV[0] < 0)
+			YUV[0] = 0;
+		if (YUV[0] > m_nMax)
+			YUV[0] = m_nMax;
+		if (YUV[2] < 0)
+			YUV[2] = 0;
+		if (YUV[2] > 65535)
+			YUV[2] = 65535;
+		for (int i = 0; i < 3; i++)
+		{
+			*(pOut++) = (unsigned short)YUV[i];
 		}
 	}
-	return true;
 }
-void CHDRPlus_Demosaicing::DeleteMinMaxYImage(MultiUshortImage *pYUVImage)
+// 邻域一律取未修改的输入,结果与行的处理顺序和线程划分无关,所以先保留一份输入
+bool CHDRPlus_Demosaicing::DeleteMinMaxYImage(MultiUshortImage *pYUVImage)
 {
 	int nWidth = pYUVImage->GetImageWidth();
 	int nHeight = pYUVImage->GetImageHeight();
 	int nChannel = pYUVImage->GetImageDim();
+	MultiUshortImage InImage;
+	if (!InImage.CreateImageWithData(nWidth, nHeight, nChannel, pYUVImage->GetImageData()))
+		return false;
 #pragma omp parallel for
 	for (int y = 1; y < nHeight - 1; y++)
 	{
 		unsigned short *pInLines[3];
-		pInLines[0] = pYUVImage->GetImageLine(y - 1) + nChannel;
-		pInLines[1] = pYUVImage->GetImageLine(y) + nChannel;
-		pInLines[2] = pYUVImage->GetImageLine(y + 1) + nChannel;
-		for (int x = 1; x < nWidth - 1; x++)
+		pInLines[0] = InImage.GetImageLine(y - 1);
+		pInLines[1] = InImage.GetImageLine(y);
+		pInLines[2] = InImage.GetImageLine(y + 1);
+		DeleteMinMaxYLine(pInLines, pYUVImage->GetImageLine(y), nWidth, nChannel);
+	}
+	return true;
+}
+// 中间行的Y钳到3x3邻域其余8个点的[min,max]内,邻域全部取自输入行,结果写到pOutLine,
+// 其余通道和首尾列原样拷贝;pOutLine不能是输入行
+void CHDRPlus_Demosaicing::DeleteMinMaxYLine(unsigned short *pLines[], unsigned short *pOutLine, int nWidth, int nChannel)
+{
+	memcpy(pOutLine, pLines[1], sizeof(unsigned short) * nWidth * nChannel);
+	unsigned short *pInLines[3];
+	pInLines[0] = pLines[0] + nChannel;
+	pInLines[1] = pLines[1] + nChannel;
+	pInLines[2] = pLines[2] + nChannel;
+	pOutLine += nChannel;
+	for (int x = 1; x < nWidth - 1; x++)
+	{
+		unsigned short Y0 = pInLines[1][0];
+		unsigned short minY = 65535;
+		unsigned short maxY = 0;
+		for (int i = 0; i < 3; i++)
 		{
-			unsigned short Y0 = pInLines[1][0];
-			unsigned short minY = 65535;
-			unsigned short maxY = 0;
-			for (int i = 0; i < 3; i++)
+			for (int j = -nChannel; j <= nChannel; j += nChannel)
 			{
-				for (int j = -nChannel; j <= nChannel; j += nChannel)
+				if (i == 1 && j == 0)
+					continue;
+				if (minY > pInLines[i][j])
 				{
-					if (i == 1 && j == 0)
-						continue;
-					if (minY > pInLines[i][j])
-					{
-						minY = pInLines[i][j];
-					}
-					if (maxY < pInLines[i][j])
-					{
-						maxY = pInLines[i][j];
-					}
+					minY = pInLines[i][j];
+				}
+				if (maxY < pInLines[i][j])
+				{
+					maxY = pInLines[i][j];
 				}
 			}
-			if (Y0 < minY)
-			{
-				pInLines[1][0] = minY;
-			}
-			else if (Y0 > maxY)
-			{
-				pInLines[1][0] = maxY;
-			}
-			pInLines[0] += nChannel;
-			pInLines[1] += nChannel;
-			pInLines[2] += nChannel;
 		}
+		if (Y0 < minY)
+		{
+			pOutLine[0] = minY;
+		}
+		else if (Y0 > maxY)
+		{
+			pOutLine[0] = maxY;
+		}
+		pInLines[0] += nChannel;
+		pInLines[1] += nChannel;
+		pInLines[2] += nChannel;
+		pOutLine += nChannel;
 	}
 }
 void CHDRPlus_Demosaicing::HYUVToRGBH3Line(unsigned short *pInLine, unsigned short *pOutLine, int nWidth)
@@ -816,8 +960,8 @@ void CHDRPlus_Demosaicing::HGaussHV7Line(unsigned int *pInLine, unsigned int *pO
 				nOut[1] = pIn[i][1];
 		}
 		nOut[0] >>= 4;
-		pOutLine[0] = (unsigned short)nOut[0];
-		pOutLine[1] = (unsigned short)nOut[1];
+		pOutLine[0] = nOut[0];
+		pOutLine[1] = nOut[1];
 		pOutLine += 14;
 		for (i = 0; i < 6; i++)
 		{
@@ -834,8 +978,8 @@ void CHDRPlus_Demosaicing::HGaussHV7Line(unsigned int *pInLine, unsigned int *pO
 				nOut[1] = pIn[i][1];
 		}
 		nOut[0] >>= 4;
-		pOutLine[0] = (unsigned short)nOut[0];
-		pOutLine[1] = (unsigned short)nOut[1];
+		pOutLine[0] = nOut[0];
+		pOutLine[1] = nOut[1];
 		pOutLine += 14;
 		for (i = 0; i < 6; i++)
 		{
@@ -17,6 +17,10 @@ protected:
 		m_nGbGrThre = 16;
 		m_nConfigParamList.ConfigParamListAddVariable("nGbGrSlope", &m_nGbGrSlope, 0, 1024);
 		m_nGbGrSlope = 64;
+		m_nConfigParamList.ConfigParamListAddVariable("bLinePipelineEnable", &m_bLinePipelineEnable, 0, 1);
+		m_bLinePipelineEnable = 1;
+		m_nConfigParamList.ConfigParamListAddVariable("nPreviewMode", &m_nPreviewMode, 0, 2);
+		m_nPreviewMode = 0; // 0:全分辨率 1:2x2合并 2:半分辨率双线性
 	}
 	virtual void CreateConfigTitleName()
 	{
@@ -32,6 +36,8 @@ public:
 	int m_bDeleteMinMaxYEnable;
 	int m_nGbGrThre;
 	int m_nGbGrSlope;
+	int m_bLinePipelineEnable;
+	int m_nPreviewMode;
 	CHDRPlus_Demosaicing()
 	{
 		Initialize();
@@ -84,16 +90,28 @@ private:
 		GC[1] /= 2;
 	}
 	void RAWToYUVH(unsigned short BlockRaw[5][5], int nCFA, int HVYUVH[6], int bYFlag, int bXFlag, int bHGreenFlag, int bVGreenFlag);
+	void GCToYUVH(int pHGC[5][2], int pVGC[5][2], int HVYUVH[6], int bYFlag, int bXFlag);
+	void RawToHVYUVHLine(unsigned short *pInLines[], int *pHGCLines[], int *pVGCLine, unsigned short *pOutLine, int nWidth, int y);
+	void RawToHGCLine(unsigned short *pPadLine, int *pHGCLine, int nWidth, int y);
+	void PadRawLine(MultiUshortImage *pInImage, int y, unsigned short *pOutLine, int nPad);
 	bool RawToHVYUVHImage(MultiUshortImage *pInImage, MultiUshortImage *pOutImage);
 	bool HVYUVHToHV3x3Image(MultiUshortImage *pInImage, CImageData_UINT32 *pOutImage);
+	void HVYUVHToHV3x3Line(unsigned short *pInLines[], unsigned int *pOutLine, int nWidth);
 	bool HVToDirImage(CImageData_UINT32 *pInImage, MultiShortImage *pOutImage, int nDirThre);
+	void HVToDirLine(unsigned int *pIn, short *pOut, int nWidth, int nDirThre);
 	bool MergeHVImage(MultiUshortImage *pInImage, MultiShortImage *pDirImage, MultiUshortImage *pOutImage);
-	void DeleteMinMaxYImage(MultiUshortImage *pYUVHImage);
+	void MergeHVLine(unsigned short *pIn, short *pDir, unsigned short *pOut, int nWidth);
+	bool DeleteMinMaxYImage(MultiUshortImage *pYUVHImage);
+	void DeleteMinMaxYLine(unsigned short *pLines[], unsigned short *pOutLine, int nWidth, int nChannel);
 	void HYUVToRGBH3Line(unsigned short *pInLine, unsigned short *pOutLine, int nWidth);
 	void VYUVToRGB3Line(unsigned short *pInLines[], unsigned short *pOutLine, int nWidth);
 	bool YUVToRGBImage(MultiUshortImage *pInImage, MultiUshortImage *pOutImage);
 	void HGaussHV7Line(unsigned int *pInLine, unsigned int *pOutLine, int nWidth);
 	void VGaussHV7Line(unsigned int *pInLines[], unsigned int *pOutLine, int nWidth);
 	bool GaussHV7x7Image(CImageData_UINT32 *pHVWImage);
+	bool LinePipelineDemosaic(MultiUshortImage *pInImage, MultiUshortImage *pOutImage);
+	bool PreviewDemosaic(MultiUshortImage *pInImage, MultiUshortImage *pOutImage, int nMode);
+	int BilinearQuadCenter(MultiUshortImage *pInImage, int x, int y, int bX, int bY);
+	void LinePipelineBand(MultiUshortImage *pInImage, MultiUshortImage *pOutImage, int nStartY, int nEndY, unsigned short *pBuffer, int *pGCBuffer, unsigned int *pHVBuffer, short *pDirLine);
 };
 #endif
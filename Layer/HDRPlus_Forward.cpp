@@ -7,8 +7,6 @@ void CHDRPlus_Forward::Forward(MultiUshortImage *InRawImage, MultiUcharImage *Ou
 	{
 		nFrameID[k] = k;
 	}
-	MultiUshortImage OutDpcRaw;
-	MultiUshortImage OutRGBImage16;
 	if (m_nBlockMatchFusionEnable)
 	{
 		m_HDRPlus_BlockMatchFusion.Forward(InRawImage, nFrameID, Framenum, pControl);
@@ -17,9 +15,58 @@ void CHDRPlus_Forward::Forward(MultiUshortImage *InRawImage, MultiUcharImage *Ou
 			InRawImage[0].SaveSingleChannelToBitmapFile("outbmp/BlockMatchFusion.bmp", 0, InRawImage[0].GetMaxVal(), 256, 0);
 		}
 	}
+	ProcessRaw(&InRawImage[0], OutRGBImage8, pControl);
+}
+bool CHDRPlus_Forward::BeginBurst(TGlobalControl *pControl)
+{
+	m_nBurstFrameNum = 0;
+	if (m_nBlockMatchFusionEnable)
+	{
+		if (!m_HDRPlus_BlockMatchFusion.BeginBurst(pControl))
+			return false;
+	}
+	return true;
+}
+bool CHDRPlus_Forward::PushFrame(MultiUshortImage *pInRawImage, bool bCopy)
+{
+	if (m_nBurstFrameNum == 0)
+	{
+		m_BurstRawImage.CopyParameters(pInRawImage);
+	}
+	if (m_nBlockMatchFusionEnable)
+	{
+		if (!m_HDRPlus_BlockMatchFusion.PushFrame(pInRawImage, bCopy))
+			return false;
+	}
+	else if (m_nBurstFrameNum == 0)
+	{
+		if (!m_BurstRawImage.Clone(pInRawImage))
+			return false;
+	}
+	m_nBurstFrameNum++;
+	return true;
+}
+void CHDRPlus_Forward::Finish(MultiUcharImage *OutRGBImage8, TGlobalControl *pControl)
+{
+	if (m_nBurstFrameNum == 0)
+		return;
+	if (m_nBlockMatchFusionEnable)
+	{
+		m_HDRPlus_BlockMatchFusion.Finish(&m_BurstRawImage);
+		if (m_HDRPlus_BlockMatchFusion.m_bDumpFileEnable)
+		{
+			m_BurstRawImage.SaveSingleChannelToBitmapFile("outbmp/BlockMatchFusion.bmp", 0, m_BurstRawImage.GetMaxVal(), 256, 0);
+		}
+	}
+	ProcessRaw(&m_BurstRawImage, OutRGBImage8, pControl);
+}
+void CHDRPlus_Forward::ProcessRaw(MultiUshortImage *pInRawImage, MultiUcharImage *OutRGBImage8, TGlobalControl *pControl)
+{
+	MultiUshortImage OutDpcRaw;
+	MultiUshortImage OutRGBImage16;
 	if (m_nDPCorrectionEnable)
 	{
-		m_HDRPlus_DPCorrection.Forward(&InRawImage[0], &OutDpcRaw, pControl);
+		m_HDRPlus_DPCorrection.Forward(pInRawImage, &OutDpcRaw, pControl);
 		// if (m_HDRPlus_DPCorrection.m_bDumpFileEnable)
 		if (1)
 		{
@@ -28,7 +75,7 @@ void CHDRPlus_Forward::Forward(MultiUshortImage *InRawImage, MultiUcharImage *Ou
 	}
 	else
 	{
-		OutDpcRaw.Clone(&InRawImage[0]);
+		OutDpcRaw.Clone(pInRawImage);
 	}
 	if (m_nBlackWhiteLevelEnable)
 	{
@@ -93,10 +93,19 @@ public:
 	int m_nGammaCorrectEnable;
 	int m_nContrastEnable;
 	int m_nSharpenEnable;
+	int m_nBurstFrameNum;
+	MultiUshortImage m_BurstRawImage;
 	CHDRPlus_Forward()
 	{
 		Initialize();
+		m_nBurstFrameNum = 0;
 	}
 	void Forward(MultiUshortImage *InputRawData, MultiUcharImage *pOutRGBData, TGlobalControl *pControl);
+	// 流式接口:读一帧送一帧,在调用方的并行域内PushFrame时各帧的对齐作为任务与下一帧的读取重叠;
+	// bCopy为false时输入图须保留到Finish,融合直接引用不拷贝
+	bool BeginBurst(TGlobalControl *pControl);
+	bool PushFrame(MultiUshortImage *pInRawImage, bool bCopy = true);
+	void Finish(MultiUcharImage *pOutRGBData, TGlobalControl *pControl);
+	void ProcessRaw(MultiUshortImage *pInRawImage, MultiUcharImage *pOutRGBData, TGlobalControl *pControl);
 };
 #endif
\ No newline at end of file
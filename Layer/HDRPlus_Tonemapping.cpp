@@ -27,61 +27,19 @@ bool CHDRPlus_Tonemapping::ConvertoGray(MultiUshortImage *pRGBImage, MultiUshort
 		}
 	}
 	delete[]table;
+	return true;
 }
 bool CHDRPlus_Tonemapping::Brighten(MultiUshortImage *pInDarkImage, float gain, MultiUshortImage *pOutBrightImage)
 {
-	int nWidth = pInDarkImage->GetImageWidth();
-	int nHeight = pInDarkImage->GetImageHeight();
-	if (pOutBrightImage->GetImageWidth() != nWidth || pOutBrightImage->GetImageHeight() != nHeight)
-	{
-		if (!pOutBrightImage->CreateImage(nWidth, nHeight, 1, 16))return false;
-	}
-	unsigned short *table=new unsigned short[m_nMax+1];
-	for (int k = 0; k < m_nMax+1; k++)
-	{
-		int tmp = k * gain;
-		table[k] = CLIP(tmp, m_nMin, m_nMax);
-	}
-	int tmpWidth = nWidth / 4 * 4;
-#pragma omp parallel for 
-	for (int y = 0; y < nHeight; y++)
-	{
-		unsigned short *pInDarkLine = pInDarkImage->GetImageLine(y);
-		unsigned short *pOutBrightLine = pOutBrightImage->GetImageLine(y);
-		int x = 0;
-		for (; x < tmpWidth; x += 4)
-		{
-			pOutBrightLine[0] = table[pInDarkLine[0]];
-			pOutBrightLine[1] = table[pInDarkLine[1]];
-			pOutBrightLine[2] = table[pInDarkLine[2]];
-			pOutBrightLine[3] = table[pInDarkLine[3]];
-			pOutBrightLine += 4;
-			pInDarkLine += 4;
-		}
-		for (; x < nWidth; x++)
-		{
-			pOutBrightLine[0] = table[pInDarkLine[0]];
-			pOutBrightLine++;
-			pInDarkLine++;
-		}
-	}
-	delete[]table;
-	return true;
+	return ApplyToneLUT(pInDarkImage, GetToneLUT(TONE_LUT_BRIGHTEN, gain), pOutBrightImage);
 }
-bool CHDRPlus_Tonemapping::GrayGammaCorrect(MultiUshortImage *pInGrayImage, MultiUshortImage *pOutGammaImage)
+void CHDRPlus_Tonemapping::BuildGammaTable(unsigned short *table)
 {
-	int nWidth = pInGrayImage->GetImageWidth();
-	int nHeight = pInGrayImage->GetImageHeight();
-	if (pOutGammaImage->GetImageWidth() != nWidth || pOutGammaImage->GetImageHeight() != nHeight)
-	{
-		if (!pOutGammaImage->CreateImage(nWidth, nHeight, 1, 16))return false;
-	}
 	int cutoff = 200;                   // ceil(0.00304 * UINT16_MAX)
 	float gamma_toe = 12.92;
 	float gamma_pow = 0.416667;         // 1 / 2.4
 	float gamma_fac = 680.552897;       // 1.055 * UINT16_MAX ^ (1 - gamma_pow);
 	float gamma_con = -3604.425;        // -0.055 * UINT16_MAX
-	unsigned short *table=new unsigned short[m_nMax+1];
 	for (int k = 0; k < m_nMax+1; k++)
 	{
 		long long int tmp;
@@ -95,35 +53,109 @@ bool CHDRPlus_Tonemapping::GrayGammaCorrect(MultiUshortImage *pInGrayImage, Mult
 		}
 		table[k] = CLIP(tmp, m_nMin, m_nMax);
 	}
-#pragma omp parallel for
-	for (int y = 0; y < nHeight; y++)
+}
+// 按类型和增益取查找表,m_nMin/m_nMax变化时全部重建
+const unsigned short *CHDRPlus_Tonemapping::GetToneLUT(int nType, float fGain)
+{
+	if (m_nToneLUTMin != m_nMin || m_nToneLUTMax != m_nMax)
 	{
-		unsigned short *pInline = pInGrayImage->GetImageLine(y);
-		unsigned short *pOutline = pOutGammaImage->GetImageLine(y);
-		for (int x = 0; x < nWidth; x++)
+		if (!m_GammaLUT.SetImageSize(m_nMax + 1, 1, 1))return NULL;
+		if (!m_InverseLUT.SetImageSize(m_nMax + 1, 1, 1))return NULL;
+		BuildGammaTable(m_GammaLUT.GetImageData());
+		BuildGammaInverseTable(m_InverseLUT.GetImageData());
+		m_nToneLUTNum = 0;
+		m_nToneLUTMin = m_nMin;
+		m_nToneLUTMax = m_nMax;
+	}
+	if (nType == TONE_LUT_GAMMA)return m_GammaLUT.GetImageData();
+	if (nType == TONE_LUT_INVERSE)return m_InverseLUT.GetImageData();
+	for (int i = 0; i < MIN2(m_nToneLUTNum, TONE_LUT_CACHE_SIZE); i++)
+	{
+		if (m_nToneLUTType[i] == nType && m_fToneLUTGain[i] == fGain)
 		{
-			pOutline[0] = table[pInline[0]];
-			pOutline++;
-			pInline++;
+			return m_ToneLUT[i].GetImageData();
 		}
 	}
-	delete[]table;
-	return true;
+	int nSlot = m_nToneLUTNum % TONE_LUT_CACHE_SIZE;
+	if (!m_ToneLUT[nSlot].SetImageSize(m_nMax + 1, 1, 1))return NULL;
+	unsigned short *pTable = m_ToneLUT[nSlot].GetImageData();
+	unsigned short *pGammaTable = m_GammaLUT.GetImageData();
+	unsigned short *pInverseTable = m_InverseLUT.GetImageData();
+	for (int k = 0; k < m_nMax + 1; k++)
+	{
+		int tmp;
+		if (nType == TONE_LUT_INVERSE_BRIGHTEN)
+		{
+			tmp = pInverseTable[k] * fGain;
+		}
+		else
+		{
+			tmp = k * fGain;
+		}
+		tmp = CLIP(tmp, m_nMin, m_nMax);
+		pTable[k] = (nType == TONE_LUT_BRIGHTEN_GAMMA) ? pGammaTable[tmp] : tmp;
+	}
+	m_nToneLUTType[nSlot] = nType;
+	m_fToneLUTGain[nSlot] = fGain;
+	m_nToneLUTNum++;
+	return pTable;
 }
-bool CHDRPlus_Tonemapping::GammaInverse(MultiUshortImage *pInGrayImage, MultiUshortImage *pOutInverseImage)
+const float *CHDRPlus_Tonemapping::GetWeightLUT()
 {
-	int nWidth = pInGrayImage->GetImageWidth();
-	int nHeight = pInGrayImage->GetImageHeight();
-	if (pOutInverseImage->GetImageWidth() != nWidth || pOutInverseImage->GetImageHeight() != nHeight)
+	if (m_WeightLUT.GetImageWidth() != m_nMax + 1)
+	{
+		if (!m_WeightLUT.SetImageSize(m_nMax + 1, 1, 1))return NULL;
+		float *pTable = m_WeightLUT.GetImageData();
+		for (int k = 0; k < m_nMax + 1; k++)
+		{
+			float darks = ((float)k / (float)m_nMax - 0.5f);
+			pTable[k] = exp(-12.5f *(darks*darks));
+		}
+	}
+	return m_WeightLUT.GetImageData();
+}
+bool CHDRPlus_Tonemapping::ApplyToneLUT(MultiUshortImage *pInImage, const unsigned short *pTable, MultiUshortImage *pOutImage)
+{
+	if (pTable == NULL)return false;
+	int nWidth = pInImage->GetImageWidth();
+	int nHeight = pInImage->GetImageHeight();
+	if (pOutImage->GetImageWidth() != nWidth || pOutImage->GetImageHeight() != nHeight)
+	{
+		if (!pOutImage->CreateImage(nWidth, nHeight, 1, 16))return false;
+	}
+	int tmpWidth = nWidth / 4 * 4;
+	int nProcs = omp_get_num_procs();
+#pragma omp parallel for num_threads(nProcs)
+	for (int y = 0; y < nHeight; y++)
 	{
-		if (!pOutInverseImage->CreateImage(nWidth, nHeight, 1, 16))return false;
+		unsigned short *pInline = pInImage->GetImageLine(y);
+		unsigned short *pOutline = pOutImage->GetImageLine(y);
+		int x = 0;
+		for (; x < tmpWidth; x += 4)
+		{
+			pOutline[x] = pTable[pInline[x]];
+			pOutline[x + 1] = pTable[pInline[x + 1]];
+			pOutline[x + 2] = pTable[pInline[x + 2]];
+			pOutline[x + 3] = pTable[pInline[x + 3]];
+		}
+		for (; x < nWidth; x++)
+		{
+			pOutline[x] = pTable[pInline[x]];
+		}
 	}
+	return true;
+}
+bool CHDRPlus_Tonemapping::GrayGammaCorrect(MultiUshortImage *pInGrayImage, MultiUshortImage *pOutGammaImage)
+{
+	return ApplyToneLUT(pInGrayImage, GetToneLUT(TONE_LUT_GAMMA, 1.f), pOutGammaImage);
+}
+void CHDRPlus_Tonemapping::BuildGammaInverseTable(unsigned short *table)
+{
 	unsigned int cutoff = 2575;                   // ceil(1/0.00304 * UINT16_MAX)
 	float gamma_toe = 0.0774f;            // 1 / 12.92
 	float gamma_pow = 2.4f;
 	float gamma_fac = 57632.49226f;       // 1 / 1.055 ^ gamma_pow * U_INT16_MAX;
 	float gamma_con = 0.055f;
-	unsigned short *table=new unsigned short[m_nMax+1];
 	for (int k = 0; k < m_nMax+1; k++)
 	{
 		long int tmp;
@@ -137,19 +169,10 @@ bool CHDRPlus_Tonemapping::GammaInverse(MultiUshortImage *pInGrayImage, MultiUsh
 		}
 		table[k] = CLIP(tmp, m_nMin, m_nMax);
 	}
-#pragma omp parallel for 
-	for (int y = 0; y < nHeight; y++)
-	{
-		unsigned short *pInline = pInGrayImage->GetImageLine(y);
-		unsigned short *pOutline = pOutInverseImage->GetImageLine(y);
-		for (int x = 0; x < nWidth; x++)
-		{
-			pOutline[0] = table[pInline[0]];
-			pOutline++;
-			pInline++;
-		}
-	}
-	delete[]table;
+}
+bool CHDRPlus_Tonemapping::GammaInverse(MultiUshortImage *pInGrayImage, MultiUshortImage *pOutInverseImage)
+{
+	return ApplyToneLUT(pInGrayImage, GetToneLUT(TONE_LUT_INVERSE, 1.f), pOutInverseImage);
 }
 bool CHDRPlus_Tonemapping::BuildWeight(MultiUshortImage *pDarkGammaImage, MultiUshortImage *pBrightGammaImage, MultiUshortImage *DarkWeightImage, MultiUshortImage *BrightWeightImage, int ScaleBit)
 {
@@ -165,12 +188,8 @@ bool CHDRPlus_Tonemapping::BuildWeight(MultiUshortImage *pDarkGammaImage, MultiU
 	{
 		if (!BrightWeightImage->CreateImage(nWidth, nHeight, nDim, 16))return false;
 	}
-	float *WeightTable=new float[m_nMax+1];
-	for (int k = 0; k < m_nMax+1; k++)
-	{
-		float darks = ((float)k / (float)m_nMax - 0.5f);
-		WeightTable[k] = exp(-12.5f *(darks*darks));
-	}
+	const float *WeightTable = GetWeightLUT();
+	if (WeightTable == NULL)return false;
 #pragma omp parallel for 
 	for (int y = 0; y < nHeight; y++)
 	{
@@ -192,7 +211,6 @@ bool CHDRPlus_Tonemapping::BuildWeight(MultiUshortImage *pDarkGammaImage, MultiU
 			pBrightWeightline++;
 		}
 	}
-	delete[]WeightTable;
 	return true;
 }
 bool CHDRPlus_Tonemapping::CombineDarkAndBrightImage(MultiUshortImage *pDarkGammaImage, MultiUshortImage *pBrightGammaImage, MultiUshortImage *pOutCombineImage)
@@ -201,16 +219,17 @@ bool CHDRPlus_Tonemapping::CombineDarkAndBrightImage(MultiUshortImage *pDarkGamm
 	int nWidth = pDarkGammaImage->GetImageWidth();
 	int nHeight = pDarkGammaImage->GetImageHeight();
 	int nDim = pDarkGammaImage->GetImageDim();
-	MultiUshortImage DarkWeightImage, BrightWeightImage;
-	MultiUshortImage DarkImagePyramid[12], BrightImagePyramid[12], DarkWeightImagePyramid[12], BrightWeightImagePyramid[12];
-	MultiShortImage DarkImagePyramidEdge[12], BrightImagePyramidEdge[12];
-	int nPyramidLevel = 12;
-	pDarkGammaImage->GaussPyramidImage(DarkImagePyramid, DarkImagePyramidEdge, nPyramidLevel, true);
-	pBrightGammaImage->GaussPyramidImage(BrightImagePyramid, BrightImagePyramidEdge, nPyramidLevel, true);
+	MultiUshortImage &DarkWeightImage = m_DarkWeightImage, &BrightWeightImage = m_BrightWeightImage;
+	MultiUshortImage *DarkImagePyramid = m_DarkImagePyramid, *BrightImagePyramid = m_BrightImagePyramid;
+	MultiUshortImage *DarkWeightImagePyramid = m_DarkWeightImagePyramid, *BrightWeightImagePyramid = m_BrightWeightImagePyramid;
+	MultiShortImage *DarkImagePyramidEdge = m_DarkImagePyramidEdge, *BrightImagePyramidEdge = m_BrightImagePyramidEdge;
+	int nPyramidLevel = TONE_PYRAMID_LEVEL;
+	pDarkGammaImage->GaussPyramidImage(DarkImagePyramid, DarkImagePyramidEdge, nPyramidLevel, true, &m_PyramidTempImage);
+	pBrightGammaImage->GaussPyramidImage(BrightImagePyramid, BrightImagePyramidEdge, nPyramidLevel, true, &m_PyramidTempImage);
 	BuildWeight(pDarkGammaImage, pBrightGammaImage, &DarkWeightImage, &BrightWeightImage, ScaleBit);
-	DarkWeightImage.GaussPyramidImage(DarkWeightImagePyramid, NULL, nPyramidLevel, false);//���ֵ��4096
-	BrightWeightImage.GaussPyramidImage(BrightWeightImagePyramid, NULL, nPyramidLevel, false);
-	MultiUshortImage TempImage;
+	DarkWeightImage.GaussPyramidImage(DarkWeightImagePyramid, NULL, nPyramidLevel, false, &m_PyramidTempImage);//���ֵ��4096
+	BrightWeightImage.GaussPyramidImage(BrightWeightImagePyramid, NULL, nPyramidLevel, false, &m_PyramidTempImage);
+	MultiUshortImage &TempImage = m_PyramidTempImage;
 	DarkImagePyramid[nPyramidLevel].ApplyWeight(&DarkWeightImagePyramid[nPyramidLevel], ScaleBit);
 	BrightImagePyramid[nPyramidLevel].ApplyWeight(&BrightWeightImagePyramid[nPyramidLevel], ScaleBit);//�Ѿ�����4096
 	DarkImagePyramid[nPyramidLevel].AddImage(&BrightImagePyramid[nPyramidLevel]);
@@ -226,6 +245,397 @@ bool CHDRPlus_Tonemapping::CombineDarkAndBrightImage(MultiUshortImage *pDarkGamm
 	}
 	return true;
 }
+// 粗一层在(x,y)处的x2上采样值,与UpScaleImagex2一样按像素中心做3:1双线性插值
+template <class T>
+static inline float UpsamplePixel(const T *pLine0, const T *pLine1, int x, int nCoarseWidth)
+{
+	int x0 = x >> 1;
+	int x1 = (x & 1) ? MIN2(x0 + 1, nCoarseWidth - 1) : MAX2(x0 - 1, 0);
+	return 0.5625f * pLine0[x0] + 0.1875f * (pLine0[x1] + pLine1[x0]) + 0.0625f * pLine1[x1];
+}
+// 快速路径:nPassNum次迭代的提亮系数连乘得到nPassNum+1个虚拟曝光 F_j = gamma(clip(invgamma(v)*gain_j)),一次性融合。
+// 全分辨率上查表得到各曝光(nPassNum+1通道),由它建真实的各曝光高斯金字塔,权重同样在原图上归一化后建金字塔;
+// 从最粗层重建:R_l = up(R_l+1) + sum_j W_j,l * (E_j,l - up(E_j,l+1)),最后一层直接查表做逆gamma并乘上各次压暗系数的乘积。
+// 用 F_j(G_l(I)) 近似 G_l(F_j(I)) 时凹的gamma在平均之后才作用,整体偏暗,所以粗层不做近似
+bool CHDRPlus_Tonemapping::FuseVirtualExposures(MultiUshortImage *pGrayImage, const float *pNormComp, const float *pNormGain, int nPassNum, MultiUshortImage *pOutImage)
+{
+	const int nMaxLevel = 12;
+	const int ScaleBit = 12;
+	int nExpNum = nPassNum + 1;
+	int nWidth = pGrayImage->GetImageWidth();
+	int nHeight = pGrayImage->GetImageHeight();
+	if (pOutImage->GetImageWidth() != nWidth || pOutImage->GetImageHeight() != nHeight)
+	{
+		if (!pOutImage->CreateImage(nWidth, nHeight, 1, 16))return false;
+	}
+	int nTableSize = m_nMax + 1;
+	const unsigned short *pGammaTable = GetToneLUT(TONE_LUT_GAMMA, 1.f);
+	const unsigned short *pInverseTable = GetToneLUT(TONE_LUT_INVERSE, 1.f);
+	if (pGammaTable == NULL || pInverseTable == NULL)return false;
+	// 查找表放在CMat里,中途失败返回时自动释放;调用方保证nExpNum不超过FAST_FUSION_MAX_EXPOSURE
+	CImageData_UINT16 ValueTable, WeightTable;
+	if (!ValueTable.SetImageSize(nExpNum, nTableSize, 1))return false;
+	if (!WeightTable.SetImageSize(nExpNum, nTableSize, 1))return false;
+	unsigned short *pValueTable = ValueTable.GetImageData();
+	unsigned short *pWeightTable = WeightTable.GetImageData();
+	float pExpGain[FAST_FUSION_MAX_EXPOSURE];
+	float fOutGain = 1.f;
+	pExpGain[0] = 1.f;
+	for (int pass = 0; pass < nPassNum; pass++)
+	{
+		pExpGain[pass + 1] = pExpGain[pass] * pNormComp[pass];
+		fOutGain *= pNormGain[pass];
+	}
+	int nProcs = omp_get_num_procs();
+#pragma omp parallel for num_threads(nProcs)
+	for (int k = 0; k < nTableSize; k++)
+	{
+		unsigned short *pValue = pValueTable + k * nExpNum;
+		unsigned short *pWeight = pWeightTable + k * nExpNum;
+		float fWeight[FAST_FUSION_MAX_EXPOSURE];
+		float fSumWeight = 0;
+		for (int j = 0; j < nExpNum; j++)
+		{
+			int tmp = pInverseTable[k] * pExpGain[j];
+			pValue[j] = pGammaTable[CLIP(tmp, m_nMin, m_nMax)];
+			float darks = pValue[j] / (float)m_nMax - 0.5f;
+			fWeight[j] = exp(-12.5f * (darks * darks));
+			fSumWeight += fWeight[j];
+		}
+		for (int j = 0; j < nExpNum; j++)
+		{
+			pWeight[j] = (unsigned short)(fWeight[j] * (1 << ScaleBit) / fSumWeight + 0.5f);
+		}
+	}
+	MultiUshortImage GammaImage, WeightImage, ExpImage;
+	if (!GrayGammaCorrect(pGrayImage, &GammaImage))return false;
+	if (!WeightImage.CreateImage(nWidth, nHeight, nExpNum, 16))return false;
+	if (!ExpImage.CreateImage(nWidth, nHeight, nExpNum, 16))return false;
+#pragma omp parallel for num_threads(nProcs)
+	for (int y = 0; y < nHeight; y++)
+	{
+		unsigned short *pGammaline = GammaImage.GetImageLine(y);
+		unsigned short *pWeightline = WeightImage.GetImageLine(y);
+		unsigned short *pExpline = ExpImage.GetImageLine(y);
+		for (int x = 0; x < nWidth; x++)
+		{
+			const unsigned short *pWeight = pWeightTable + pGammaline[x] * nExpNum;
+			const unsigned short *pValue = pValueTable + pGammaline[x] * nExpNum;
+			for (int j = 0; j < nExpNum; j++)
+			{
+				pWeightline[j] = pWeight[j];
+				pExpline[j] = pValue[j];
+			}
+			pWeightline += nExpNum;
+			pExpline += nExpNum;
+		}
+	}
+	MultiUshortImage ExpPyramid[nMaxLevel + 1], WeightPyramid[nMaxLevel + 1];
+	MultiUshortImage *pLevel[nMaxLevel + 1], *pWeightLevel[nMaxLevel + 1];
+	pLevel[0] = &ExpImage;
+	pWeightLevel[0] = &WeightImage;
+	int nLevel = 0;
+	while (nLevel < nMaxLevel && pLevel[nLevel]->GetImageWidth() > 4 && pLevel[nLevel]->GetImageHeight() > 4)
+	{
+		MultiUshortImage *pIn = pLevel[nLevel];
+		MultiUshortImage *pWeightIn = pWeightLevel[nLevel];
+		MultiUshortImage tmpExtendImage, tmpExtendWeightImage;
+		if ((pIn->GetImageWidth() & 1) == 1 || (pIn->GetImageHeight() & 1) == 1)
+		{
+			if (!pIn->Extend2Image(pIn, &tmpExtendImage, 1))return false;
+			if (!pWeightIn->Extend2Image(pWeightIn, &tmpExtendWeightImage, 1))return false;
+			pIn = &tmpExtendImage;
+			pWeightIn = &tmpExtendWeightImage;
+		}
+		if (!pIn->DownScaleImagex2(&ExpPyramid[nLevel + 1], false))return false;
+		if (!pWeightIn->DownScaleImagex2(&WeightPyramid[nLevel + 1], false))return false;
+		pLevel[nLevel + 1] = &ExpPyramid[nLevel + 1];
+		pWeightLevel[nLevel + 1] = &WeightPyramid[nLevel + 1];
+		nLevel++;
+	}
+	// 原图层重建时直接由gamma图查表,全分辨率的多曝光图不再保留
+	if (nLevel > 0)
+	{
+		ExpImage.ClearMem();
+	}
+	const unsigned short *pOutTable = GetToneLUT(TONE_LUT_INVERSE_BRIGHTEN, fOutGain);
+	if (pOutTable == NULL)return false;
+	float fWeightScale = 1.f / (1 << ScaleBit);
+	CImage_FLOAT FuseImage[2];
+	if (!FuseImage[nLevel & 1].SetImageSize(pLevel[nLevel]->GetImageWidth(), pLevel[nLevel]->GetImageHeight(), 1))return false;
+	for (int y = 0; y < pLevel[nLevel]->GetImageHeight(); y++)
+	{
+		unsigned short *pExpline = pLevel[nLevel]->GetImageLine(y);
+		unsigned short *pWeightline = pWeightLevel[nLevel]->GetImageLine(y);
+		float *pFuseline = FuseImage[nLevel & 1].GetImageLine(y);
+		for (int x = 0; x < pLevel[nLevel]->GetImageWidth(); x++)
+		{
+			float fVal = 0;
+			for (int j = 0; j < nExpNum; j++)
+			{
+				fVal += pWeightline[j] * pExpline[j];
+			}
+			pFuseline[x] = fVal * fWeightScale;
+			if (nLevel == 0)
+			{
+				int tmp = (int)(pFuseline[x] + 0.5f);
+				pOutImage->GetImageLine(y)[x] = pOutTable[CLIP(tmp, m_nMin, m_nMax)];
+			}
+			pWeightline += nExpNum;
+			pExpline += nExpNum;
+		}
+	}
+	for (int l = nLevel - 1; l >= 0; l--)
+	{
+		MultiUshortImage *pFine = pLevel[l];
+		MultiUshortImage *pCoarse = pLevel[l + 1];
+		MultiUshortImage *pFineWeight = pWeightLevel[l];
+		CImage_FLOAT *pCoarseFuse = &FuseImage[(l + 1) & 1];
+		CImage_FLOAT *pFineFuse = &FuseImage[l & 1];
+		int nFineWidth = pFineWeight->GetImageWidth();
+		int nFineHeight = pFineWeight->GetImageHeight();
+		int nCoarseWidth = pCoarse->GetImageWidth();
+		int nCoarseHeight = pCoarse->GetImageHeight();
+		if (l > 0)
+		{
+			if (!pFineFuse->SetImageSize(nFineWidth, nFineHeight, 1))return false;
+		}
+#pragma omp parallel for num_threads(nProcs) schedule(dynamic, 16)
+		for (int y = 0; y < nFineHeight; y++)
+		{
+			int y0 = y >> 1;
+			int y1 = (y & 1) ? MIN2(y0 + 1, nCoarseHeight - 1) : MAX2(y0 - 1, 0);
+			unsigned short *pCoarseline0 = pCoarse->GetImageLine(y0);
+			unsigned short *pCoarseline1 = pCoarse->GetImageLine(y1);
+			float *pCoarseFuseline0 = pCoarseFuse->GetImageLine(y0);
+			float *pCoarseFuseline1 = pCoarseFuse->GetImageLine(y1);
+			unsigned short *pFineline = (l > 0) ? pFine->GetImageLine(y) : GammaImage.GetImageLine(y);
+			unsigned short *pWeightline = pFineWeight->GetImageLine(y);
+			for (int x = 0; x < nFineWidth; x++)
+			{
+				// 各曝光粗一层的3:1双线性上采样,与UpsamplePixel相同
+				int x0 = x >> 1;
+				int x1 = (x & 1) ? MIN2(x0 + 1, nCoarseWidth - 1) : MAX2(x0 - 1, 0);
+				const unsigned short *p00 = pCoarseline0 + x0 * nExpNum;
+				const unsigned short *p01 = pCoarseline0 + x1 * nExpNum;
+				const unsigned short *p10 = pCoarseline1 + x0 * nExpNum;
+				const unsigned short *p11 = pCoarseline1 + x1 * nExpNum;
+				const unsigned short *pFineValue = (l > 0) ? pFineline + x * nExpNum : pValueTable + pFineline[x] * nExpNum;
+				float fDetail = 0;
+				for (int j = 0; j < nExpNum; j++)
+				{
+					float fUp = 0.5625f * p00[j] + 0.1875f * (p01[j] + p10[j]) + 0.0625f * p11[j];
+					fDetail += pWeightline[j] * (pFineValue[j] - fUp);
+				}
+				float fVal = UpsamplePixel(pCoarseFuseline0, pCoarseFuseline1, x, nCoarseWidth) + fDetail * fWeightScale;
+				if (l > 0)
+				{
+					pFineFuse->GetImageLine(y)[x] = fVal;
+				}
+				else
+				{
+					int tmp = (int)(fVal + 0.5f);
+					pOutImage->GetImageLine(y)[x] = pOutTable[CLIP(tmp, m_nMin, m_nMax)];
+				}
+				pWeightline += nExpNum;
+			}
+		}
+	}
+	return true;
+}
+// 灰度图连续nScaleBit次x2缩小,奇数尺寸先扩边
+bool CHDRPlus_Tonemapping::DownScaleGrayImage(MultiUshortImage *pGrayImage, MultiUshortImage *pOutImage, int nScaleBit)
+{
+	MultiUshortImage TempImage[2];
+	MultiUshortImage *pIn = pGrayImage;
+	for (int i = 0; i < nScaleBit; i++)
+	{
+		MultiUshortImage tmpExtendImage;
+		MultiUshortImage *pOut = (i == nScaleBit - 1) ? pOutImage : &TempImage[i & 1];
+		if ((pIn->GetImageWidth() & 1) == 1 || (pIn->GetImageHeight() & 1) == 1)
+		{
+			if (!pIn->Extend2Image(pIn, &tmpExtendImage, 1))return false;
+			pIn = &tmpExtendImage;
+		}
+		if (!pIn->DownScaleImagex2(pOut, false))return false;
+		pIn = pOut;
+	}
+	return true;
+}
+// (2*nRadius+1)x(2*nRadius+1)窗口均值,边界只统计图内像素
+void CHDRPlus_Tonemapping::BoxMeanImage(CImage_FLOAT *pInImage, CImage_FLOAT *pOutImage, int nRadius)
+{
+	int nWidth = pInImage->GetImageWidth();
+	int nHeight = pInImage->GetImageHeight();
+	CImage_FLOAT TempImage;
+	TempImage.SetImageSize(nWidth, nHeight, 1);
+	pOutImage->SetImageSize(nWidth, nHeight, 1);
+	int nProcs = omp_get_num_procs();
+#pragma omp parallel for num_threads(nProcs)
+	for (int y = 0; y < nHeight; y++)
+	{
+		float *pInline = pInImage->GetImageLine(y);
+		float *pTempline = TempImage.GetImageLine(y);
+		float fSum = 0;
+		int nCount = 0;
+		for (int x = 0; x < MIN2(nRadius, nWidth); x++)
+		{
+			fSum += pInline[x];
+			nCount++;
+		}
+		for (int x = 0; x < nWidth; x++)
+		{
+			if (x + nRadius < nWidth)
+			{
+				fSum += pInline[x + nRadius];
+				nCount++;
+			}
+			if (x - nRadius - 1 >= 0)
+			{
+				fSum -= pInline[x - nRadius - 1];
+				nCount--;
+			}
+			pTempline[x] = fSum / nCount;
+		}
+	}
+#pragma omp parallel for num_threads(nProcs)
+	for (int y = 0; y < nHeight; y++)
+	{
+		int y0 = MAX2(y - nRadius, 0);
+		int y1 = MIN2(y + nRadius, nHeight - 1);
+		float fScale = 1.f / (y1 - y0 + 1);
+		float *pOutline = pOutImage->GetImageLine(y);
+		float *pTempline = TempImage.GetImageLine(y0);
+		for (int x = 0; x < nWidth; x++)
+		{
+			pOutline[x] = pTempline[x];
+		}
+		for (int yy = y0 + 1; yy <= y1; yy++)
+		{
+			pTempline = TempImage.GetImageLine(yy);
+			for (int x = 0; x < nWidth; x++)
+			{
+				pOutline[x] += pTempline[x];
+			}
+		}
+		for (int x = 0; x < nWidth; x++)
+		{
+			pOutline[x] *= fScale;
+		}
+	}
+}
+// 低分辨率上做gamma域的导向滤波:以gamma(小灰度图)为导向,gamma(小融合图)为目标,得到局部线性系数a,b,
+// 双线性放大a,b后在原图上计算 a*gamma(灰度)+b 再逆gamma,边缘跟随原图灰度,不会出现块状的增益
+bool CHDRPlus_Tonemapping::GuidedUpsampleDarkImage(MultiUshortImage *pGrayImage, MultiUshortImage *pSmallGrayImage, MultiUshortImage *pSmallDarkImage, MultiUshortImage *pOutImage)
+{
+	int nWidth = pGrayImage->GetImageWidth();
+	int nHeight = pGrayImage->GetImageHeight();
+	int nSmallWidth = pSmallGrayImage->GetImageWidth();
+	int nSmallHeight = pSmallGrayImage->GetImageHeight();
+	int nScale = 1 << m_nLowResScaleBit;
+	if (pOutImage->GetImageWidth() != nWidth || pOutImage->GetImageHeight() != nHeight)
+	{
+		if (!pOutImage->CreateImage(nWidth, nHeight, 1, 16))return false;
+	}
+	const unsigned short *pGammaTable = GetToneLUT(TONE_LUT_GAMMA, 1.f);
+	const unsigned short *pInverseTable = GetToneLUT(TONE_LUT_INVERSE, 1.f);
+	if (pGammaTable == NULL || pInverseTable == NULL)return false;
+	CImage_FLOAT GuideImage, TargetImage, GuideTargetImage, GuideSquareImage;
+	CImage_FLOAT MeanGuideImage, MeanTargetImage, MeanGuideTargetImage, MeanGuideSquareImage;
+	if (!GuideImage.SetImageSize(nSmallWidth, nSmallHeight, 1))return false;
+	if (!TargetImage.SetImageSize(nSmallWidth, nSmallHeight, 1))return false;
+	if (!GuideTargetImage.SetImageSize(nSmallWidth, nSmallHeight, 1))return false;
+	if (!GuideSquareImage.SetImageSize(nSmallWidth, nSmallHeight, 1))return false;
+	int nProcs = omp_get_num_procs();
+#pragma omp parallel for num_threads(nProcs)
+	for (int y = 0; y < nSmallHeight; y++)
+	{
+		unsigned short *pGrayline = pSmallGrayImage->GetImageLine(y);
+		unsigned short *pDarkline = pSmallDarkImage->GetImageLine(y);
+		float *pGuideline = GuideImage.GetImageLine(y);
+		float *pTargetline = TargetImage.GetImageLine(y);
+		float *pGuideTargetline = GuideTargetImage.GetImageLine(y);
+		float *pGuideSquareline = GuideSquareImage.GetImageLine(y);
+		for (int x = 0; x < nSmallWidth; x++)
+		{
+			float I = pGammaTable[pGrayline[x]];
+			float p = pGammaTable[pDarkline[x]];
+			pGuideline[x] = I;
+			pTargetline[x] = p;
+			pGuideTargetline[x] = I * p;
+			pGuideSquareline[x] = I * I;
+		}
+	}
+	BoxMeanImage(&GuideImage, &MeanGuideImage, m_nGuidedRadius);
+	BoxMeanImage(&TargetImage, &MeanTargetImage, m_nGuidedRadius);
+	BoxMeanImage(&GuideTargetImage, &MeanGuideTargetImage, m_nGuidedRadius);
+	BoxMeanImage(&GuideSquareImage, &MeanGuideSquareImage, m_nGuidedRadius);
+	// a,b写回GuideImage,TargetImage,再做一次窗口均值
+	float fEps = (float)m_nGuidedEps * m_nGuidedEps;
+#pragma omp parallel for num_threads(nProcs)
+	for (int y = 0; y < nSmallHeight; y++)
+	{
+		float *pMeanI = MeanGuideImage.GetImageLine(y);
+		float *pMeanP = MeanTargetImage.GetImageLine(y);
+		float *pMeanIP = MeanGuideTargetImage.GetImageLine(y);
+		float *pMeanII = MeanGuideSquareImage.GetImageLine(y);
+		float *pAline = GuideImage.GetImageLine(y);
+		float *pBline = TargetImage.GetImageLine(y);
+		for (int x = 0; x < nSmallWidth; x++)
+		{
+			float fVar = pMeanII[x] - pMeanI[x] * pMeanI[x];
+			float fCov = pMeanIP[x] - pMeanI[x] * pMeanP[x];
+			pAline[x] = fCov / (MAX2(fVar, 0.f) + fEps);
+			pBline[x] = pMeanP[x] - pAline[x] * pMeanI[x];
+		}
+	}
+	BoxMeanImage(&GuideImage, &MeanGuideImage, m_nGuidedRadius);
+	BoxMeanImage(&TargetImage, &MeanTargetImage, m_nGuidedRadius);
+	// 小图像素中心对应原图 (x+0.5)*nScale-0.5
+	int *pXIndex = new int[nWidth * 2];
+	float *pXWeight = new float[nWidth];
+	for (int x = 0; x < nWidth; x++)
+	{
+		float fx = (x + 0.5f) / nScale - 0.5f;
+		fx = CLIP(fx, 0.f, (float)(nSmallWidth - 1));
+		int x0 = (int)fx;
+		pXIndex[2 * x] = x0;
+		pXIndex[2 * x + 1] = MIN2(x0 + 1, nSmallWidth - 1);
+		pXWeight[x] = fx - x0;
+	}
+#pragma omp parallel for num_threads(nProcs)
+	for (int y = 0; y < nHeight; y++)
+	{
+		float fy = (y + 0.5f) / nScale - 0.5f;
+		fy = CLIP(fy, 0.f, (float)(nSmallHeight - 1));
+		int y0 = (int)fy;
+		int y1 = MIN2(y0 + 1, nSmallHeight - 1);
+		float wy = fy - y0;
+		float *pA0 = MeanGuideImage.GetImageLine(y0);
+		float *pA1 = MeanGuideImage.GetImageLine(y1);
+		float *pB0 = MeanTargetImage.GetImageLine(y0);
+		float *pB1 = MeanTargetImage.GetImageLine(y1);
+		unsigned short *pGrayline = pGrayImage->GetImageLine(y);
+		unsigned short *pOutline = pOutImage->GetImageLine(y);
+		for (int x = 0; x < nWidth; x++)
+		{
+			int x0 = pXIndex[2 * x];
+			int x1 = pXIndex[2 * x + 1];
+			float wx = pXWeight[x];
+			float A0 = pA0[x0] + (pA0[x1] - pA0[x0]) * wx;
+			float A1 = pA1[x0] + (pA1[x1] - pA1[x0]) * wx;
+			float B0 = pB0[x0] + (pB0[x1] - pB0[x0]) * wx;
+			float B1 = pB1[x0] + (pB1[x1] - pB1[x0]) * wx;
+			float A = A0 + (A1 - A0) * wy;
+			float B = B0 + (B1 - B0) * wy;
+			int tmp = (int)(A * pGammaTable[pGrayline[x]] + B + 0.5f);
+			pOutline[x] = pInverseTable[CLIP(tmp, m_nMin, m_nMax)];
+		}
+	}
+	delete[] pXIndex;
+	delete[] pXWeight;
+	return true;
+}
 void CHDRPlus_Tonemapping::GammaCombinRGB(MultiUshortImage *pRGBImage, MultiUshortImage *pGrayImage, MultiUshortImage *pDarkImage)
 {
 	int nWidth = pRGBImage->GetImageWidth();
@@ -409,54 +819,67 @@ bool CHDRPlus_Tonemapping::SmoothGammaYImage(MultiUshortImage *pInImage, MultiUs
 }
 bool CHDRPlus_Tonemapping::EstimateDigiGain(MultiUshortImage *pInImage, TGlobalControl *pControl)
 {
-	int m, n, W, x, y, x1, y1, Y, C[1];
+	int y;
 	int nWidth = pInImage->GetImageWidth();
 	int nHeight = pInImage->GetImageHeight();
 	double fMean[1], fMeanV;
-	long long int intMean[1], intMeanV;
 	int nWinW = nWidth >> 2;
 	int nWinH = nHeight >> 2;
-	unsigned int *pHist = new unsigned int[m_nMax + 1];
-	if (pHist == NULL)return false;
-	memset(pHist, 0, sizeof(int)*(m_nMax + 1));
-	fMean[0]=0;
-	intMean[0]= 0;
-	C[0]= 0;
-	for (y = y1 = 0, m = 0; y < nHeight; y++)
-	{
-		unsigned short *pCFA = pInImage->GetImageLine(y);
-		W = m_nBlockWeightMap[m][0];
-		for (x = x1 = 0,  n = 0; x < nWidth; x++)
-		{
-			unsigned short Y = pCFA[0];
-			intMean[0] += Y * W;
-			C[0] += W;
-			pHist[Y] += W;
-			x1++;
-			if (x1 == nWinW)
+	int nStep = 1 << m_nStatSubSampleBit;
+	int nHistSize = m_nMax + 1;
+	int nProcs = omp_get_num_procs();
+	// 每个线程一个直方图,统计完再合并
+	if (!m_HistBuffer.SetImageSize(nHistSize, nProcs, 1))return false;
+	memset(m_HistBuffer.GetImageData(), 0, sizeof(unsigned int) * nHistSize * nProcs);
+	// 每行分4段,段内块权重相同;宽高不是4的整数倍时多出的行列归到最后一块
+	int nSegStart[5];
+	for (int n = 0; n < 4; n++)
+	{
+		nSegStart[n] = (n * nWinW + nStep - 1) / nStep * nStep;
+	}
+	nSegStart[4] = nWidth;
+	long long int intMean = 0;
+	long long int nCount = 0;
+#pragma omp parallel for num_threads(nProcs) reduction(+ : intMean, nCount)
+	for (int yy = 0; yy < nHeight; yy += nStep)
+	{
+		unsigned int *pHist = m_HistBuffer.GetImageLine(omp_get_thread_num());
+		unsigned short *pLine = pInImage->GetImageLine(yy);
+		int m = (nWinH > 0) ? MIN2(yy / nWinH, 3) : 3;
+		for (int n = 0; n < 4; n++)
+		{
+			unsigned int W = m_nBlockWeightMap[m][n];
+			if (W == 0)continue;
+			long long int nSum = 0;
+			int nNum = 0;
+			for (int x = nSegStart[n]; x < nSegStart[n + 1]; x += nStep)
 			{
-				n++;
-				W = m_nBlockWeightMap[m][n];
-				x1 = 0;
+				unsigned short Y = pLine[x];
+				nSum += Y;
+				pHist[Y] += W;
+				nNum++;
 			}
-			pCFA++;
+			intMean += nSum * W;
+			nCount += (long long int)nNum * W;
 		}
-		y1++;
-		if (y1 == nWinH)
+	}
+	unsigned int *pHist = m_HistBuffer.GetImageLine(0);
+#pragma omp parallel for num_threads(nProcs)
+	for (int k = 0; k < nHistSize; k++)
+	{
+		for (int t = 1; t < nProcs; t++)
 		{
-			m++;
-			y1 = 0;
+			pHist[k] += m_HistBuffer.GetImageLine(t)[k];
 		}
 	}
-	fMean[0] = (double)intMean[0];
-	fMean[0] /= C[0];
+	fMean[0] = (nCount > 0) ? (double)intMean / nCount : 0;
 	printf("GRAY Mean:[%f]\n", fMean[0]);
 	if (fMean[0] < 0)fMean[0] = 0;
 	fMeanV = fMean[0];
 	if (fMeanV < 1.0)fMeanV = 1.0;
 	unsigned int nPs = 0;
-	unsigned int nThre1 = (C[0] * m_nHighLevelPtsPercent[0]) >> 16;//Ratio of histogram between 0 and X
-	unsigned int nThre2 = (C[0] * m_nHighLevelPtsPercent[1]) >> 16;//Ratio of histogram between 0 and X
+	unsigned int nThre1 = (nCount * m_nHighLevelPtsPercent[0]) >> 16;//Ratio of histogram between 0 and X
+	unsigned int nThre2 = (nCount * m_nHighLevelPtsPercent[1]) >> 16;//Ratio of histogram between 0 and X
 	if (nThre2 < nThre1)nThre2 = nThre1;
 	for (y = m_nMax - 1; y > 0; y--)
 	{
@@ -490,7 +913,6 @@ bool CHDRPlus_Tonemapping::EstimateDigiGain(MultiUshortImage *pInImage, TGlobalC
 		m_nHighLevelGain[1] = m_nHighLevelGain[0];
 	}
 	printf("HighLevel1=%d HighGain1=%d\n", y, m_nHighLevelGain[1]);
-	delete[] pHist;
 	int m_nMeanY;
 	if (m_bAutoDigiGainEnable == 1)
 	{
@@ -574,7 +996,6 @@ bool CHDRPlus_Tonemapping::Forward(MultiUshortImage *pInRGBImage,TGlobalControl
 	MultiUshortImage GrayImage;
 	MultiUshortImage DarkImage;
 	MultiUshortImage DarkGammaImage;
-	MultiUshortImage BrightImage;
 	MultiUshortImage BrightGammaImage;
 	MultiUshortImage DarkOutImage;
 	ConvertoGray(pInRGBImage, &GrayImage);
@@ -585,20 +1006,50 @@ bool CHDRPlus_Tonemapping::Forward(MultiUshortImage *pInRGBImage,TGlobalControl
 	float gain_const = 1.f + gain / m_nVirtualExposureNum;
 	float comp_slope = (comp - comp_const) / (float)(m_nVirtualExposureNum - 1);
 	float gain_slope = (gain - gain_const) / (float)(m_nVirtualExposureNum - 1);
-	DarkImage.Clone(&GrayImage);
-	for (int pass = 0; pass < m_nVirtualExposureNum; pass++)
-	{
-		//float norm_comp = (pass + 1) * comp_slope + 1.0;
-		//float norm_gain = (pass+1) * gain_slope + 1.0;
-		float norm_comp = pass * comp_slope + comp_const;//����
-		float norm_gain = pass * gain_slope + gain_const;//��С
-		printf("norm_comp=%f norm_gain=%f \n", norm_comp, norm_gain);
-		Brighten(&DarkImage, norm_comp, &BrightImage);
-		GrayGammaCorrect(&DarkImage, &DarkGammaImage);
-		GrayGammaCorrect(&BrightImage, &BrightGammaImage);
-		CombineDarkAndBrightImage(&DarkGammaImage, &BrightGammaImage, &DarkOutImage);
-		GammaInverse(&DarkOutImage, &DarkGammaImage);
-		Brighten(&DarkGammaImage, norm_gain, &DarkImage);
+	// 在缩小的灰度图上做融合,最后用导向滤波放大到原图
+	MultiUshortImage SmallGrayImage;
+	MultiUshortImage *pFuseGrayImage = &GrayImage;
+	if (m_nLowResScaleBit > 0)
+	{
+		if (!DownScaleGrayImage(&GrayImage, &SmallGrayImage, m_nLowResScaleBit))return false;
+		pFuseGrayImage = &SmallGrayImage;
+	}
+	if (m_bFastFusionEnable && m_nVirtualExposureNum < FAST_FUSION_MAX_EXPOSURE)
+	{
+		float *pNormComp = new float[m_nVirtualExposureNum + 1];
+		float *pNormGain = new float[m_nVirtualExposureNum + 1];
+		for (int pass = 0; pass < m_nVirtualExposureNum; pass++)
+		{
+			pNormComp[pass] = pass * comp_slope + comp_const;
+			pNormGain[pass] = pass * gain_slope + gain_const;
+		}
+		bool bRet = FuseVirtualExposures(pFuseGrayImage, pNormComp, pNormGain, m_nVirtualExposureNum, &DarkImage);
+		delete[] pNormComp;
+		delete[] pNormGain;
+		if (!bRet)return false;
+	}
+	else
+	{
+		DarkImage.Clone(pFuseGrayImage);
+		for (int pass = 0; pass < m_nVirtualExposureNum; pass++)
+		{
+			//float norm_comp = (pass + 1) * comp_slope + 1.0;
+			//float norm_gain = (pass+1) * gain_slope + 1.0;
+			float norm_comp = pass * comp_slope + comp_const;//����
+			float norm_gain = pass * gain_slope + gain_const;//��С
+			printf("norm_comp=%f norm_gain=%f \n", norm_comp, norm_gain);
+			// 提亮+gamma、逆gamma+增益各合成一张表,省掉中间的BrightImage和一次全图遍历
+			GrayGammaCorrect(&DarkImage, &DarkGammaImage);
+			ApplyToneLUT(&DarkImage, GetToneLUT(TONE_LUT_BRIGHTEN_GAMMA, norm_comp), &BrightGammaImage);
+			CombineDarkAndBrightImage(&DarkGammaImage, &BrightGammaImage, &DarkOutImage);
+			ApplyToneLUT(&DarkOutImage, GetToneLUT(TONE_LUT_INVERSE_BRIGHTEN, norm_gain), &DarkImage);
+		}
+	}
+	if (m_nLowResScaleBit > 0)
+	{
+		MultiUshortImage SmallDarkImage;
+		SmallDarkImage.SwapImage(&DarkImage);
+		if (!GuidedUpsampleDarkImage(&GrayImage, &SmallGrayImage, &SmallDarkImage, &DarkImage))return false;
 	}
 	MultiUshortImage GrayImage1;
 	//GrayImage1.Clone(&GrayImage);
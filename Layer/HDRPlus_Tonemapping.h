@@ -2,6 +2,18 @@
 #define __HDRPlus_Tonemapping_H_
 #include "../Mat/WeightConfig.h"
 #include "../Mat/MultiUshortImage.h"
+#define FAST_FUSION_MAX_EXPOSURE 12
+#define TONE_LUT_CACHE_SIZE 16
+#define TONE_PYRAMID_LEVEL 12
+// 16bit->16bit查找表类型,后两种为两次映射合成的一张表
+enum
+{
+	TONE_LUT_GAMMA = 0,
+	TONE_LUT_INVERSE,
+	TONE_LUT_BRIGHTEN,
+	TONE_LUT_BRIGHTEN_GAMMA,//gamma(clip(k*gain))
+	TONE_LUT_INVERSE_BRIGHTEN,//clip(invgamma(k)*gain)
+};
 class CHDRPlus_Tonemapping : public CSingleConfigTitleFILE
 {
 protected:
@@ -58,7 +70,33 @@ protected:
 			m_nSmoothYThreP[i] = 2048;
 			m_nSmoothYThreM[i] = 2048;
 		}
+		m_nConfigParamList.ConfigParamListAddVariable("bFastFusionEnable", &m_bFastFusionEnable, 0, 1);
+		m_bFastFusionEnable = 0;
+		m_nConfigParamList.ConfigParamListAddVariable("nLowResScaleBit", &m_nLowResScaleBit, 0, 3);
+		m_nLowResScaleBit = 0;
+		m_nConfigParamList.ConfigParamListAddVariable("nGuidedRadius", &m_nGuidedRadius, 1, 16);
+		m_nGuidedRadius = 2;
+		m_nConfigParamList.ConfigParamListAddVariable("nGuidedEps", &m_nGuidedEps, 0, 65535);
+		m_nGuidedEps = 128;
+		m_nConfigParamList.ConfigParamListAddVariable("nStatSubSampleBit", &m_nStatSubSampleBit, 0, 2);
+		m_nStatSubSampleBit = 0;
 	}
+	// 查找表缓存:gamma/逆gamma按m_nMin,m_nMax建一次,带增益的表按(类型,增益)缓存,跨迭代和多帧复用
+	CImageData_UINT16 m_GammaLUT;
+	CImageData_UINT16 m_InverseLUT;
+	CImageData_UINT16 m_ToneLUT[TONE_LUT_CACHE_SIZE];
+	int m_nToneLUTType[TONE_LUT_CACHE_SIZE];
+	float m_fToneLUTGain[TONE_LUT_CACHE_SIZE];
+	int m_nToneLUTNum;
+	int m_nToneLUTMin;
+	int m_nToneLUTMax;
+	CImage_FLOAT m_WeightLUT;
+	CImageData_UINT32 m_HistBuffer;
+	// CombineDarkAndBrightImage的金字塔和权重图,作为成员跨迭代和多帧复用,尺寸不变时不再从MemPool重新分配
+	MultiUshortImage m_DarkImagePyramid[TONE_PYRAMID_LEVEL + 1], m_BrightImagePyramid[TONE_PYRAMID_LEVEL + 1];
+	MultiUshortImage m_DarkWeightImagePyramid[TONE_PYRAMID_LEVEL + 1], m_BrightWeightImagePyramid[TONE_PYRAMID_LEVEL + 1];
+	MultiShortImage m_DarkImagePyramidEdge[TONE_PYRAMID_LEVEL + 1], m_BrightImagePyramidEdge[TONE_PYRAMID_LEVEL + 1];
+	MultiUshortImage m_DarkWeightImage, m_BrightWeightImage, m_PyramidTempImage;
 	virtual void CreateConfigTitleName()
 	{
 		strcpy(m_pConfigTitleName, "CHDRPlus_Tonemapping");
@@ -83,16 +121,33 @@ public:
 	int m_nDynamicCompression;
 	int m_nSmoothYThreP[13];
 	int m_nSmoothYThreM[13];
+	int m_bFastFusionEnable; // 一次融合所有虚拟曝光(各曝光真实金字塔),不是逐次融合的链式结果,局部对比度略有差别
+	int m_nLowResScaleBit;
+	int m_nGuidedRadius;
+	int m_nGuidedEps;
+	int m_nStatSubSampleBit;
 	CHDRPlus_Tonemapping()
 	{
 		Initialize();
+		m_nToneLUTNum = 0;
+		m_nToneLUTMin = -1;
+		m_nToneLUTMax = -1;
 	}
 	bool ConvertoGray(MultiUshortImage * pRGBImage, MultiUshortImage * pGrayImage);
 	bool Brighten(MultiUshortImage * pInDarkImage, float gain, MultiUshortImage * pOutBrightImage);
+	void BuildGammaTable(unsigned short * table);
+	void BuildGammaInverseTable(unsigned short * table);
+	const unsigned short *GetToneLUT(int nType, float fGain);
+	const float *GetWeightLUT();
+	bool ApplyToneLUT(MultiUshortImage * pInImage, const unsigned short * pTable, MultiUshortImage * pOutImage);
 	bool GrayGammaCorrect(MultiUshortImage * pInGrayImage, MultiUshortImage * pOutGammaImage);
 	bool GammaInverse(MultiUshortImage * pInGrayImage, MultiUshortImage * pOutInverseImage);
 	bool BuildWeight(MultiUshortImage * pDarkGammaImage, MultiUshortImage * pBrightGammaImage, MultiUshortImage * DarkWeightImage, MultiUshortImage * BrightWeightImage, int ScaleBit);
 	bool CombineDarkAndBrightImage(MultiUshortImage * pDarkGammaImage, MultiUshortImage * pBrightGammaImage, MultiUshortImage * pOutCombineImage);
+	bool FuseVirtualExposures(MultiUshortImage * pGrayImage, const float * pNormComp, const float * pNormGain, int nPassNum, MultiUshortImage * pOutImage);
+	bool DownScaleGrayImage(MultiUshortImage * pGrayImage, MultiUshortImage * pOutImage, int nScaleBit);
+	void BoxMeanImage(CImage_FLOAT * pInImage, CImage_FLOAT * pOutImage, int nRadius);
+	bool GuidedUpsampleDarkImage(MultiUshortImage * pGrayImage, MultiUshortImage * pSmallGrayImage, MultiUshortImage * pSmallDarkImage, MultiUshortImage * pOutImage);
 	void GammaCombinRGB(MultiUshortImage * pRGBImage, MultiUshortImage * pGrayImage, MultiUshortImage * pDarkImage);
 	bool BilateralSmoothYImagenew(MultiUshortImage * pInImage, MultiUshortImage * pOutImage, int nThreP, int nThreM, int nMaskThreP, int nMaskThreM);
 	bool SmoothGammaYImage(MultiUshortImage * pInImage, MultiUshortImage * pOutImage);
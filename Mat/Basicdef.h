@@ -58,6 +58,32 @@ android        __ANDROID__
 #define USE_NEON
 #define  USE_OPT
 #endif
+///////////////////////x86 runtime dispatch////////////////////////////
+#if !defined(USE_NEON) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_X86_DISPATCH
+#include <immintrin.h>
+#define X86_TARGET(isa) __attribute__((target(isa)))
+enum
+{
+	X86_SIMD_NONE = 0,
+	X86_SIMD_SSE41,
+	X86_SIMD_AVX2
+};
+inline int DetectX86SimdLevel()
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return X86_SIMD_AVX2;
+	if (__builtin_cpu_supports("sse4.1"))
+		return X86_SIMD_SSE41;
+	return X86_SIMD_NONE;
+}
+inline int GetX86SimdLevel()
+{
+	static const int nLevel = DetectX86SimdLevel();
+	return nLevel;
+}
+#endif
 
 #ifdef _WIN32
 #define ATTR_ALIGN(n)  __declspec(align(n))
@@ -7,6 +7,7 @@
 #include <cstdio>
 #include <cstdint>
 #include <cstring>
+#include <algorithm>
 
 #ifndef _WIN32
 #define BI_RGB 0L
@@ -102,6 +103,16 @@ public:
 		m_pImgData = NULL;
 		m_nSizeInBytes = m_nWidth = m_nHeight = m_nChannel = m_nSize = 0;
 	}
+	// 只交换数据指针和尺寸,不拷贝像素
+	void SwapImage(CMat<T> *pImage)
+	{
+		std::swap(m_nWidth, pImage->m_nWidth);
+		std::swap(m_nHeight, pImage->m_nHeight);
+		std::swap(m_nChannel, pImage->m_nChannel);
+		std::swap(m_nSize, pImage->m_nSize);
+		std::swap(m_pImgData, pImage->m_pImgData);
+		std::swap(m_nSizeInBytes, pImage->m_nSizeInBytes);
+	}
 	inline int GetImageWidth() { return m_nWidth; }
 	inline int GetImageHeight() { return m_nHeight; }
 	inline int GetImagePitch() { return m_nWidth * m_nChannel; }
@@ -184,10 +184,15 @@ bool MultiUshortImage::AddBackEdgeImage(MultiUshortImage *pInputImage, MultiShor
 	AddBackWordEdge(pInputImage->GetImageData(), pInputEdgeImage->GetImageData(), GetImageData(), nWidth, nHeight, nEdgeWidth, nEdgeHeight, nDim);
 	return true;
 }
-bool MultiUshortImage::GaussPyramidImage(MultiUshortImage *pOutPyramid, MultiShortImage *pOutEdgePyramid, int &nPyramidLevel, bool SaveEdge)
+// pTempImage由调用者持有时,各层的扩边和上采样都复用它,不再每次从MemPool分配
+bool MultiUshortImage::GaussPyramidImage(MultiUshortImage *pOutPyramid, MultiShortImage *pOutEdgePyramid, int &nPyramidLevel, bool SaveEdge, MultiUshortImage *pTempImage)
 {
 	int nWidth[12], nHeight[12];
-	MultiUshortImage TempImage;
+	MultiUshortImage LocalTempImage;
+	if (pTempImage == NULL)
+	{
+		pTempImage = &LocalTempImage;
+	}
 	printf("input nPyramidLevel=%d\n", nPyramidLevel);
 	pOutPyramid[0].Clone(this);
 	for (int i = 0; i < nPyramidLevel; i++)
@@ -203,18 +208,17 @@ bool MultiUshortImage::GaussPyramidImage(MultiUshortImage *pOutPyramid, MultiSho
 		}
 		if ((nWidth[i] & 1) == 1 || (nHeight[i] & 1) == 1)
 		{
-			MultiUshortImage tmpExtendImage;
-			if (!pOutPyramid[i].Extend2Image(&pOutPyramid[i], &tmpExtendImage, 1))
+			if (!pOutPyramid[i].Extend2Image(&pOutPyramid[i], pTempImage, 1))
 				return false;
-			pOutPyramid[i].Clone(&tmpExtendImage);
+			pOutPyramid[i].Clone(pTempImage);
 		}
 		if (!pOutPyramid[i].DownScaleImagex2(&pOutPyramid[i + 1], false))
 			return false;
 		if (SaveEdge == true)
 		{
-			if (!pOutPyramid[i + 1].UpScaleImagex2(&TempImage, false))
+			if (!pOutPyramid[i + 1].UpScaleImagex2(pTempImage, false))
 				return false;
-			if (!pOutPyramid[i].SubtractEdgeImage(&TempImage, pOutEdgePyramid + i))
+			if (!pOutPyramid[i].SubtractEdgeImage(pTempImage, pOutEdgePyramid + i))
 				return false;
 		}
 	}
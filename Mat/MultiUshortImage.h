@@ -30,7 +30,7 @@ public:
 	int  GetRAWStride(int width, int nMIPIRAW = 0);
 	bool SubtractEdgeImage(MultiUshortImage * pInImage, MultiShortImage * pOutImage);
 	bool AddBackEdgeImage(MultiUshortImage * pInputImage, MultiShortImage * pInputEdgeImage);
-	bool GaussPyramidImage(MultiUshortImage * pOutPyramid, MultiShortImage * pOutEdgePyramid, int & nPyramidLevel, bool SaveEdge);
+	bool GaussPyramidImage(MultiUshortImage * pOutPyramid, MultiShortImage * pOutEdgePyramid, int & nPyramidLevel, bool SaveEdge, MultiUshortImage * pTempImage = NULL);
 	bool ApplyWeight(MultiUshortImage *pWeightImage, int ScaleBit);
 	bool FuseDiffImageWeight(MultiUshortImage * pRefImage, MultiUshortImage * pWeightImage, int ScaleBit);
 	bool AddImage(MultiUshortImage * pRefImage);